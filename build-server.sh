@@ -0,0 +1 @@
+clang++ -O2 -g -std=c++17 -stdlib=libc++ -pthread src/lexer.cpp src/parser.cpp src/codegen.cpp src/columns.cpp src/output.cpp src/instance.cpp src/snapshot.cpp src/type_infer.cpp src/time_report.cpp src/perf_counters.cpp src/sampler.cpp src/expr_cache.cpp src/parallel_parse.cpp src/session.cpp src/protocol.cpp src/server_main.cpp `/usr/local/opt/llvm/bin/llvm-config --cppflags --ldflags --system-libs --libs core orcjit native ipo bitreader bitwriter` -o ksc-server.app
\ No newline at end of file
@@ -13,25 +13,51 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "SlabMemoryManager.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/iterator_range.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Object/SymbolSize.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <algorithm>
-#include <map>
-#include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace llvm {
@@ -42,43 +68,903 @@ public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
-  KaleidoscopeJIT()
-      : Resolver(createLegacyLookupResolver(
-            ES,
-            [this](StringRef Name) {
-              return findMangledSymbol(std::string(Name));
-            },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+  /// Tiered mode: modules added through addTieredModule are compiled at -O0
+  /// with entry and back-edge counters, and every function is called through
+  /// an indirect stub. Once a counter reaches its threshold the function is
+  /// recompiled with the full pipeline on a background thread and its stub
+  /// is repointed to the optimized code.
+  struct TieringOptions {
+    bool Enabled = false;
+    uint64_t CallThreshold = 1000;
+    uint64_t BackEdgeThreshold = 10000;
+  };
+
+  /// Counters and tier of a function added through addTieredModule.
+  struct FunctionTierStats {
+    std::string Name;
+    uint64_t Calls;
+    uint64_t BackEdges;
+    unsigned Tier;
+  };
+
+  /// A function recompiled by the optimizing tier.
+  struct TierUpEvent {
+    std::string Name;
+    uint64_t Calls;
+    uint64_t BackEdges;
+    double CompileMillis;
+  };
+
+  /// Make JIT'd code visible to external tools. Frame pointers are kept in
+  /// JIT'd code whenever one of these is enabled.
+  struct ProfilingOptions {
+    /// Append "<start> <size> <name>" lines to /tmp/perf-<pid>.map, which
+    /// `perf report` reads to symbolize JIT'd addresses.
+    bool PerfMap = false;
+    /// Emit a jitdump file for `perf inject --jit`. Only available if LLVM
+    /// was built with LLVM_USE_PERF.
+    bool PerfJITDump = false;
+    /// Register objects with the GDB JIT interface.
+    bool GDBRegistration = false;
+    /// Keep the address range of every JIT'd function, for findFunctionName,
+    /// so that an in-process sampler can name the frames it walks.
+    bool Sampling = false;
+  };
+
+  KaleidoscopeJIT() : KaleidoscopeJIT(TieringOptions()) {}
+
+  KaleidoscopeJIT(TieringOptions Opts)
+      : KaleidoscopeJIT(Opts, ProfilingOptions()) {}
+
+  KaleidoscopeJIT(TieringOptions Opts, ProfilingOptions ProfOpts)
+      : TM(EngineBuilder()
+               .setOptLevel(Opts.Enabled ? CodeGenOpt::None
+                                         : CodeGenOpt::Default)
+               .selectTarget()),
+        DL(TM->createDataLayout()),
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                    [this](VModuleKey) {
-                      return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                    [this](VModuleKey K) {
+                      std::shared_ptr<RuntimeDyld::MemoryManager> MemMgr;
+                      if (Slabs)
+                        MemMgr = std::make_shared<SlabMemoryManager>(Slabs);
+                      else
+                        MemMgr = std::make_shared<SectionMemoryManager>();
+                      return ObjLayerT::Resources{std::move(MemMgr),
+                                                  createResolver(K)};
+                    },
+                    ObjLayerT::NotifyLoadedFtor(),
+                    [this](VModuleKey K, const object::ObjectFile &Obj,
+                           const RuntimeDyld::LoadedObjectInfo &Info) {
+                      notifyObjectFinalized(K, Obj, Info);
+                    },
+                    [this](VModuleKey K, const object::ObjectFile &) {
+                      for (JITEventListener *L : EventListeners)
+                        L->notifyFreeingObject(K);
                     }),
         CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
+                     SimpleCompiler(*TM)),
+        Profiling(ProfOpts), Tiering(Opts) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    Slabs = SlabAllocator::create();
+
+    if (Profiling.GDBRegistration)
+      EventListeners.push_back(
+          JITEventListener::createGDBRegistrationListener());
+    if (Profiling.PerfJITDump) {
+      if (auto *L = JITEventListener::createPerfJITEventListener())
+        EventListeners.push_back(L);
+      else
+        errs() << "perf jitdump is not supported by this LLVM build\n";
+    }
+    if (Profiling.PerfMap) {
+      std::string Path =
+          "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+      std::error_code EC;
+      PerfMap = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+      if (EC) {
+        errs() << "cannot open " << Path << ": " << EC.message() << "\n";
+        PerfMap.reset();
+      }
+    }
+
+    CompileCallbackMgr = cantFail(
+        createLocalCompileCallbackManager(TM->getTargetTriple(), ES, 0));
+    IndirectStubsMgr =
+        createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())();
+    if (Tiering.Enabled)
+      TierUpThread = std::thread([this]() { runTierUpWorker(); });
+  }
+
+  ~KaleidoscopeJIT() {
+    if (TierUpThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> Lock(TierUpQueueMutex);
+        StopTierUp = true;
+      }
+      TierUpQueueCV.notify_all();
+      TierUpThread.join();
+    }
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  bool isTieringEnabled() const { return Tiering.Enabled; }
+
+  bool isProfilingEnabled() const {
+    return Profiling.PerfMap || Profiling.PerfJITDump ||
+           Profiling.GDBRegistration || Profiling.Sampling;
+  }
+
+  bool isSamplingEnabled() const { return Profiling.Sampling; }
+
+  /// Name of the JIT'd function whose code contains Addr, as it appears in
+  /// the perf map, or an empty string. The code of a removed module keeps
+  /// its name until other code is loaded at its address, so that samples
+  /// taken while it ran can still be named after it is gone.
+  std::string findFunctionName(JITTargetAddress Addr) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto It = FunctionRanges.upper_bound(Addr);
+    if (It == FunctionRanges.begin())
+      return "";
+    --It;
+    if (Addr - It->first >= It->second.Size)
+      return "";
+    return It->second.Name;
+  }
+
+  /// Keeps the code reachable when it was taken in memory: a module retired
+  /// while the pin is held is only removed by the first module added after
+  /// it is dropped. Hold one while JIT'd code may run, or a function address
+  /// is kept, on another thread than the one adding modules. It must not
+  /// outlive the JIT.
+  class CodePin {
+  public:
+    CodePin(CodePin &&Other) : JIT(Other.JIT), Epoch(Other.Epoch) {
+      Other.JIT = nullptr;
+    }
+    CodePin(const CodePin &) = delete;
+    CodePin &operator=(const CodePin &) = delete;
+    ~CodePin() {
+      if (JIT)
+        JIT->unpinCode(Epoch);
+    }
+
+  private:
+    friend class KaleidoscopeJIT;
+    CodePin(KaleidoscopeJIT &JIT, uint64_t Epoch) : JIT(&JIT), Epoch(Epoch) {}
+
+    KaleidoscopeJIT *JIT;
+    uint64_t Epoch;
+  };
+
+  /// Does not take the JIT lock, so it can be taken while code is compiled.
+  CodePin pinCode() {
+    std::lock_guard<std::mutex> Lock(PinMutex);
+    ++Pins[CurrentEpoch];
+    return CodePin(*this, CurrentEpoch);
+  }
+
+  /// The JIT and the LLVMContext of the modules added to it are shared with
+  /// the tier-up thread. Hold this lock while generating IR or calling into
+  /// the JIT, but not while running JIT'd code.
+  std::unique_lock<std::recursive_mutex> acquireLock() {
+    return std::unique_lock<std::recursive_mutex>(JITMutex);
+  }
+
+  /// Add a module. Functions it defines supersede earlier definitions with
+  /// the same name, and a module left without live functions is removed as
+  /// soon as no other module's code is linked against it, nor pinned.
   VModuleKey addModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto K = registerModule(std::move(M));
+    retireSupersededModules();
+    return K;
+  }
+
+  /// Add a module of long-lived function definitions. Every call to them,
+  /// from modules added before or after, goes through an indirect stub: a
+  /// redefinition compiles the new body and repoints the stub, the callers
+  /// are not recompiled.
+  VModuleKey addTieredModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+
+    // Rename every body to "<name>$impl", and route calls through the stub
+    // which keeps the original name. Without tiering a body calls itself
+    // directly, since only the calls entering it must see a redefinition.
+    std::vector<Function *> Bodies;
+    for (Function &F : *M)
+      if (!F.isDeclaration())
+        Bodies.push_back(&F);
+    for (Function *F : Bodies) {
+      std::string Name = F->getName().str();
+      F->setName(Name + "$impl");
+      Function *Decl = Function::Create(
+          F->getFunctionType(), Function::ExternalLinkage, Name, M.get());
+      if (Tiering.Enabled)
+        F->replaceAllUsesWith(Decl);
+      else
+        F->replaceUsesWithIf(Decl, [F](Use &U) {
+          auto *I = dyn_cast<Instruction>(U.getUser());
+          return !I || I->getFunction() != F;
+        });
+    }
+
+    // Keep the uninstrumented IR for the optimizing tier.
+    std::shared_ptr<SmallVector<char, 0>> Bitcode;
+    if (Tiering.Enabled) {
+      Bitcode = std::make_shared<SmallVector<char, 0>>();
+      raw_svector_ostream BitcodeStream(*Bitcode);
+      WriteBitcodeToFile(*M, BitcodeStream);
+    }
+
+    std::vector<std::shared_ptr<TieredFunction>> Added;
+    for (Function *F : Bodies) {
+      std::string Name = F->getName().drop_back(5).str();
+      auto Fn = std::make_shared<TieredFunction>(*this);
+      Fn->Name = Name;
+      Fn->Bitcode = Bitcode;
+      if (auto Prev = LatestTieredFunction.find(Name);
+          Prev != LatestTieredFunction.end())
+        Prev->second->Superseded = true;
+      LatestTieredFunction[Name] = Fn.get();
+      if (Tiering.Enabled)
+        instrumentFunction(*F, *Fn);
+      Added.push_back(Fn);
+    }
+
+    auto K = registerModule(std::move(M));
+
+    // Bodies are linked lazily: the stub first points to a compile callback,
+    // so the module can reference symbols added after it. Callers are linked
+    // against the stub, so a redefinition repoints it rather than adding one.
+    // A callback binds to the newest body when it is first called, so one
+    // which has not been called yet serves the redefinition too: callbacks
+    // cannot be released, only the called ones add up.
+    for (auto &Fn : Added) {
+      Fn->Key = K;
+      auto Pending = PendingCallbacks.find(Fn->Name);
+      if (Pending == PendingCallbacks.end()) {
+        auto CCAddr = cantFail(CompileCallbackMgr->getCompileCallback(
+            [this, Name = Fn->Name]() { return materializeBaseline(Name); }));
+        Pending = PendingCallbacks.emplace(Fn->Name, CCAddr).first;
+      }
+      std::string StubName = mangle(Fn->Name);
+      if (IndirectStubsMgr->findStub(StubName, false))
+        cantFail(IndirectStubsMgr->updatePointer(StubName, Pending->second));
+      else
+        cantFail(IndirectStubsMgr->createStub(StubName, Pending->second,
+                                              JITSymbolFlags::Exported));
+    }
+    Modules[K].TieredFunctions = std::move(Added);
+
+    // The superseded bodies are unreachable from now on.
+    retireSupersededModules();
+    return K;
+  }
+
+  /// Add a module of batch entry points, i.e. loops over arrays. It is
+  /// optimized with the full pipeline, vectorizers included, and compiled
+  /// for the host CPU, so loops use the vector width it is best at (e.g.
+  /// <4 x double> with AVX2). Functions with local linkage are not tracked
+  /// for redefinition.
+  VModuleKey addVectorizedModule(std::unique_ptr<Module> M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    if (!HostTM) {
+      StringMap<bool> HostFeatures;
+      std::vector<std::string> Features;
+      if (sys::getHostCPUFeatures(HostFeatures))
+        for (auto &Feature : HostFeatures)
+          Features.push_back((Feature.second ? "+" : "-") +
+                             Feature.first().str());
+      HostTM.reset(EngineBuilder()
+                       .setOptLevel(CodeGenOpt::Aggressive)
+                       .setMCPU(sys::getHostCPUName())
+                       .setMAttrs(Features)
+                       .selectTarget());
+    }
+
+    optimizeModule(*M, *HostTM);
+    if (isProfilingEnabled())
+      keepFramePointers(*M);
     auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
+    trackDefinitions(K, *M);
+    Modules[K].HostSpecific = true;
+    cantFail(ObjectLayer.addObject(K, cantFail(SimpleCompiler(*HostTM)(*M))));
     ModuleKeys.push_back(K);
+
+    retireSupersededModules();
     return K;
   }
 
+  /// Compile a module to an object file without adding it. Modules may be
+  /// compiled by one JIT per thread, and their objects added to a single one.
+  Expected<std::unique_ptr<MemoryBuffer>> compileModule(Module &M) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    if (isProfilingEnabled())
+      keepFramePointers(M);
+    return SimpleCompiler(*TM)(M);
+  }
+
+  /// Add an object file. Its symbols are found like those of modules, and it
+  /// is never retired since its functions are not known.
+  VModuleKey addObject(std::unique_ptr<MemoryBuffer> Obj) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto K = ES.allocateVModule();
+    Modules[K].DefinesData = true;
+    if (KeepObjects)
+      Modules[K].Object = MemoryBuffer::getMemBufferCopy(
+          Obj->getBuffer(), Obj->getBufferIdentifier());
+    cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    ModuleKeys.push_back(K);
+    return K;
+  }
+
+  /// Remove a module right away. Its code must not be running, and no other
+  /// module should be linked against it. A module defining globals stays,
+  /// since later modules refer to them.
   void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    if (!Modules[K].DefinesData)
+      releaseModule(K);
+    retireSupersededModules();
+  }
+
+  /// Keep a copy of the object of every module added from now on, for
+  /// getObjects. Turn it on before adding anything.
+  void keepObjects() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    KeepObjects = true;
+  }
+
+  /// Objects of the live modules, in the order they were added, but those
+  /// compiled for the host CPU by addVectorizedModule. Together with
+  /// getStubbedFunctions they can be added to a JIT for the same target by
+  /// addSavedObjects. Fails if a live module was added before keepObjects.
+  Expected<std::vector<MemoryBufferRef>> getObjects() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    std::vector<MemoryBufferRef> Objects;
+    for (VModuleKey K : ModuleKeys) {
+      ModuleInfo &Info = Modules[K];
+      if (Info.HostSpecific)
+        continue;
+      if (!Info.Object)
+        return make_error<StringError>("objects are not kept",
+                                       inconvertibleErrorCode());
+      Objects.push_back(Info.Object->getMemBufferRef());
+    }
+    return Objects;
+  }
+
+  /// Names of the functions called through indirect stubs.
+  std::vector<std::string> getStubbedFunctions() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    std::set<std::string> Names(SavedFunctions.begin(), SavedFunctions.end());
+    for (auto &Latest : LatestTieredFunction)
+      Names.insert(Latest.first);
+    return std::vector<std::string>(Names.begin(), Names.end());
+  }
+
+  /// Add the objects and stubbed functions saved from another JIT. The
+  /// objects are not copied, so their memory must outlive this JIT. Every
+  /// function gets a stub, bound to the newest "<name>$impl" on first call,
+  /// so the objects are only linked as their code is reached.
+  void addSavedObjects(ArrayRef<MemoryBufferRef> Objects,
+                       ArrayRef<std::string> Functions) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    for (MemoryBufferRef Obj : Objects)
+      addObject(MemoryBuffer::getMemBuffer(Obj, false));
+    for (const std::string &Name : Functions) {
+      SavedFunctions.insert(Name);
+      auto CCAddr = cantFail(CompileCallbackMgr->getCompileCallback(
+          [this, Name]() { return materializeSaved(Name); }));
+      std::string StubName = mangle(Name);
+      if (IndirectStubsMgr->findStub(StubName, false))
+        cantFail(IndirectStubsMgr->updatePointer(StubName, CCAddr));
+      else
+        cantFail(IndirectStubsMgr->createStub(StubName, CCAddr,
+                                              JITSymbolFlags::Exported));
+    }
+  }
+
+  /// Resolve Name to Addr in the code added from now on, ahead of the
+  /// modules and the host process, e.g. for data the host keeps per JIT.
+  void defineAbsoluteSymbol(const std::string &Name, JITTargetAddress Addr) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    AbsoluteSymbols[mangle(Name)] = Addr;
+  }
+
+  /// Usage of the slabs holding the code and data of the live modules. None
+  /// where code cannot be mapped twice, every module then has its own pages.
+  Optional<SlabAllocator::Stats> getMemoryStats() {
+    if (!Slabs)
+      return None;
+    return Slabs->getStats();
+  }
+
+  /// Number of modules removed because all of their functions were redefined.
+  uint64_t getRetiredModuleCount() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    return RetiredModules;
   }
 
   JITSymbol findSymbol(const std::string Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
     return findMangledSymbol(mangle(Name));
   }
 
+  /// Look up and materialize a symbol under the JIT lock.
+  JITTargetAddress getSymbolAddress(const std::string Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    return cantFail(findMangledSymbol(mangle(Name)).getAddress());
+  }
+
+  std::vector<FunctionTierStats> getTierStats() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    std::vector<FunctionTierStats> Stats;
+    if (!Tiering.Enabled)
+      return Stats;
+    for (auto &Info : Modules)
+      for (auto &Fn : Info.second.TieredFunctions)
+        Stats.push_back({Fn->Name, Fn->Calls.load(std::memory_order_relaxed),
+                         Fn->BackEdges.load(std::memory_order_relaxed),
+                         Fn->Tier.load()});
+    return Stats;
+  }
+
+  std::vector<TierUpEvent> getTierUpEvents() {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    return TierUpEvents;
+  }
+
+  /// Block until every requested tier-up has been installed.
+  void waitForTierUps() {
+    std::unique_lock<std::mutex> Lock(TierUpQueueMutex);
+    TierUpIdleCV.wait(Lock,
+                      [this]() { return TierUpQueue.empty() && !TierUpBusy; });
+  }
+
 private:
+  void unpinCode(uint64_t Epoch) {
+    std::lock_guard<std::mutex> Lock(PinMutex);
+    auto Pin = Pins.find(Epoch);
+    if (--Pin->second == 0)
+      Pins.erase(Pin);
+  }
+
+  /// Start a new epoch, and return the one ending: pins taken from now on
+  /// cannot reach code which has become unreachable until then.
+  uint64_t advanceEpoch() {
+    std::lock_guard<std::mutex> Lock(PinMutex);
+    return CurrentEpoch++;
+  }
+
+  /// Whether a pin taken at Epoch or before is held.
+  bool isPinnedSince(uint64_t Epoch) {
+    std::lock_guard<std::mutex> Lock(PinMutex);
+    return !Pins.empty() && Pins.begin()->first <= Epoch;
+  }
+
+  /// Add a module without retiring the modules it supersedes.
+  VModuleKey registerModule(std::unique_ptr<Module> M) {
+    if (isProfilingEnabled())
+      keepFramePointers(*M);
+    auto K = ES.allocateVModule();
+    trackDefinitions(K, *M);
+    if (KeepObjects) {
+      // Compile it here rather than in the compile layer, to keep a copy.
+      auto Obj = cantFail(SimpleCompiler(*TM)(*M));
+      Modules[K].Object = MemoryBuffer::getMemBufferCopy(
+          Obj->getBuffer(), Obj->getBufferIdentifier());
+      cantFail(ObjectLayer.addObject(K, std::move(Obj)));
+    } else {
+      cantFail(CompileLayer.addModule(K, std::move(M)));
+    }
+    ModuleKeys.push_back(K);
+    return K;
+  }
+
+  /// Record the functions and data module K defines, the functions it
+  /// redefines lose their owner.
+  void trackDefinitions(VModuleKey K, Module &M) {
+    ModuleInfo &Info = Modules[K];
+    for (Function &F : M)
+      if (!F.isDeclaration() && !F.hasLocalLinkage()) {
+        std::string Name = mangle(F.getName().str());
+        auto Owner = FunctionOwners.find(Name);
+        if (Owner != FunctionOwners.end())
+          --Modules[Owner->second].LiveFunctions;
+        FunctionOwners[Name] = K;
+        ++Info.LiveFunctions;
+      }
+    // Globals cannot be redefined, their module stays.
+    for (GlobalVariable &GV : M.globals())
+      if (!GV.isDeclaration())
+        Info.DefinesData = true;
+  }
+
+  struct TieredFunction;
+
+  /// Bookkeeping for the retirement of superseded modules.
+  struct ModuleInfo {
+    /// Functions of this module which have not been redefined since.
+    unsigned LiveFunctions = 0;
+    bool DefinesData = false;
+    /// Modules whose symbols this module's code is linked against.
+    std::set<VModuleKey> Dependencies;
+    /// Number of modules linked against this one.
+    unsigned Dependents = 0;
+    /// Compiled for the host CPU rather than the target of TM.
+    bool HostSpecific = false;
+    /// Copy of the object, when keepObjects is on.
+    std::unique_ptr<MemoryBuffer> Object;
+    /// Bodies added by addTieredModule, freed with the module.
+    std::vector<std::shared_ptr<TieredFunction>> TieredFunctions;
+    /// Epoch during which it became unreachable, once it has.
+    Optional<uint64_t> UnreachableAt;
+  };
+
+  std::shared_ptr<SymbolResolver> createResolver(VModuleKey K) {
+    return createLegacyLookupResolver(
+        ES,
+        [this, K](StringRef Name) {
+          // Left as is for stubs and host symbols.
+          VModuleKey Definer = K;
+          JITSymbol Sym = findMangledSymbol(std::string(Name), &Definer);
+          if (Sym && Definer != K)
+            recordDependency(K, Definer);
+          return Sym;
+        },
+        [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); });
+  }
+
+  void recordDependency(VModuleKey K, VModuleKey Definer) {
+    // Objects of the optimizing tier are not tracked.
+    auto Info = Modules.find(K);
+    if (Info == Modules.end())
+      return;
+    if (Info->second.Dependencies.insert(Definer).second)
+      ++Modules[Definer].Dependents;
+  }
+
+  void releaseModule(VModuleKey K) {
+    ModuleKeys.erase(find(ModuleKeys, K));
+    cantFail(CompileLayer.removeModule(K));
+
+    for (VModuleKey Definer : Modules[K].Dependencies)
+      --Modules[Definer].Dependents;
+    for (auto It = FunctionOwners.begin(); It != FunctionOwners.end();)
+      It = It->second == K ? FunctionOwners.erase(It) : std::next(It);
+
+    // The tier-up thread keeps the function it is recompiling alive, and
+    // drops it once it sees it superseded. Its optimized object goes with it.
+    for (auto &Fn : Modules[K].TieredFunctions) {
+      Fn->Superseded = true;
+      if (Fn->OptimizedKey)
+        cantFail(ObjectLayer.removeObject(*Fn->OptimizedKey));
+      auto Latest = LatestTieredFunction.find(Fn->Name);
+      if (Latest != LatestTieredFunction.end() && Latest->second == Fn.get())
+        LatestTieredFunction.erase(Latest);
+    }
+    {
+      std::lock_guard<std::mutex> Lock(TierUpQueueMutex);
+      TierUpQueue.erase(
+          remove_if(TierUpQueue, [K](auto &Fn) { return Fn->Key == K; }),
+          TierUpQueue.end());
+    }
+    Modules.erase(K);
+  }
+
+  /// Remove every module whose functions have all been redefined, and which
+  /// no other module's code is linked against. Removing one may release
+  /// others, so repeat until nothing changes. One stays while a pin taken
+  /// before it became unreachable is held, its code may be running.
+  ///
+  /// In tiered mode a redefinition repoints the stub away from both tiers of
+  /// the superseded body, which then go together. The optimized object links
+  /// against what the baseline module was linked against, whose dependencies
+  /// keep those modules alive.
+  void retireSupersededModules() {
+    bool Retired = true;
+    while (Retired) {
+      Retired = false;
+      for (VModuleKey K : ModuleKeys) {
+        ModuleInfo &Info = Modules[K];
+        if (Info.LiveFunctions != 0 || Info.DefinesData || Info.Dependents != 0)
+          continue;
+        if (!Info.UnreachableAt)
+          Info.UnreachableAt = advanceEpoch();
+        if (isPinnedSince(*Info.UnreachableAt))
+          continue;
+        releaseModule(K);
+        ++RetiredModules;
+        Retired = true;
+        break;
+      }
+    }
+  }
+
+  /// A body added through addTieredModule, called through the stub of its
+  /// name. Counters and tiers are only used in tiered mode.
+  struct TieredFunction : std::enable_shared_from_this<TieredFunction> {
+    TieredFunction(KaleidoscopeJIT &JIT) : JIT(JIT) {}
+
+    KaleidoscopeJIT &JIT;
+    std::string Name;
+    VModuleKey Key = 0;
+    std::shared_ptr<SmallVector<char, 0>> Bitcode;
+    // Incremented by the baseline code with monotonic atomicrmw.
+    std::atomic<uint64_t> Calls{0};
+    std::atomic<uint64_t> BackEdges{0};
+    std::atomic<unsigned> Tier{0};
+    std::atomic<bool> TierUpRequested{false};
+    bool Superseded = false;
+    /// The object of the optimizing tier, removed with the baseline module.
+    Optional<VModuleKey> OptimizedKey;
+  };
+
+  /// Called from baseline code when a counter reaches its threshold.
+  static void requestTierUp(uint64_t FnAddr) {
+    auto &Fn = *reinterpret_cast<TieredFunction *>(FnAddr);
+    // Both counters may reach their threshold.
+    if (Fn.TierUpRequested.exchange(true))
+      return;
+    {
+      std::lock_guard<std::mutex> Lock(Fn.JIT.TierUpQueueMutex);
+      Fn.JIT.TierUpQueue.push_back(Fn.shared_from_this());
+    }
+    Fn.JIT.TierUpQueueCV.notify_one();
+  }
+
+  /// Count entries of F, and entries of every block a back edge targets.
+  void instrumentFunction(Function &F, TieredFunction &Fn) {
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> BackEdges;
+    FindFunctionBackedges(F, BackEdges);
+    std::vector<BasicBlock *> LoopHeaders;
+    for (auto &Edge : BackEdges)
+      if (!is_contained(LoopHeaders, Edge.second))
+        LoopHeaders.push_back(const_cast<BasicBlock *>(Edge.second));
+
+    // Allocas stay in the entry block, ahead of the counter.
+    Instruction *EntryPt = &*F.getEntryBlock().getFirstInsertionPt();
+    while (isa<AllocaInst>(EntryPt))
+      EntryPt = EntryPt->getNextNode();
+    insertCounter(EntryPt, Fn.Calls, Tiering.CallThreshold, Fn);
+
+    for (BasicBlock *Header : LoopHeaders)
+      insertCounter(&*Header->getFirstInsertionPt(), Fn.BackEdges,
+                    Tiering.BackEdgeThreshold, Fn);
+  }
+
+  void insertCounter(Instruction *InsertPt, std::atomic<uint64_t> &Counter,
+                     uint64_t Threshold, TieredFunction &Fn) {
+    IRBuilder<> B(InsertPt);
+    Type *Int64Ty = B.getInt64Ty();
+    Constant *CounterPtr = ConstantExpr::getIntToPtr(
+        B.getInt64(reinterpret_cast<uint64_t>(&Counter)),
+        Int64Ty->getPointerTo());
+    // The counter is a std::atomic read by the JIT while the code runs, maybe
+    // on several threads: no increment is lost, and no ordering is needed.
+    Value *Count = B.CreateAdd(
+        B.CreateAtomicRMW(AtomicRMWInst::Add, CounterPtr, B.getInt64(1),
+                          AtomicOrdering::Monotonic),
+        B.getInt64(1));
+
+    // Only the increment which hits the threshold calls back into the JIT.
+    Value *IsHot = B.CreateICmpEQ(Count, B.getInt64(Threshold));
+    Instruction *Then = SplitBlockAndInsertIfThen(IsHot, InsertPt, false);
+    B.SetInsertPoint(Then);
+    FunctionType *CallbackTy =
+        FunctionType::get(B.getVoidTy(), {Int64Ty}, false);
+    Constant *Callback = ConstantExpr::getIntToPtr(
+        B.getInt64(reinterpret_cast<uint64_t>(&requestTierUp)),
+        CallbackTy->getPointerTo());
+    B.CreateCall(CallbackTy, Callback,
+                 {B.getInt64(reinterpret_cast<uint64_t>(&Fn))});
+  }
+
+  /// First call through the stub: link the newest body of Name (the
+  /// baseline tier when tiering) and bind to it.
+  JITTargetAddress materializeBaseline(const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    PendingCallbacks.erase(Name);
+    TieredFunction &Fn = *LatestTieredFunction.at(Name);
+    auto Sym = CompileLayer.findSymbolIn(Fn.Key, mangle(Name + "$impl"), true);
+    JITTargetAddress Addr = cantFail(Sym.getAddress());
+    if (Fn.Tier == 0)
+      cantFail(IndirectStubsMgr->updatePointer(mangle(Name), Addr));
+    return Addr;
+  }
+
+  /// First call through the stub of a function added by addSavedObjects.
+  JITTargetAddress materializeSaved(const std::string &Name) {
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    JITTargetAddress Addr =
+        cantFail(findMangledSymbol(mangle(Name + "$impl")).getAddress());
+    // Unless it has been redefined meanwhile.
+    if (!LatestTieredFunction.count(Name))
+      cantFail(IndirectStubsMgr->updatePointer(mangle(Name), Addr));
+    return Addr;
+  }
+
+  void runTierUpWorker() {
+    // The optimizing tier has its own TargetMachine; modules are rebuilt
+    // from bitcode in a private LLVMContext, so IR generation on the main
+    // thread can go on meanwhile.
+    std::unique_ptr<TargetMachine> OptTM(
+        EngineBuilder().setOptLevel(CodeGenOpt::Aggressive).selectTarget());
+
+    while (true) {
+      std::shared_ptr<TieredFunction> Fn;
+      {
+        std::unique_lock<std::mutex> Lock(TierUpQueueMutex);
+        TierUpQueueCV.wait(
+            Lock, [this]() { return StopTierUp || !TierUpQueue.empty(); });
+        if (StopTierUp)
+          return;
+        Fn = TierUpQueue.front();
+        TierUpQueue.pop_front();
+        TierUpBusy = true;
+      }
+
+      tierUp(*Fn, *OptTM);
+
+      {
+        std::lock_guard<std::mutex> Lock(TierUpQueueMutex);
+        TierUpBusy = false;
+      }
+      TierUpIdleCV.notify_all();
+    }
+  }
+
+  void tierUp(TieredFunction &Fn, TargetMachine &OptTM) {
+    auto Start = std::chrono::steady_clock::now();
+
+    LLVMContext Ctx;
+    StringRef Bitcode(Fn.Bitcode->data(), Fn.Bitcode->size());
+    auto M = parseBitcodeFile(MemoryBufferRef(Bitcode, Fn.Name), Ctx);
+    if (!M) {
+      logAllUnhandledErrors(M.takeError(), errs(), "tier-up failed: ");
+      return;
+    }
+
+    // Keep only this body, everything else resolves to the live definitions.
+    std::string ImplName = Fn.Name + "$impl";
+    for (Function &F : **M)
+      if (!F.isDeclaration() && F.getName() != ImplName)
+        F.deleteBody();
+    for (GlobalVariable &GV : (*M)->globals())
+      if (!GV.isDeclaration()) {
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setInitializer(nullptr);
+      }
+    std::string OptName = Fn.Name + "$opt";
+    (*M)->getFunction(ImplName)->setName(OptName);
+
+    optimizeModule(**M, OptTM);
+    if (isProfilingEnabled())
+      keepFramePointers(**M);
+    auto Obj = SimpleCompiler(OptTM)(**M);
+    if (!Obj) {
+      logAllUnhandledErrors(Obj.takeError(), errs(), "tier-up failed: ");
+      return;
+    }
+
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    if (Fn.Superseded)
+      return;
+    auto K = ES.allocateVModule();
+    cantFail(ObjectLayer.addObject(K, std::move(*Obj)));
+    JITTargetAddress Addr =
+        cantFail(ObjectLayer.findSymbolIn(K, mangle(OptName), true)
+                     .getAddress());
+    cantFail(IndirectStubsMgr->updatePointer(mangle(Fn.Name), Addr));
+    Fn.OptimizedKey = K;
+    Fn.Tier = 1;
+
+    std::chrono::duration<double, std::milli> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    TierUpEvents.push_back({Fn.Name, Fn.Calls.load(std::memory_order_relaxed),
+                            Fn.BackEdges.load(std::memory_order_relaxed),
+                            Elapsed.count()});
+  }
+
+  static void optimizeModule(Module &M, TargetMachine &OptTM) {
+    legacy::FunctionPassManager FPM(&M);
+    legacy::PassManager MPM;
+    FPM.add(createTargetTransformInfoWrapperPass(OptTM.getTargetIRAnalysis()));
+    MPM.add(createTargetTransformInfoWrapperPass(OptTM.getTargetIRAnalysis()));
+
+    PassManagerBuilder Builder;
+    Builder.OptLevel = 3;
+    Builder.LibraryInfo = createLibraryInfo(Triple(M.getTargetTriple()));
+    Builder.Inliner = createFunctionInliningPass(3, 0, false);
+    Builder.LoopVectorize = true;
+    Builder.SLPVectorize = true;
+    OptTM.adjustPassManager(Builder);
+    Builder.populateFunctionPassManager(FPM);
+    Builder.populateModulePassManager(MPM);
+
+    FPM.doInitialization();
+    for (Function &F : M)
+      FPM.run(F);
+    FPM.doFinalization();
+    MPM.run(M);
+  }
+
+  /// Library info for the optimizer. Where glibc's vector math library can
+  /// be loaded, vectorized loops call its variants of the math intrinsics,
+  /// e.g. _ZGVdN4v_sin for llvm.sin.f64 with AVX2.
+  static TargetLibraryInfoImpl *createLibraryInfo(const Triple &TT) {
+    auto *TLII = new TargetLibraryInfoImpl(TT);
+#if defined(__linux__) && defined(__x86_64__)
+    static const bool HasLibmvec =
+        !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+    if (HasLibmvec)
+      TLII->addVectorizableFunctionsFromVecLib(
+          TargetLibraryInfoImpl::LIBMVEC_X86);
+#endif
+    return TLII;
+  }
+
+  /// Profilers unwind JIT'd frames through the frame pointer chain.
+  static void keepFramePointers(Module &M) {
+    for (Function &F : M)
+      if (!F.isDeclaration())
+        F.addFnAttr("frame-pointer", "all");
+  }
+
+  void notifyObjectFinalized(VModuleKey K, const object::ObjectFile &Obj,
+                             const RuntimeDyld::LoadedObjectInfo &Info) {
+    for (JITEventListener *L : EventListeners)
+      L->notifyObjectLoaded(K, Obj, Info);
+
+    if (!PerfMap && !Profiling.Sampling)
+      return;
+    // Symbol addresses of the debug object are the final load addresses.
+    auto DebugObj = Info.getObjectForDebug(Obj);
+    const object::ObjectFile &LoadedObj =
+        DebugObj.getBinary() ? *DebugObj.getBinary() : Obj;
+    for (auto &SymSize : object::computeSymbolSizes(LoadedObj)) {
+      object::SymbolRef Sym = SymSize.first;
+      auto Type = Sym.getType();
+      if (!Type || *Type != object::SymbolRef::ST_Function) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      auto Name = Sym.getName();
+      auto Addr = Sym.getAddress();
+      if (!Name || !Addr) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      if (Profiling.Sampling)
+        addFunctionRange(*Addr, SymSize.second, Name->str());
+      if (PerfMap)
+        *PerfMap << format("%llx %llx %s\n", (unsigned long long)*Addr,
+                           (unsigned long long)SymSize.second,
+                           Name->str().c_str());
+    }
+    if (PerfMap)
+      PerfMap->flush();
+  }
+
+  /// Record [Addr, Addr + Size) as the code of Name, forgetting the ranges
+  /// of unloaded code which it reuses.
+  void addFunctionRange(JITTargetAddress Addr, uint64_t Size,
+                        std::string Name) {
+    if (Size == 0)
+      return;
+    std::lock_guard<std::recursive_mutex> Lock(JITMutex);
+    auto It = FunctionRanges.upper_bound(Addr);
+    if (It != FunctionRanges.begin() &&
+        std::prev(It)->first + std::prev(It)->second.Size > Addr)
+      --It;
+    while (It != FunctionRanges.end() && It->first < Addr + Size)
+      It = FunctionRanges.erase(It);
+    FunctionRanges[Addr] = {Size, std::move(Name)};
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -88,7 +974,18 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
+  /// Definer, if given, is set to the module which defines the symbol.
+  JITSymbol findMangledSymbol(const std::string &Name,
+                              VModuleKey *Definer = nullptr) {
+    // Stubs are the canonical definitions of tiered functions.
+    if (IndirectStubsMgr)
+      if (auto Sym = IndirectStubsMgr->findStub(Name, true))
+        return Sym;
+
+    auto Absolute = AbsoluteSymbols.find(Name);
+    if (Absolute != AbsoluteSymbols.end())
+      return JITSymbol(Absolute->second, JITSymbolFlags::Exported);
+
 #ifdef _WIN32
     // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
     // flag to decide whether a symbol will be visible or not, when we call
@@ -106,8 +1003,11 @@ private:
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
     for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
+      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly)) {
+        if (Definer)
+          *Definer = H;
         return Sym;
+      }
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -127,12 +1027,55 @@ private:
   }
 
   ExecutionSession ES;
-  std::shared_ptr<SymbolResolver> Resolver;
+  /// Memory of the sections of every module, shared by them.
+  std::shared_ptr<SlabAllocator> Slabs;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
   std::vector<VModuleKey> ModuleKeys;
+  std::map<VModuleKey, ModuleInfo> Modules;
+  std::map<std::string, VModuleKey> FunctionOwners;
+  uint64_t RetiredModules = 0;
+  std::recursive_mutex JITMutex;
+  /// Pins held, by the epoch they were taken in, see CodePin.
+  std::mutex PinMutex;
+  std::map<uint64_t, unsigned> Pins;
+  uint64_t CurrentEpoch = 0;
+  bool KeepObjects = false;
+  /// Functions stubbed by addSavedObjects.
+  std::set<std::string> SavedFunctions;
+  /// Symbols defined by defineAbsoluteSymbol, by mangled name.
+  std::map<std::string, JITTargetAddress> AbsoluteSymbols;
+
+  /// Compiles batch entry points, created on first use.
+  std::unique_ptr<TargetMachine> HostTM;
+
+  ProfilingOptions Profiling;
+  std::vector<JITEventListener *> EventListeners;
+  std::unique_ptr<raw_fd_ostream> PerfMap;
+  struct FunctionRange {
+    uint64_t Size;
+    std::string Name;
+  };
+  /// Start address to the code of every JIT'd function, with Sampling.
+  std::map<JITTargetAddress, FunctionRange> FunctionRanges;
+
+  TieringOptions Tiering;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackMgr;
+  std::unique_ptr<IndirectStubsManager> IndirectStubsMgr;
+  std::map<std::string, TieredFunction *> LatestTieredFunction;
+  /// Compile callbacks of the stubs which have not been called yet.
+  std::map<std::string, JITTargetAddress> PendingCallbacks;
+  std::vector<TierUpEvent> TierUpEvents;
+
+  std::thread TierUpThread;
+  std::mutex TierUpQueueMutex;
+  std::condition_variable TierUpQueueCV;
+  std::condition_variable TierUpIdleCV;
+  std::deque<std::shared_ptr<TieredFunction>> TierUpQueue;
+  bool TierUpBusy = false;
+  bool StopTierUp = false;
 };
 
 } // end namespace orc
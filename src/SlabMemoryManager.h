@@ -0,0 +1,363 @@
+//===- SlabMemoryManager.h - Shared slabs for JIT'd sections ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A memory manager which carves the sections of every object out of slabs
+// shared by all the objects of a JIT, rather than mapping pages per object.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+/// Slabs of code, read-only data and read-write data, shared by the objects
+/// of a JIT. Sections of many objects are packed into the same pages, and a
+/// section freed with its object is reused by the next one that fits.
+///
+/// Code and read-only data slabs are shared memory mapped twice: RuntimeDyld
+/// writes and relocates sections through a read-write view, and the code
+/// runs from a read-execute (or read-only) view at another address. Their
+/// permissions are set once when the slab is mapped, so adding an object
+/// costs no mprotect, and pages holding code which runs are never made
+/// writable again for the next object.
+class SlabAllocator {
+public:
+  enum SectionKind { Code, ReadOnlyData, ReadWriteData, NumSectionKinds };
+
+  struct KindStats {
+    uint64_t Slabs = 0;
+    uint64_t PagesMapped = 0;
+    /// Pages holding at least one live section.
+    uint64_t PagesInUse = 0;
+    /// Bytes of the live sections, alignment padding excluded.
+    uint64_t BytesInUse = 0;
+  };
+
+  struct Stats {
+    KindStats Kinds[NumSectionKinds];
+    uint64_t Allocations = 0;
+    /// Allocations placed in memory freed by a removed object.
+    uint64_t ReusedAllocations = 0;
+    uint64_t SlabsUnmapped = 0;
+  };
+
+  /// A section: RuntimeDyld writes it at Writable, and the code refers to it
+  /// at Address. Both are the same for read-write data.
+  struct Block {
+    uint8_t *Writable = nullptr;
+    uint64_t Address = 0;
+    uint64_t Size = 0;
+    SectionKind Kind = Code;
+  };
+
+  /// Fails, returning null, where code cannot be mapped twice (e.g. where
+  /// executable memory must be mapped with MAP_JIT).
+  static std::shared_ptr<SlabAllocator>
+  create(uint64_t SlabSize = 256 * 1024) {
+    std::shared_ptr<SlabAllocator> Allocator(new SlabAllocator(SlabSize));
+    // Keep the probe as the first code slab.
+    if (!Allocator->mapSlab(Code, Allocator->SlabSize))
+      return nullptr;
+    return Allocator;
+  }
+
+  ~SlabAllocator() {
+    for (auto &S : Slabs)
+      unmapSlab(*S);
+  }
+
+  /// Returns a block with a null Writable if no memory can be mapped.
+  Block allocate(SectionKind Kind, uint64_t Size, unsigned Alignment) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    // Keep free ranges coarse, so that freeing coalesces them.
+    Size = alignTo(std::max<uint64_t>(Size, 1), MinAlignment);
+    uint64_t Align = std::max<uint64_t>(Alignment, MinAlignment);
+
+    Block B;
+    for (auto &S : Slabs)
+      if (S->Kind == Kind && carve(*S, Size, Align, B))
+        return B;
+    uint64_t NewSlabSize =
+        std::max(SlabSize, alignTo(Size + Align, PageSize));
+    if (Slab *S = mapSlab(Kind, NewSlabSize))
+      carve(*S, Size, Align, B);
+    return B;
+  }
+
+  void release(const Block &B) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto It = Slabs.begin(); It != Slabs.end(); ++It) {
+      Slab &S = **It;
+      if (S.Kind != B.Kind || B.Writable < S.Writable ||
+          B.Writable >= S.Writable + S.Size)
+        continue;
+      uint64_t Offset = B.Writable - S.Writable;
+      uint64_t Size = S.Live[Offset];
+      S.Live.erase(Offset);
+      addFreeRange(S, Offset, Size);
+
+      // Keep one empty slab per kind for the next objects, unmap the others.
+      if (S.Live.empty() && (S.Size != SlabSize || hasEmptySlab(S))) {
+        unmapSlab(S);
+        Slabs.erase(It);
+        ++Counters.SlabsUnmapped;
+      }
+      return;
+    }
+  }
+
+  Stats getStats() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stats Result = Counters;
+    for (auto &S : Slabs) {
+      KindStats &K = Result.Kinds[S->Kind];
+      ++K.Slabs;
+      K.PagesMapped += S->Size / PageSize;
+      // Live sections are sorted, so a page shared by several is seen in a
+      // row and counted once.
+      uint64_t LastPage = UINT64_MAX;
+      for (auto &Live : S->Live) {
+        uint64_t First = Live.first / PageSize;
+        uint64_t Last = (Live.first + Live.second - 1) / PageSize;
+        K.PagesInUse += Last - First + 1 - (First == LastPage ? 1 : 0);
+        K.BytesInUse += Live.second;
+        LastPage = Last;
+      }
+    }
+    return Result;
+  }
+
+private:
+  static constexpr uint64_t MinAlignment = 16;
+
+  struct Slab {
+    SectionKind Kind;
+    uint64_t Size;
+    uint8_t *Writable;
+    /// The read-execute or read-only view, Writable for read-write data.
+    uint8_t *Mapped;
+    /// Offset to size, of the free ranges (coalesced) and of the sections.
+    std::map<uint64_t, uint64_t> Free;
+    std::map<uint64_t, uint64_t> Live;
+    /// End of the highest section ever placed, memory below it is reused.
+    uint64_t HighWater = 0;
+  };
+
+  explicit SlabAllocator(uint64_t SlabSize)
+      : PageSize(sys::Process::getPageSizeEstimate()),
+        SlabSize(alignTo(SlabSize, sys::Process::getPageSizeEstimate())) {}
+
+  static int createSharedMemory() {
+#ifdef __linux__
+    return memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+#else
+    static std::atomic<unsigned> Counter{0};
+    std::string Name = "/kaleidoscope-jit-" + std::to_string(getpid()) + "-" +
+                       std::to_string(Counter++);
+    int FD = shm_open(Name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (FD >= 0)
+      shm_unlink(Name.c_str());
+    return FD;
+#endif
+  }
+
+  Slab *mapSlab(SectionKind Kind, uint64_t Size) {
+    std::unique_ptr<Slab> S(new Slab{Kind, Size, nullptr, nullptr, {}, {}, 0});
+    if (Kind == ReadWriteData) {
+      void *Addr = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (Addr == MAP_FAILED)
+        return nullptr;
+      S->Writable = S->Mapped = static_cast<uint8_t *>(Addr);
+    } else {
+      int FD = createSharedMemory();
+      if (FD < 0)
+        return nullptr;
+      int Prot = Kind == Code ? PROT_READ | PROT_EXEC : PROT_READ;
+      void *Writable = MAP_FAILED, *Mapped = MAP_FAILED;
+      if (ftruncate(FD, Size) == 0) {
+        Writable = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FD,
+                        0);
+        Mapped = mmap(nullptr, Size, Prot, MAP_SHARED, FD, 0);
+      }
+      // The mappings keep the memory.
+      close(FD);
+      if (Writable == MAP_FAILED || Mapped == MAP_FAILED) {
+        if (Writable != MAP_FAILED)
+          munmap(Writable, Size);
+        if (Mapped != MAP_FAILED)
+          munmap(Mapped, Size);
+        return nullptr;
+      }
+      S->Writable = static_cast<uint8_t *>(Writable);
+      S->Mapped = static_cast<uint8_t *>(Mapped);
+    }
+    S->Free[0] = Size;
+    Slabs.push_back(std::move(S));
+    return Slabs.back().get();
+  }
+
+  void unmapSlab(Slab &S) {
+    if (S.Mapped != S.Writable)
+      munmap(S.Mapped, S.Size);
+    munmap(S.Writable, S.Size);
+  }
+
+  /// Place a section in the first free range of S it fits in.
+  bool carve(Slab &S, uint64_t Size, uint64_t Align, Block &B) {
+    for (auto It = S.Free.begin(); It != S.Free.end(); ++It) {
+      uint64_t Begin = It->first, End = It->first + It->second;
+      // Views are page aligned, so aligning offsets aligns addresses.
+      uint64_t Offset = alignTo(Begin, Align);
+      if (Offset + Size > End)
+        continue;
+      S.Free.erase(It);
+      if (Offset > Begin)
+        S.Free[Begin] = Offset - Begin;
+      if (Offset + Size < End)
+        S.Free[Offset + Size] = End - Offset - Size;
+      S.Live[Offset] = Size;
+
+      ++Counters.Allocations;
+      if (Offset < S.HighWater)
+        ++Counters.ReusedAllocations;
+      S.HighWater = std::max(S.HighWater, Offset + Size);
+
+      B.Writable = S.Writable + Offset;
+      B.Address = reinterpret_cast<uint64_t>(S.Mapped + Offset);
+      B.Size = Size;
+      B.Kind = S.Kind;
+      return true;
+    }
+    return false;
+  }
+
+  void addFreeRange(Slab &S, uint64_t Offset, uint64_t Size) {
+    auto Next = S.Free.lower_bound(Offset);
+    if (Next != S.Free.end() && Offset + Size == Next->first) {
+      Size += Next->second;
+      Next = S.Free.erase(Next);
+    }
+    if (Next != S.Free.begin()) {
+      auto Prev = std::prev(Next);
+      if (Prev->first + Prev->second == Offset) {
+        Prev->second += Size;
+        return;
+      }
+    }
+    S.Free[Offset] = Size;
+  }
+
+  bool hasEmptySlab(const Slab &Except) {
+    for (auto &S : Slabs)
+      if (S.get() != &Except && S->Kind == Except.Kind && S->Live.empty() &&
+          S->Size == SlabSize)
+        return true;
+    return false;
+  }
+
+  const uint64_t PageSize;
+  const uint64_t SlabSize;
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<Slab>> Slabs;
+  Stats Counters;
+};
+
+/// The memory manager of one object, its sections are allocated from the
+/// slabs of the JIT and released when the object is removed.
+class SlabMemoryManager : public RTDyldMemoryManager {
+public:
+  explicit SlabMemoryManager(std::shared_ptr<SlabAllocator> Allocator)
+      : Allocator(std::move(Allocator)) {}
+
+  ~SlabMemoryManager() override {
+    for (const SlabAllocator::Block &B : Blocks)
+      Allocator->release(B);
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    return allocate(SlabAllocator::Code, Size, Alignment);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    return allocate(IsReadOnly ? SlabAllocator::ReadOnlyData
+                               : SlabAllocator::ReadWriteData,
+                    Size, Alignment);
+  }
+
+  /// Called once the sections are allocated and before relocations are
+  /// resolved: point RuntimeDyld at the views the code runs from, so that
+  /// relocations and symbol addresses refer to them.
+  void notifyObjectLoaded(RuntimeDyld &RTDyld,
+                          const object::ObjectFile &Obj) override {
+    for (; Loaded < Blocks.size(); ++Loaded) {
+      const SlabAllocator::Block &B = Blocks[Loaded];
+      if (B.Address != reinterpret_cast<uint64_t>(B.Writable))
+        RTDyld.mapSectionAddress(B.Writable, B.Address);
+    }
+  }
+
+  /// The unwinder reads the frames from where they are mapped for the code.
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override {
+    RTDyldMemoryManager::registerEHFrames(reinterpret_cast<uint8_t *>(LoadAddr),
+                                          LoadAddr, Size);
+  }
+
+  bool finalizeMemory(std::string *ErrMsg) override {
+    for (const SlabAllocator::Block &B : Blocks)
+      if (B.Kind == SlabAllocator::Code)
+        sys::Memory::InvalidateInstructionCache(
+            reinterpret_cast<const void *>(B.Address), B.Size);
+    return false;
+  }
+
+private:
+  uint8_t *allocate(SlabAllocator::SectionKind Kind, uintptr_t Size,
+                    unsigned Alignment) {
+    SlabAllocator::Block B = Allocator->allocate(Kind, Size, Alignment);
+    if (!B.Writable)
+      return nullptr;
+    Blocks.push_back(B);
+    return B.Writable;
+  }
+
+  std::shared_ptr<SlabAllocator> Allocator;
+  std::vector<SlabAllocator::Block> Blocks;
+  /// Blocks already mapped by notifyObjectLoaded.
+  size_t Loaded = 0;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
@@ -0,0 +1,234 @@
+#include "codegen.h"
+#include "parser.h"
+#include "lexer.h"
+#include "output.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+/**
+ * Struct Declare
+ */
+// one input file of the batch
+struct BatchFile {
+    std::string path;
+    std::string error;
+    // object code of its definitions and top level expressions
+    std::unique_ptr<llvm::MemoryBuffer> object;
+    // symbols of its top level expressions, in source order
+    std::vector<std::string> entry_points;
+    double compile_ms = 0;
+    double link_ms = 0;
+    double run_ms = 0;
+};
+
+static double MillisSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// compile `file` into one module and then an object, with the (fresh) thread local compiler of this thread
+static void CompileFile(BatchFile& file, size_t index) {
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream in(file.path);
+    if (!in) {
+        file.error = "cannot open the file";
+        return;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    // the lexer reads it in place
+    std::string code = buffer.str();
+
+    g_enable_ir_print = false;
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    ReCreateModule();
+    g_module->setModuleIdentifier(file.path);
+
+    SetLexerInput(code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF && file.error.empty()) {
+        switch (g_current_token) {
+            case TOKEN_END: GetNextToken(); break;
+            case TOKEN_DEF: {
+                std::shared_ptr<FunctionAST> ast = ParseDefinition();
+                if (ast == nullptr) {
+                    file.error = "a definition does not parse";
+                    break;
+                }
+                // all definitions share a module, so a function cannot be redefined
+                llvm::Function* existing = g_module->getFunction(ast->proto().name());
+                if (existing != nullptr && !existing->isDeclaration()) {
+                    file.error = "redefinition of " + ast->proto().name();
+                    break;
+                }
+                RegisterFunctionAST(ast);
+                ast->CodeGen();
+                break;
+            }
+            case TOKEN_EXTERN: {
+                std::unique_ptr<PrototypeAST> ast = ParseExtern();
+                if (ast == nullptr) {
+                    file.error = "an extern does not parse";
+                    break;
+                }
+                ast->CodeGen();
+                name2proto_ast[ast->name()] = std::move(ast);
+                break;
+            }
+            default: {
+                // every top level expression keeps its function, named after the file and its position
+                std::unique_ptr<FunctionAST> ast = ParseTopLevelExpr();
+                if (ast == nullptr) {
+                    file.error = "an expression does not parse";
+                    break;
+                }
+                llvm::Function* func = (llvm::Function*) ast->CodeGen();
+                std::string name = top_level_expr_name + "." + std::to_string(index) + "." +
+                                   std::to_string(file.entry_points.size());
+                func->setName(name);
+                file.entry_points.push_back(name);
+                break;
+            }
+        }
+    }
+    ResetLexerInput();
+
+    if (file.error.empty()) {
+        CodeGenSpecializations();
+        auto object = g_jit->compileModule(*g_module);
+        if (object) {
+            file.object = std::move(*object);
+        } else {
+            file.error = llvm::toString(object.takeError());
+        }
+    }
+
+    // IR refers to the LLVM context of this thread, release it while the context is alive
+    g_fpm.reset();
+    g_module.reset();
+    g_jit.reset();
+    file.compile_ms = MillisSince(start);
+}
+
+static bool WriteObject(const BatchFile& file, const std::string& object_dir) {
+    llvm::SmallString<128> path(object_dir);
+    llvm::sys::path::append(path, llvm::sys::path::stem(file.path) + ".o");
+    std::error_code error;
+    llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_None);
+    if (error) {
+        std::cerr << "batch> " << path.str().str() << ": " << error.message() << std::endl;
+        return false;
+    }
+    out << file.object->getBuffer();
+    return true;
+}
+
+// add the objects to one JIT in the order of the command line, and run their top level expressions
+static void LinkAndRun(std::vector<BatchFile>& files) {
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    for (BatchFile& file : files) {
+        auto start = std::chrono::steady_clock::now();
+        g_jit->addObject(std::move(file.object));
+        std::vector<double (*)()> entry_points;
+        for (const std::string& name : file.entry_points) {
+            entry_points.push_back((double (*)()) g_jit->getSymbolAddress(name));
+        }
+        file.link_ms = MillisSince(start);
+
+        start = std::chrono::steady_clock::now();
+        for (auto entry_point : entry_points) {
+            WriteOutput(OUTPUT_STDOUT, "result> ");
+            WriteOutput(OUTPUT_STDOUT, entry_point(), DOUBLE_GENERAL);
+            WriteOutput(OUTPUT_STDOUT, "\n");
+        }
+        file.run_ms = MillisSince(start);
+    }
+    // before the report on stderr
+    FlushOutput();
+}
+
+// usage: ksc-batch.app [-j N] [--emit-obj <dir>] file.ks ...
+// every file is compiled in its own context and module, on N threads (the number of cores by default),
+// then either linked into one JIT and run in order, or written to <dir>/<file stem>.o
+int main(int argc, char* argv[]) {
+    size_t jobs = std::thread::hardware_concurrency();
+    std::string object_dir;
+    std::vector<BatchFile> files;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = strtoull(argv[++i], nullptr, 10);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+            jobs = strtoull(argv[i] + 2, nullptr, 10);
+        } else if (strcmp(argv[i], "--emit-obj") == 0 && i + 1 < argc) {
+            object_dir = argv[++i];
+        } else {
+            files.emplace_back();
+            files.back().path = argv[i];
+        }
+    }
+    if (files.empty()) {
+        std::cerr << "usage: " << argv[0] << " [-j N] [--emit-obj <dir>] file.ks ..." << std::endl;
+        return 1;
+    }
+    jobs = std::max<size_t>(1, std::min(jobs, files.size()));
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next_file(0);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < jobs; ++i) {
+        workers.emplace_back([&files, &next_file]() {
+            for (size_t index = next_file++; index < files.size(); index = next_file++) {
+                // a thread per file starts from a fresh thread local compiler
+                std::thread(CompileFile, std::ref(files[index]), index).join();
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double compile_ms = MillisSince(start);
+
+    bool failed = false;
+    for (const BatchFile& file : files) {
+        if (!file.error.empty()) {
+            std::cerr << "batch> " << file.path << ": " << file.error << std::endl;
+            failed = true;
+        }
+    }
+    if (failed) {
+        return 1;
+    }
+
+    auto link_start = std::chrono::steady_clock::now();
+    if (object_dir.empty()) {
+        LinkAndRun(files);
+    } else {
+        for (const BatchFile& file : files) {
+            failed |= !WriteObject(file, object_dir);
+        }
+    }
+    double link_ms = MillisSince(link_start);
+
+    for (const BatchFile& file : files) {
+        fprintf(stderr, "batch> %s: compile %.3f ms, link %.3f ms, run %.3f ms\n",
+                file.path.c_str(), file.compile_ms, file.link_ms, file.run_ms);
+    }
+    fprintf(stderr, "batch> %zu files on %zu threads: compile %.3f ms, %s %.3f ms, total %.3f ms\n",
+            files.size(), jobs, compile_ms, object_dir.empty() ? "link and run" : "write objects", link_ms,
+            MillisSince(start));
+    return failed ? 1 : 0;
+}
@@ -1,63 +1,145 @@
 #include "codegen.h"
 #include "parser.h"
 #include "lexer.h"
+#include "instance.h"
+#include "expr_cache.h"
+#include "output.h"
+#include "sampler.h"
+#include "time_report.h"
+#include <algorithm>
 #include <iostream>
 
 // Add a flag to control whether to print out LLVM IR
-bool g_enable_ir_print;
+thread_local bool g_enable_ir_print;
+
+// Print `result> ...` after evaluating a top level expression
+thread_local bool g_enable_result_print = true;
+
+// Compile globals to slots of a GlobalsInstance
+thread_local bool g_enable_instance_globals = false;
 
 // Record the core "global" data of LLVM's core infrastructure, e.g. types and constants uniquing table
-llvm::LLVMContext g_llvm_context;
+thread_local std::unique_ptr<llvm::LLVMContext> g_llvm_context;
 
 // Used for creating LLVM IR (Intermediate Representation)
-llvm::IRBuilder<> g_ir_builder(g_llvm_context);
+thread_local std::unique_ptr<llvm::IRBuilder<>> g_ir_builder;
+
+// Replace g_llvm_context after this many modules
+thread_local size_t g_context_recycle_modules = 256;
 
 // Used for managing functions and global variables. You can consider it as a compile unit (like single .cpp file)
-std::unique_ptr<llvm::Module> g_module;
+thread_local std::unique_ptr<llvm::Module> g_module;
 
 // Used for recording the parameters of function
-std::unordered_map<std::string, llvm::AllocaInst*> g_local_named_vars;
+thread_local std::unordered_map<std::string, llvm::AllocaInst*> g_local_named_vars;
 
 // Used for recording the global named variables
-std::unordered_map<std::string, llvm::AllocaInst*> g_global_named_vars;
+thread_local std::unordered_map<std::string, llvm::AllocaInst*> g_global_named_vars;
+
+// Slot of every global in a GlobalsInstance, when g_enable_instance_globals is set
+thread_local std::unordered_map<std::string, size_t> g_global_slots;
 
 // Function Passes Manager for CodeGen Optimizer
-std::unique_ptr<llvm::legacy::FunctionPassManager> g_fpm;
+thread_local std::unique_ptr<llvm::legacy::FunctionPassManager> g_fpm;
 
 // Add JIT Compiler
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> g_jit;
+thread_local std::unique_ptr<llvm::orc::KaleidoscopeJIT> g_jit;
+
+// Type inference result of the function being generated
+thread_local const TypeInfo* g_type_info;
 
 // Add dictionary for function name to function interface
-std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> name2proto_ast;
+thread_local std::unordered_map<std::string, std::shared_ptr<PrototypeAST>> name2proto_ast;
+
+// Specializations referenced by generated code but not emitted yet
+thread_local std::vector<std::string> g_pending_specializations;
+
+// A generated batch entry point, and the definitions copied into it
+struct BatchFunctionEntry {
+    BatchFunction address;
+    std::vector<std::shared_ptr<FunctionAST>> sources;
+};
+
+// Batch entry points by function name
+thread_local std::unordered_map<std::string, BatchFunctionEntry> g_batch_functions;
+
+// Value of every `const` global, folded into the code compiled after its definition
+thread_local std::unordered_map<std::string, double> g_const_values;
+
+// Functions whose code folded a const, recompiled if it is written
+thread_local std::unordered_map<std::string, std::unordered_set<std::string>> g_const_users;
+
+// Globals written by the functions compiled so far, such a global defined by `const` is not folded
+thread_local std::unordered_set<std::string> g_written_globals;
+
+// Consts defined by the top level expression being compiled, folded once it has run
+thread_local std::vector<std::string> g_pending_consts;
+
+// The function whose body is being generated
+thread_local const FunctionAST* g_codegen_function;
+
+// Modules generated in g_llvm_context so far, and how often it was replaced
+static thread_local size_t context_modules = 0;
+static thread_local uint64_t recycled_contexts = 0;
+
+// Modules set aside (by DemoteConst, GetBatchFunction) while IR goes into another one, g_llvm_context must outlive them
+static thread_local int modules_set_aside = 0;
+
+// Symbol of the calling thread's defining GlobalsInstance, and the JIT it is defined in
+static const char* defining_instance_symbol = "kaleidoscope_defining_instance";
+static thread_local const llvm::orc::KaleidoscopeJIT* instance_symbol_jit = nullptr;
 
 llvm::Value* NumberExprAST::CodeGen() {
-    return llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(val_));
+    // a lifted literal is read from where RunTopLevel stores the value for each run
+    if (g_lifting_key != nullptr && g_lifting_key->literal_slots.count(this) > 0) {
+        llvm::Type* double_type = llvm::Type::getDoubleTy(*g_llvm_context);
+        const double* address = LiftedLiteralAddress(g_lifting_key->literal_slots.at(this));
+        llvm::Value* ptr = llvm::ConstantExpr::getIntToPtr(
+            g_ir_builder->getInt64((uint64_t) address), double_type->getPointerTo());
+        llvm::Value* value = g_ir_builder->CreateLoad(double_type, ptr, "literal");
+        return CastValue(value, GetLLVMType(g_type_info->TypeOf(this)));
+    }
+    if (g_type_info->TypeOf(this) == TYPE_INT) {
+        return llvm::ConstantInt::get(*g_llvm_context, llvm::APInt(64, (int64_t) val_, true));
+    }
+    return llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(val_));
 }
 
 llvm::Value* VariableExprAST::CodeGen() {
+    // a const is a literal, unless a local variable shadows it
+    auto const_value = g_const_values.find(name_);
+    if (const_value != g_const_values.end() && g_local_named_vars.count(name_) == 0) {
+        g_const_users[name_].insert(g_codegen_function->proto().name());
+        llvm::Value* value = llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(const_value->second));
+        return CastValue(value, GetLLVMType(g_type_info->TypeOf(this)));
+    }
+
     llvm::AllocaInst* var = FindVariableAllocaInst(name_);
-    return g_ir_builder.CreateLoad(var, name_.c_str());
+    llvm::Value* value = g_ir_builder->CreateLoad(var, name_.c_str());
+    return CastValue(value, GetLLVMType(g_type_info->TypeOf(this)));
 }
 
 llvm::Value* UnaryExprAST::CodeGen() {
     llvm::Value* operand = operand_->CodeGen();
 
     if (op_ == "!") {
-        auto zero = llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(0.0));
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOEQ(operand, zero, "nottmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        if (operand->getType()->isDoubleTy()) {
+            auto zero = llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(0.0));
+            return g_ir_builder->CreateFCmpOEQ(operand, zero, "nottmp");
+        }
+        return g_ir_builder->CreateICmpEQ(operand, llvm::Constant::getNullValue(operand->getType()), "nottmp");
     }
 
     if (op_ == "-") {
-        auto zero = llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(0.0));
-        return g_ir_builder.CreateFSub(zero, operand, "negtmp");
+        if (g_type_info->TypeOf(this) == TYPE_INT) {
+            return g_ir_builder->CreateNeg(CastValue(operand, GetLLVMType(TYPE_INT)), "negtmp");
+        }
+        auto zero = llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(0.0));
+        return g_ir_builder->CreateFSub(zero, CastValue(operand, GetLLVMType(TYPE_DOUBLE)), "negtmp");
     }
 
     // user defined operator
-    llvm::Function* func = GetFunction(std::string("unary") + op_);
-    llvm::Value* operands[1] = { operand };
-    return g_ir_builder.CreateCall(func, operands, "unaryop");
+    return CreateKaleidoscopeCall(this, std::string("unary") + op_, { operand }, "unaryop");
 }
 
 llvm::Value* BinaryExprAST::CodeGen() {
@@ -66,116 +148,253 @@ llvm::Value* BinaryExprAST::CodeGen() {
         VariableExprAST* leftVar = (VariableExprAST*) lhs_.get();
         llvm::AllocaInst* var = FindVariableAllocaInst(leftVar->name());
         if (var == nullptr) {
-            if (leftVar->isGlobalScope()) {
-                g_module->getOrInsertGlobal(leftVar->name(), llvm::Type::getDoubleTy(g_llvm_context));
+            if (leftVar->isGlobalScope() && g_enable_instance_globals) {
+                g_global_slots.emplace(leftVar->name(), g_global_slots.size());
+                DefiningGlobalsInstance()->UseSlots(g_global_slots.size());
+                g_global_named_vars[leftVar->name()] = nullptr;
+                var = FindVariableAllocaInst(leftVar->name());
+            } else if (leftVar->isGlobalScope()) {
+                g_module->getOrInsertGlobal(leftVar->name(), llvm::Type::getDoubleTy(*g_llvm_context));
                 llvm::GlobalVariable* gbl_var = g_module->getNamedGlobal(leftVar->name());
-                gbl_var->setLinkage(llvm::GlobalValue::CommonLinkage);
+                // a zero initialized definition, later modules refer to it through a declaration
+                gbl_var->setLinkage(llvm::GlobalValue::ExternalLinkage);
+                gbl_var->setInitializer(llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(0.0)));
                 gbl_var->setAlignment(llvm::MaybeAlign(8));
                 var = (llvm::AllocaInst*) gbl_var;
                 g_global_named_vars[leftVar->name()] = var;
             } else {
-                llvm::Function* func = g_ir_builder.GetInsertBlock()->getParent();
-                var = CreateEntryBlockAlloca(func, leftVar->name());
+                llvm::Function* func = g_ir_builder->GetInsertBlock()->getParent();
+                var = CreateEntryBlockAlloca(func, leftVar->name(), GetLLVMType(g_type_info->VarType(leftVar->name())));
                 g_local_named_vars[leftVar->name()] = var;
             }
+            // cached expressions may have been compiled while the name referred to something else
+            if (leftVar->isGlobalScope()) {
+                DropCachedExpressions("");
+            }
         }
 
-        llvm::Value* rightVal = rhs_->CodeGen();
-        g_ir_builder.CreateStore(rightVal, var);
+        // globals are double, locals have their inferred type
+        llvm::Value* rightVal = CastValue(rhs_->CodeGen(), var->getType()->getPointerElementType());
+        g_ir_builder->CreateStore(rightVal, var);
+        // a const defined in a function body is a plain global, it may be assigned on every call
+        if (leftVar->isConst() && g_codegen_function->proto().name() == top_level_expr_name) {
+            g_pending_consts.push_back(leftVar->name());
+        }
         return leftVar->CodeGen();
     }
 
     llvm::Value* lhs = lhs_->CodeGen();
     llvm::Value* rhs = rhs_->CodeGen();
 
+    if (op_ == "&&" || op_ == "||") {
+        lhs = CastValue(lhs, GetLLVMType(TYPE_BOOL));
+        rhs = CastValue(rhs, GetLLVMType(TYPE_BOOL));
+    }
+
+    // comparisons are done on doubles unless both sides are integral
+    ValueType operand_type = JoinType(g_type_info->TypeOf(lhs_.get()), g_type_info->TypeOf(rhs_.get()));
+    bool is_integral_cmp = operand_type == TYPE_BOOL || operand_type == TYPE_INT;
+    llvm::Type* cmp_type = GetLLVMType(is_integral_cmp ? TYPE_INT : TYPE_DOUBLE);
+
+    // arithmetic is done in the inferred result type
+    llvm::Type* arith_type = GetLLVMType(g_type_info->TypeOf(this));
+    bool is_integral_arith = g_type_info->TypeOf(this) == TYPE_INT;
+
     if (op_ == "&&") {
-        llvm::Value* tmp = g_ir_builder.CreateAnd(lhs, rhs, "andtmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        return g_ir_builder->CreateAnd(lhs, rhs, "andtmp");
     }
 
     if (op_ == "||") {
-        llvm::Value* tmp = g_ir_builder.CreateOr(lhs, rhs, "ortmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        return g_ir_builder->CreateOr(lhs, rhs, "ortmp");
     }
 
     if (op_ == "==") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOEQ(lhs, rhs, "eqcmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpEQ(lhs, rhs, "eqcmptmp")
+            : g_ir_builder->CreateFCmpOEQ(lhs, rhs, "eqcmptmp");
     }
 
     if (op_ == "!=") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpONE(lhs, rhs, "necmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpNE(lhs, rhs, "necmptmp")
+            : g_ir_builder->CreateFCmpONE(lhs, rhs, "necmptmp");
     }
 
     if (op_ == "<=") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOLE(lhs, rhs, "lecmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpSLE(lhs, rhs, "lecmptmp")
+            : g_ir_builder->CreateFCmpOLE(lhs, rhs, "lecmptmp");
     }
 
     if (op_ == ">=") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOGE(lhs, rhs, "gecmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpSGE(lhs, rhs, "gecmptmp")
+            : g_ir_builder->CreateFCmpOGE(lhs, rhs, "gecmptmp");
     }
 
     if (op_ == "<") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOLT(lhs, rhs, "ltcmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpSLT(lhs, rhs, "ltcmptmp")
+            : g_ir_builder->CreateFCmpOLT(lhs, rhs, "ltcmptmp");
     }
 
     if (op_ == ">") {
-        llvm::Value* tmp = g_ir_builder.CreateFCmpOGT(lhs, rhs, "gtcmptmp");
-        // convert 0/1 to 0.0/1.0
-        return g_ir_builder.CreateUIToFP(tmp, llvm::Type::getDoubleTy(g_llvm_context), "booltmp");
+        lhs = CastValue(lhs, cmp_type);
+        rhs = CastValue(rhs, cmp_type);
+        return is_integral_cmp
+            ? g_ir_builder->CreateICmpSGT(lhs, rhs, "gtcmptmp")
+            : g_ir_builder->CreateFCmpOGT(lhs, rhs, "gtcmptmp");
     }
 
     if (op_ == "+") {
-        return g_ir_builder.CreateFAdd(lhs, rhs, "addtmp");
+        lhs = CastValue(lhs, arith_type);
+        rhs = CastValue(rhs, arith_type);
+        return is_integral_arith
+            ? g_ir_builder->CreateAdd(lhs, rhs, "addtmp")
+            : g_ir_builder->CreateFAdd(lhs, rhs, "addtmp");
     }
 
     if (op_ == "-") {
-        return g_ir_builder.CreateFSub(lhs, rhs, "subtmp");
+        lhs = CastValue(lhs, arith_type);
+        rhs = CastValue(rhs, arith_type);
+        return is_integral_arith
+            ? g_ir_builder->CreateSub(lhs, rhs, "subtmp")
+            : g_ir_builder->CreateFSub(lhs, rhs, "subtmp");
     }
 
     if (op_ == "*") {
-        return g_ir_builder.CreateFMul(lhs, rhs, "multmp");
+        lhs = CastValue(lhs, arith_type);
+        rhs = CastValue(rhs, arith_type);
+        return is_integral_arith
+            ? g_ir_builder->CreateMul(lhs, rhs, "multmp")
+            : g_ir_builder->CreateFMul(lhs, rhs, "multmp");
     }
 
     if (op_ == "/") {
-        return g_ir_builder.CreateFDiv(lhs, rhs, "divtmp");
+        lhs = CastValue(lhs, GetLLVMType(TYPE_DOUBLE));
+        rhs = CastValue(rhs, GetLLVMType(TYPE_DOUBLE));
+        return g_ir_builder->CreateFDiv(lhs, rhs, "divtmp");
     }
 
     // user defined operator
-    llvm::Function* func = GetFunction(std::string("binary") + op_);
-    llvm::Value* operands[2] = { lhs, rhs };
-    return g_ir_builder.CreateCall(func, operands, "binop");
+    return CreateKaleidoscopeCall(this, std::string("binary") + op_, { lhs, rhs }, "binop");
 }
 
-llvm::Value* CallExprAST::CodeGen() {
-    // g_module stores global variables and functions
-    llvm::Function* callee = GetFunction(callee_);
+// load from a table which is frozen before any code is compiled, so loads may be hoisted out of loops
+static llvm::LoadInst* CreateInvariantLoad(llvm::Type* type, llvm::Value* ptr, const std::string& name) {
+    llvm::LoadInst* load = g_ir_builder->CreateLoad(type, ptr, name);
+    load->setMetadata(llvm::LLVMContext::MD_invariant_load, llvm::MDNode::get(*g_llvm_context, {}));
+    return load;
+}
 
+// inline `column_get(column, index)`: a bounds check and a load from the mapped column, NaN if out of range
+static llvm::Value* CodeGenColumnGet(llvm::Value* column, llvm::Value* index) {
+    llvm::Type* double_type = llvm::Type::getDoubleTy(*g_llvm_context);
+    llvm::Type* size_type = llvm::Type::getInt64Ty(*g_llvm_context);
+    // matches `Column` in columns.h
+    llvm::StructType* column_type = llvm::StructType::get(*g_llvm_context, { double_type->getPointerTo(), size_type });
+    llvm::Value* columns_var = g_module->getOrInsertGlobal("g_columns", column_type->getPointerTo());
+    llvm::Value* count_var = g_module->getOrInsertGlobal("g_column_count", size_type);
+
+    // negative values wrap around, so one unsigned comparison checks both bounds
+    column = CastValue(column, size_type);
+    index = CastValue(index, size_type);
+    llvm::Function* func = g_ir_builder->GetInsertBlock()->getParent();
+    llvm::BasicBlock* column_block = g_ir_builder->GetInsertBlock();
+    llvm::BasicBlock* index_block = llvm::BasicBlock::Create(*g_llvm_context, "columnindex", func);
+    llvm::BasicBlock* load_block = llvm::BasicBlock::Create(*g_llvm_context, "columnload", func);
+    llvm::BasicBlock* after_block = llvm::BasicBlock::Create(*g_llvm_context, "aftercolumn", func);
+
+    llvm::Value* count = CreateInvariantLoad(size_type, count_var, "columncount");
+    g_ir_builder->CreateCondBr(g_ir_builder->CreateICmpULT(column, count), index_block, after_block);
+
+    g_ir_builder->SetInsertPoint(index_block);
+    llvm::Value* columns = CreateInvariantLoad(column_type->getPointerTo(), columns_var, "columns");
+    llvm::Value* size_ptr = g_ir_builder->CreateInBoundsGEP(
+        column_type, columns, { column, g_ir_builder->getInt32(1) });
+    llvm::Value* size = CreateInvariantLoad(size_type, size_ptr, "columnsize");
+    g_ir_builder->CreateCondBr(g_ir_builder->CreateICmpULT(index, size), load_block, after_block);
+
+    g_ir_builder->SetInsertPoint(load_block);
+    llvm::Value* data_ptr = g_ir_builder->CreateInBoundsGEP(
+        column_type, columns, { column, g_ir_builder->getInt32(0) });
+    llvm::Value* data = CreateInvariantLoad(double_type->getPointerTo(), data_ptr, "columndata");
+    llvm::Value* value = CreateInvariantLoad(
+        double_type, g_ir_builder->CreateInBoundsGEP(double_type, data, index), "columnvalue");
+    g_ir_builder->CreateBr(after_block);
+
+    g_ir_builder->SetInsertPoint(after_block);
+    llvm::PHINode* result = g_ir_builder->CreatePHI(double_type, 3, "columnget");
+    llvm::Value* nan = llvm::ConstantFP::getNaN(double_type);
+    result->addIncoming(nan, column_block);
+    result->addIncoming(nan, index_block);
+    result->addIncoming(value, load_block);
+    return result;
+}
+
+// math builtins lowered to LLVM intrinsics, so that calls are constant folded, hoisted and vectorized
+// they are named after the C functions, so `extern sin(x)` from before still declares the same function
+static const std::unordered_map<std::string, std::pair<llvm::Intrinsic::ID, size_t>> math_intrinsics = {
+    { "sqrt", { llvm::Intrinsic::sqrt, 1 } },
+    { "fabs", { llvm::Intrinsic::fabs, 1 } },
+    { "floor", { llvm::Intrinsic::floor, 1 } },
+    { "ceil", { llvm::Intrinsic::ceil, 1 } },
+    { "round", { llvm::Intrinsic::round, 1 } },
+    { "trunc", { llvm::Intrinsic::trunc, 1 } },
+    { "sin", { llvm::Intrinsic::sin, 1 } },
+    { "cos", { llvm::Intrinsic::cos, 1 } },
+    { "exp", { llvm::Intrinsic::exp, 1 } },
+    { "exp2", { llvm::Intrinsic::exp2, 1 } },
+    { "log", { llvm::Intrinsic::log, 1 } },
+    { "log2", { llvm::Intrinsic::log2, 1 } },
+    { "log10", { llvm::Intrinsic::log10, 1 } },
+    { "pow", { llvm::Intrinsic::pow, 2 } },
+    { "fmin", { llvm::Intrinsic::minnum, 2 } },
+    { "fmax", { llvm::Intrinsic::maxnum, 2 } },
+    { "copysign", { llvm::Intrinsic::copysign, 2 } },
+    { "fma", { llvm::Intrinsic::fma, 3 } }
+};
+
+llvm::Value* CallExprAST::CodeGen() {
     std::vector<llvm::Value*> args;
     for (std::unique_ptr<ExprAST>& arg_expr : args_) {
         args.push_back(arg_expr->CodeGen());
     }
 
-    return g_ir_builder.CreateCall(callee, args, "calltmp");
+    // the builtins, unless a function of the same name is defined
+    if (callee_ == "column_get" && args.size() == 2 && name2func_ast.find(callee_) == name2func_ast.end()) {
+        return CastValue(CodeGenColumnGet(args[0], args[1]), GetLLVMType(g_type_info->TypeOf(this)));
+    }
+    auto intrinsic = math_intrinsics.find(callee_);
+    if (intrinsic != math_intrinsics.end() && args.size() == intrinsic->second.second &&
+        name2func_ast.find(callee_) == name2func_ast.end()) {
+        llvm::Type* double_type = llvm::Type::getDoubleTy(*g_llvm_context);
+        for (llvm::Value*& arg : args) {
+            arg = CastValue(arg, double_type);
+        }
+        llvm::Function* func = llvm::Intrinsic::getDeclaration(g_module.get(), intrinsic->second.first, { double_type });
+        return CastValue(g_ir_builder->CreateCall(func, args, "calltmp"), GetLLVMType(g_type_info->TypeOf(this)));
+    }
+
+    return CreateKaleidoscopeCall(this, callee_, args, "calltmp");
 }
 
 llvm::Value* PrototypeAST::CodeGen() {
     // create kaleidoscope function type: double (doube, double, ..., double)
-    std::vector<llvm::Type*> doubles(args_.size(), llvm::Type::getDoubleTy(g_llvm_context));
+    std::vector<llvm::Type*> doubles(args_.size(), llvm::Type::getDoubleTy(*g_llvm_context));
 
     // function is unique，so use 'get' not 'new'/'create'
-    llvm::FunctionType* function_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(g_llvm_context), doubles, false);
+    llvm::FunctionType* function_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_llvm_context), doubles, false);
 
     // create function, ExternalLinkage means function may not be defined in current module
     // we register it using name_ in current module `g_module`, so that can query it using this name later
@@ -190,9 +409,51 @@ llvm::Value* PrototypeAST::CodeGen() {
     return func;
 }
 
+// const `name` is written by `writer`: fold it no more, and recompile the functions which folded it (but the writer,
+// which is being compiled), their stubs then call code which reads the global
+static void DemoteConst(const std::string& name, const std::string& writer) {
+    g_const_values.erase(name);
+    std::unordered_set<std::string> users = std::move(g_const_users[name]);
+    g_const_users.erase(name);
+    // copies inlined into batch entry points may have folded it too, and so may cached top level expressions
+    g_batch_functions.clear();
+    DropCachedExpressions("");
+
+    // the writer's module is being generated, so the users go into a module of their own
+    std::unique_ptr<llvm::Module> module = std::move(g_module);
+    std::unique_ptr<llvm::legacy::FunctionPassManager> fpm = std::move(g_fpm);
+    ++modules_set_aside;
+    ReCreateModule();
+
+    for (auto& user : users) {
+        // top level expressions are not called again
+        auto func_ast = name2func_ast.find(user);
+        if (user == writer || func_ast == name2func_ast.end()) {
+            continue;
+        }
+        func_ast->second->CodeGen();
+        for (auto& key : SpecializationKeys(user)) {
+            Specialization& spec = g_specializations.at(key);
+            if (spec.emitted) {
+                spec.emitted = false;
+                GetSpecializedFunction(key);
+            }
+        }
+    }
+    CodeGenSpecializations();
+    if (!g_module->empty()) {
+        PhaseTimer timer(PHASE_ADD_MODULE);
+        g_jit->addTieredModule(std::move(g_module));
+    }
+
+    g_module = std::move(module);
+    g_fpm = std::move(fpm);
+    --modules_set_aside;
+}
+
 llvm::Value* FunctionAST::CodeGen() {
     PrototypeAST& proto = *proto_;
-    name2proto_ast[proto.name()] = std::move(proto_); // transfer ownership
+    name2proto_ast[proto.name()] = proto_; // share ownership
 
     llvm::Function* func = GetFunction(proto.name());
 
@@ -201,10 +462,41 @@ llvm::Value* FunctionAST::CodeGen() {
         g_binop_precedence[proto.GetOpName()] = proto.op_precedence();
     }
 
+    // the double ABI entry point used by host callers and all-double call sites
+    TypeInfo info;
+    InferFunctionType(*this, std::vector<ValueType>(proto.args().size(), TYPE_DOUBLE), info);
+
+    // before the body reads them, so that it does not fold a value it overwrites
+    for (auto& name : info.assigned_globals) {
+        if (proto.name() != top_level_expr_name) {
+            g_written_globals.insert(name);
+        }
+        if (g_const_values.count(name) > 0) {
+            DemoteConst(name, proto.name());
+        }
+    }
+    CodeGenBody(func, info);
+
+    return func;
+}
+
+llvm::Function* FunctionAST::CodeGenSpecialization(const std::string& key) {
+    llvm::Function* func = GetSpecializedFunction(key);
+    CodeGenBody(func, g_specializations.at(key).type_info);
+    return func;
+}
+
+void FunctionAST::CodeGenBody(llvm::Function* func, const TypeInfo& info) {
+    PhaseTimer timer(PHASE_CODEGEN, func->getName().str());
+    const TypeInfo* outer_type_info = g_type_info;
+    const FunctionAST* outer_function = g_codegen_function;
+    g_type_info = &info;
+    g_codegen_function = this;
+
     // create a block and set insert point
     // llvm block can be used for defining control flow graph
-    llvm::BasicBlock* block = llvm::BasicBlock::Create(g_llvm_context, "entry", func);
-    g_ir_builder.SetInsertPoint(block);
+    llvm::BasicBlock* block = llvm::BasicBlock::Create(*g_llvm_context, "entry", func);
+    g_ir_builder->SetInsertPoint(block);
 
     // register function arguments to `g_local_named_vars`, so VariableExprAST can codegen
     g_local_named_vars.clear();
@@ -212,9 +504,11 @@ llvm::Value* FunctionAST::CodeGen() {
         // create a variable on stack for each function argument & assign the initial value
         // set argument name and corresponding variable into g_local_named_vars
         // so that in later code piece we can ref the on stack variable
-        llvm::AllocaInst* var = CreateEntryBlockAlloca(func, (std::string) arg.getName());
-        g_ir_builder.CreateStore(&arg, var);
-        g_local_named_vars[(std::string) arg.getName()] = var;
+        // the variable may be wider than the argument if it is re-assigned in the body
+        std::string arg_name = (std::string) arg.getName();
+        llvm::AllocaInst* var = CreateEntryBlockAlloca(func, arg_name, GetLLVMType(info.VarType(arg_name)));
+        g_ir_builder->CreateStore(CastValue(&arg, GetLLVMType(info.VarType(arg_name))), var);
+        g_local_named_vars[arg_name] = var;
     }
 
     // codegen body then return
@@ -223,43 +517,49 @@ llvm::Value* FunctionAST::CodeGen() {
         ret_val = expr->CodeGen();
     }
     if (ret_val == nullptr) {
-        ret_val = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(g_llvm_context));
+        ret_val = llvm::Constant::getNullValue(func->getReturnType());
     }
 
-    g_ir_builder.CreateRet(ret_val);
+    g_ir_builder->CreateRet(CastValue(ret_val, func->getReturnType()));
     llvm::verifyFunction(*func);
 
-    // add optimization for function codegen
-    g_fpm->run(*func);
+    // add optimization for function codegen, the baseline tier of the tiered JIT runs at -O0
+    if (!g_jit->isTieringEnabled()) {
+        PhaseTimer optimize_timer(PHASE_OPTIMIZE, func->getName().str());
+        g_fpm->run(*func);
+    }
 
-    return func;
+    g_type_info = outer_type_info;
+    g_codegen_function = outer_function;
 }
 
 llvm::Value* IfExprAST::CodeGen() {
     llvm::Value* cond_value = cond_->CodeGen();
 
-    // convert condition to a bool by comparing non-equal to 0.0
-    cond_value = g_ir_builder.CreateFCmpONE(
-        cond_value, llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(0.0)), "ifcond");
+    // convert condition to a bool by comparing non-equal to 0
+    cond_value = CastValue(cond_value, GetLLVMType(TYPE_BOOL));
+
+    // both branches are converted to the joined type of the if expression
+    llvm::Type* if_type = GetLLVMType(g_type_info->TypeOf(this));
 
     // since we will create a block for each function, so here we must be already inside a block
     // we can access the parent function via the current block
-    llvm::Function* func = g_ir_builder.GetInsertBlock()->getParent();
+    llvm::Function* func = g_ir_builder->GetInsertBlock()->getParent();
 
     // create blocks for the then and else cases
     // insert the 'then' block at the end of the function
     llvm::BasicBlock* then_block =
-        llvm::BasicBlock::Create(g_llvm_context, "then", func);
+        llvm::BasicBlock::Create(*g_llvm_context, "then", func);
     llvm::BasicBlock* else_block =
-        llvm::BasicBlock::Create(g_llvm_context, "else");
+        llvm::BasicBlock::Create(*g_llvm_context, "else");
     llvm::BasicBlock* final_block =
-        llvm::BasicBlock::Create(g_llvm_context, "ifcont");
+        llvm::BasicBlock::Create(*g_llvm_context, "ifcont");
 
     // create jump instruction, use cond_value to choose then_block/else_block
-    g_ir_builder.CreateCondBr(cond_value, then_block, else_block);
+    g_ir_builder->CreateCondBr(cond_value, then_block, else_block);
 
     // emit then value
-    g_ir_builder.SetInsertPoint(then_block);
+    g_ir_builder->SetInsertPoint(then_block);
 
     // codegen then_block, add instruction to jump to final_block
     llvm::Value* then_value = nullptr;
@@ -267,22 +567,23 @@ llvm::Value* IfExprAST::CodeGen() {
         then_value = expr->CodeGen();
     }
     if (then_value == nullptr) {
-        then_value = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(g_llvm_context));
+        then_value = llvm::Constant::getNullValue(if_type);
     }
+    then_value = CastValue(then_value, if_type);
 
-    g_ir_builder.CreateBr(final_block);
+    g_ir_builder->CreateBr(final_block);
 
     // inside then statement, there may be nested if-then-else,
     // with nested codegen, it will change the current block,
     // we use the block which has the final result as the current then_block
-    then_block = g_ir_builder.GetInsertBlock();
+    then_block = g_ir_builder->GetInsertBlock();
 
     // we only add else_block here in order to guarantee
     // the else_block is put behind the most outer then_block above
     func->getBasicBlockList().push_back(else_block);
 
     // emit else value
-    g_ir_builder.SetInsertPoint(else_block);
+    g_ir_builder->SetInsertPoint(else_block);
 
     // codegen else_block, similar to then_block
     llvm::Value* else_value = nullptr;
@@ -290,24 +591,24 @@ llvm::Value* IfExprAST::CodeGen() {
         else_value = expr->CodeGen();
     }
     if (else_value == nullptr) {
-        else_value = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(g_llvm_context));
+        else_value = llvm::Constant::getNullValue(if_type);
     }
+    else_value = CastValue(else_value, if_type);
 
-    g_ir_builder.CreateBr(final_block);
+    g_ir_builder->CreateBr(final_block);
 
     // same reason as then_block (nested if-then-else)
-    else_block = g_ir_builder.GetInsertBlock();
+    else_block = g_ir_builder->GetInsertBlock();
 
     // same reason as else_block
     func->getBasicBlockList().push_back(final_block);
 
     // emit final block
-    g_ir_builder.SetInsertPoint(final_block);
+    g_ir_builder->SetInsertPoint(final_block);
 
     // NumReservedValues is a hint for the number of incoming edges
     // that this phi node will have (use 0 if you really have no idea)
-    llvm::PHINode* pn = g_ir_builder.CreatePHI(
-        llvm::Type::getDoubleTy(g_llvm_context), 2, "iftmp");
+    llvm::PHINode* pn = g_ir_builder->CreatePHI(if_type, 2, "iftmp");
 
     pn->addIncoming(then_value, then_block);
     pn->addIncoming(else_value, else_block);
@@ -317,10 +618,11 @@ llvm::Value* IfExprAST::CodeGen() {
 
 llvm::Value* ForExprAST::CodeGen() {
     // get current function
-    llvm::Function* func = g_ir_builder.GetInsertBlock()->getParent();
+    llvm::Function* func = g_ir_builder->GetInsertBlock()->getParent();
 
     // create variable on stack, no more phi node
-    llvm::AllocaInst* var = CreateEntryBlockAlloca(func, var_name_);
+    llvm::Type* var_type = GetLLVMType(g_type_info->VarType(var_name_));
+    llvm::AllocaInst* var = CreateEntryBlockAlloca(func, var_name_, var_type);
 
     // now we have a new variable, since it may be referenced in the later code piece
     // so we need to register it into g_named_values
@@ -332,26 +634,25 @@ llvm::Value* ForExprAST::CodeGen() {
     llvm::Value* start_val = start_expr_->CodeGen();
 
     // assign the start_val to var
-    g_ir_builder.CreateStore(start_val, var);
+    g_ir_builder->CreateStore(CastValue(start_val, var_type), var);
 
     // codegen end_expr
     llvm::Value* end_value = end_expr_->CodeGen();
 
-    // end_value = (end_value != 0.0)
-    end_value = g_ir_builder.CreateFCmpONE(
-        end_value, llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(0.0)), "startcond");
+    // end_value = (end_value != 0)
+    end_value = CastValue(end_value, GetLLVMType(TYPE_BOOL));
 
     // add a loop block into current function
-    llvm::BasicBlock* loop_block = llvm::BasicBlock::Create(g_llvm_context, "forloop", func);
+    llvm::BasicBlock* loop_block = llvm::BasicBlock::Create(*g_llvm_context, "forloop", func);
 
     // create block for loop ends
-    llvm::BasicBlock* after_block = llvm::BasicBlock::Create(g_llvm_context, "afterloop", func);
+    llvm::BasicBlock* after_block = llvm::BasicBlock::Create(*g_llvm_context, "afterloop", func);
 
     // use end_value to choose enter loop_block or not
-    g_ir_builder.CreateCondBr(end_value, loop_block, after_block);
+    g_ir_builder->CreateCondBr(end_value, loop_block, after_block);
 
     // now begin to add instructions into loop_block
-    g_ir_builder.SetInsertPoint(loop_block);
+    g_ir_builder->SetInsertPoint(loop_block);
 
     // add body instructions into loop_block
     for (auto& expr : body_expr_) {
@@ -362,30 +663,32 @@ llvm::Value* ForExprAST::CodeGen() {
     llvm::Value* step_value = step_expr_->CodeGen();
 
     // var = var + step_value
-    llvm::Value* curr_value = g_ir_builder.CreateLoad(var);
-    llvm::Value* next_value = g_ir_builder.CreateFAdd(curr_value, step_value, "nextvar");
+    llvm::Value* curr_value = g_ir_builder->CreateLoad(var);
+    step_value = CastValue(step_value, var_type);
+    llvm::Value* next_value = var_type->isDoubleTy()
+        ? g_ir_builder->CreateFAdd(curr_value, step_value, "nextvar")
+        : g_ir_builder->CreateAdd(curr_value, step_value, "nextvar");
 
     // assign next_value back to var
-    g_ir_builder.CreateStore(next_value, var);
+    g_ir_builder->CreateStore(next_value, var);
 
     // codegen end_expr
     end_value = end_expr_->CodeGen();
 
-    // end_value = (end_value != 0.0)
-    end_value = g_ir_builder.CreateFCmpONE(
-        end_value, llvm::ConstantFP::get(g_llvm_context, llvm::APFloat(0.0)), "loopcond");
+    // end_value = (end_value != 0)
+    end_value = CastValue(end_value, GetLLVMType(TYPE_BOOL));
 
     // use end_value to choose enter loop_block again or finish loop
-    g_ir_builder.CreateCondBr(end_value, loop_block, after_block);
+    g_ir_builder->CreateCondBr(end_value, loop_block, after_block);
 
     // add instructions into after_block
-    g_ir_builder.SetInsertPoint(after_block);
+    g_ir_builder->SetInsertPoint(after_block);
 
     // erase var_name when loop ends
     g_local_named_vars.erase(var_name_);
 
     // return 0
-    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(g_llvm_context));
+    return llvm::Constant::getNullValue(GetLLVMType(g_type_info->TypeOf(this)));
 }
 
 llvm::Function* GetFunction(const std::string& name) {
@@ -397,13 +700,145 @@ llvm::Function* GetFunction(const std::string& name) {
     }
     
     // declare function (use PrototypeAST to CodeGen)
-    return (llvm::Function*) name2proto_ast.at(name)->CodeGen();
+    callee = (llvm::Function*) name2proto_ast.at(name)->CodeGen();
+
+    // a definition replacing a math builtin must not be folded as the C function it is named after
+    if (math_intrinsics.count(name) > 0 && name2func_ast.count(name) > 0) {
+        callee->addFnAttr(llvm::Attribute::NoBuiltin);
+    }
+    return callee;
+}
+
+// declare specialization `key` in current module, and queue its body for emission
+llvm::Function* GetSpecializedFunction(const std::string& key) {
+    Specialization& spec = g_specializations.at(key);
+    std::string symbol = SpecializationSymbol(key);
+
+    if (!spec.emitted) {
+        spec.emitted = true;
+        g_pending_specializations.push_back(key);
+    }
+
+    llvm::Function* func = g_module->getFunction(symbol);
+    if (func != nullptr) {
+        return func;
+    }
+
+    std::vector<llvm::Type*> arg_types;
+    for (ValueType type : spec.arg_types) {
+        arg_types.push_back(GetLLVMType(type));
+    }
+    llvm::FunctionType* function_type = llvm::FunctionType::get(GetLLVMType(spec.ret_type), arg_types, false);
+    func = llvm::Function::Create(function_type, llvm::Function::ExternalLinkage, symbol, *g_module);
+
+    int index = 0;
+    const std::vector<std::string>& arg_names = name2func_ast.at(spec.func_name)->proto().args();
+    for (auto& arg : func->args()) {
+        arg.setName(arg_names[index++]);
+    }
+
+    return func;
+}
+
+// call a kaleidoscope function (or operator), using the specialization chosen by type inference if any
+llvm::Value* CreateKaleidoscopeCall(
+  const ExprAST* node, const std::string& name, const std::vector<llvm::Value*>& args, const std::string& tmp_name) {
+    auto spec = g_type_info->callees.find(node);
+    llvm::Function* callee = spec == g_type_info->callees.end() ? GetFunction(name) : GetSpecializedFunction(spec->second);
+
+    std::vector<llvm::Value*> cast_args;
+    for (size_t i = 0; i < args.size(); ++i) {
+        cast_args.push_back(CastValue(args[i], callee->getFunctionType()->getParamType(i)));
+    }
+
+    llvm::Value* result = g_ir_builder->CreateCall(callee, cast_args, tmp_name);
+    return CastValue(result, GetLLVMType(g_type_info->TypeOf(node)));
+}
+
+// lower an inferred type, a type which is still unknown falls back to double
+llvm::Type* GetLLVMType(ValueType type) {
+    switch (type) {
+        case TYPE_BOOL: return llvm::Type::getInt1Ty(*g_llvm_context);
+        case TYPE_INT: return llvm::Type::getInt64Ty(*g_llvm_context);
+        default: return llvm::Type::getDoubleTy(*g_llvm_context);
+    }
+}
+
+// convert a value between the lowered types: i1, i64 and double
+llvm::Value* CastValue(llvm::Value* value, llvm::Type* type) {
+    llvm::Type* value_type = value->getType();
+    if (value_type == type) {
+        return value;
+    }
+
+    // to bool: compare non-equal to 0
+    if (type->isIntegerTy(1)) {
+        if (value_type->isDoubleTy()) {
+            return g_ir_builder->CreateFCmpONE(
+                value, llvm::ConstantFP::get(*g_llvm_context, llvm::APFloat(0.0)), "tobool");
+        }
+        return g_ir_builder->CreateICmpNE(value, llvm::Constant::getNullValue(value_type), "tobool");
+    }
+
+    // to integer: widening from bool, inference never narrows a double but keep it total
+    if (type->isIntegerTy()) {
+        if (value_type->isDoubleTy()) {
+            return g_ir_builder->CreateFPToSI(value, type, "toint");
+        }
+        return g_ir_builder->CreateZExt(value, type, "toint");
+    }
+
+    // to double: convert 0/1 to 0.0/1.0
+    if (value_type->isIntegerTy(1)) {
+        return g_ir_builder->CreateUIToFP(value, type, "todouble");
+    }
+    return g_ir_builder->CreateSIToFP(value, type, "todouble");
 }
 
 // add memory allocate instruction in the entry-block of function
-llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func, const std::string& var_name) {
+llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func, const std::string& var_name, llvm::Type* type) {
     llvm::IRBuilder<> ir_builder(&(func->getEntryBlock()), func->getEntryBlock().begin());
-    return ir_builder.CreateAlloca(llvm::Type::getDoubleTy(g_llvm_context), nullptr, var_name.c_str());
+    if (type == nullptr) {
+        type = llvm::Type::getDoubleTy(*g_llvm_context);
+    }
+    return ir_builder.CreateAlloca(type, nullptr, var_name.c_str());
+}
+
+// make the symbol of the defining instance known to g_jit, the code of a JIT (a snapshot's included) passes the
+// instance of the thread it is added on, and not one baked into its object
+static void DefineInstanceSymbol() {
+    if (instance_symbol_jit != g_jit.get()) {
+        g_jit->defineAbsoluteSymbol(defining_instance_symbol, (llvm::JITTargetAddress) DefiningGlobalsInstance());
+        instance_symbol_jit = g_jit.get();
+    }
+}
+
+// address of a global in the GlobalsInstance of the running thread
+static llvm::Value* CreateGlobalSlotPtr(size_t slot) {
+    DefineInstanceSymbol();
+    llvm::Type* double_type = llvm::Type::getDoubleTy(*g_llvm_context);
+    llvm::Type* instance_type = llvm::Type::getInt8Ty(*g_llvm_context);
+    llvm::FunctionCallee accessor = g_module->getOrInsertFunction(
+        "kaleidoscope_instance_globals",
+        llvm::FunctionType::get(double_type->getPointerTo(), { instance_type->getPointerTo() }, false));
+    // the instance does not change while compiled code runs, so GVN merges the calls of a function
+    llvm::Function* accessor_func = llvm::cast<llvm::Function>(accessor.getCallee());
+    accessor_func->setDoesNotAccessMemory();
+    accessor_func->setDoesNotThrow();
+    llvm::Constant* defining = g_module->getOrInsertGlobal(defining_instance_symbol, instance_type);
+    llvm::Value* slots = g_ir_builder->CreateCall(accessor, { defining }, "globals");
+    return g_ir_builder->CreateInBoundsGEP(double_type, slots, g_ir_builder->getInt64(slot), "globalslot");
+}
+
+double* GetGlobalAddress(const std::string& name) {
+    if (g_global_named_vars.find(name) == g_global_named_vars.end()) {
+        return nullptr;
+    }
+    if (g_enable_instance_globals) {
+        DefineInstanceSymbol();
+        return kaleidoscope_instance_globals(DefiningGlobalsInstance()) + g_global_slots.at(name);
+    }
+    return (double*) g_jit->getSymbolAddress(name);
 }
 
 // find variable AllocaInst from local_variable_table and global_variable_table
@@ -411,15 +846,35 @@ llvm::AllocaInst* FindVariableAllocaInst(const std::string& name) {
     if (g_local_named_vars.find(name) != g_local_named_vars.end()) {
         return g_local_named_vars[name];
     }
+    if (g_global_named_vars.find(name) != g_global_named_vars.end() && g_enable_instance_globals) {
+        return (llvm::AllocaInst*) CreateGlobalSlotPtr(g_global_slots.at(name));
+    }
     if (g_global_named_vars.find(name) != g_global_named_vars.end()) {
-        return g_global_named_vars[name];
+        // the module which defined the global is freed once compiled, so refer to it through
+        // a declaration in the current module, the JIT links them by name
+        g_module->getOrInsertGlobal(name, llvm::Type::getDoubleTy(*g_llvm_context));
+        return (llvm::AllocaInst*) g_module->getNamedGlobal(name);
     }
     return nullptr;
 }
 
 void ReCreateModule() {
+    // the previous module has been compiled (and freed) by the JIT, unless it is set aside, so nothing refers to
+    // the context anymore: start over from an empty one, with what the old one uniqued freed
+    bool recycle = g_context_recycle_modules > 0 && context_modules >= g_context_recycle_modules;
+    if (!g_llvm_context || (recycle && modules_set_aside == 0)) {
+        recycled_contexts += g_llvm_context ? 1 : 0;
+        g_fpm.reset();
+        g_module.reset();
+        g_ir_builder.reset();
+        g_llvm_context = std::make_unique<llvm::LLVMContext>();
+        g_ir_builder = std::make_unique<llvm::IRBuilder<>>(*g_llvm_context);
+        context_modules = 0;
+    }
+    ++context_modules;
+
     // open a new module
-    g_module = std::make_unique<llvm::Module>("kaleidoscope jit", g_llvm_context);
+    g_module = std::make_unique<llvm::Module>("kaleidoscope jit", *g_llvm_context);
     g_module->setDataLayout(g_jit->getTargetMachine().createDataLayout());
 
     // create a new pass manager attached to g_module
@@ -439,67 +894,668 @@ void ReCreateModule() {
     g_fpm->doInitialization();
 }
 
-void ParseDefinitionToken() {
-    auto ast = ParseDefinition();
+uint64_t GetRecycledContextCount() {
+    return recycled_contexts;
+}
+
+// print IR to stderr, then a newline to `newline_stream`
+static void PrintIR(const llvm::Value& value, OutputStream newline_stream = OUTPUT_STDERR) {
+    std::string ir;
+    llvm::raw_string_ostream ir_stream(ir);
+    value.print(ir_stream);
+    WriteOutput(OUTPUT_STDERR, ir_stream.str());
+    WriteOutput(newline_stream, "\n");
+}
+
+void CodeGenSpecializations() {
+    // emitting a specialization may reference further ones
+    for (size_t i = 0; i < g_pending_specializations.size(); ++i) {
+        const std::string key = g_pending_specializations[i];
+        const std::string& func_name = g_specializations.at(key).func_name;
+        llvm::Function* func = name2func_ast.at(func_name)->CodeGenSpecialization(key);
+        if (g_enable_ir_print) {
+            WriteOutput(OUTPUT_STDOUT, "Specialized a function definition:\n");
+            PrintIR(*func);
+        }
+    }
+    g_pending_specializations.clear();
+}
+
+void EmitSpecializations() {
+    if (g_pending_specializations.empty()) {
+        return;
+    }
+
+    // they all go into the same module which is never removed, even if it was requested by a top level expression
+    CodeGenSpecializations();
+    {
+        PhaseTimer timer(PHASE_ADD_MODULE);
+        g_jit->addTieredModule(std::move(g_module));
+    }
+    ReCreateModule();
+}
+
+// operators generated inline, the others call their definition
+static const std::set<std::string> builtin_binary_ops = {
+    "&&", "||", "==", "!=", "<=", ">=", "<", ">", "+", "-", "*", "/", "="
+};
+static const std::set<std::string> builtin_unary_ops = { "!", "-" };
+
+// check that `name` can be called with `arg_count` arguments, as a declared function, the function being validated,
+// or a builtin
+static bool ValidateCallee(const NameScope& scope, const std::string& name, size_t arg_count, std::string& error) {
+    const PrototypeAST* proto = nullptr;
+    auto declared = name2proto_ast.find(name);
+    if (scope.function != nullptr && scope.function->name() == name) {
+        proto = scope.function;
+    } else if (declared != name2proto_ast.end()) {
+        proto = declared->second.get();
+    }
+
+    if (proto == nullptr) {
+        auto intrinsic = math_intrinsics.find(name);
+        if ((name == "column_get" && arg_count == 2) ||
+            (intrinsic != math_intrinsics.end() && intrinsic->second.second == arg_count)) {
+            return true;
+        }
+        error = name + " is not defined";
+        return false;
+    }
+    if (proto->args().size() != arg_count) {
+        error = name + " takes " + std::to_string(proto->args().size()) + " arguments, called with " +
+            std::to_string(arg_count);
+        return false;
+    }
+    return true;
+}
+
+static bool ValidateBody(const std::vector<std::unique_ptr<ExprAST>>& body, NameScope& scope, std::string& error) {
+    for (auto& expr : body) {
+        if (!expr->Validate(scope, error)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool NumberExprAST::Validate(NameScope& scope, std::string& error) const {
+    return true;
+}
+
+bool VariableExprAST::Validate(NameScope& scope, std::string& error) const {
+    if (scope.locals.count(name_) == 0 && g_global_named_vars.count(name_) == 0 && g_const_values.count(name_) == 0) {
+        error = "variable " + name_ + " is not defined";
+        return false;
+    }
+    return true;
+}
+
+bool BinaryExprAST::Validate(NameScope& scope, std::string& error) const {
+    if (op_ == "=") {
+        auto var = dynamic_cast<const VariableExprAST*>(lhs_.get());
+        if (var == nullptr) {
+            error = "only a variable can be assigned";
+            return false;
+        }
+        // the variable is created before its value is generated
+        scope.locals.insert(var->name());
+        return rhs_->Validate(scope, error);
+    }
+    if (!lhs_->Validate(scope, error) || !rhs_->Validate(scope, error)) {
+        return false;
+    }
+    return builtin_binary_ops.count(op_) > 0 || ValidateCallee(scope, "binary" + op_, 2, error);
+}
+
+bool UnaryExprAST::Validate(NameScope& scope, std::string& error) const {
+    if (!operand_->Validate(scope, error)) {
+        return false;
+    }
+    return builtin_unary_ops.count(op_) > 0 || ValidateCallee(scope, "unary" + op_, 1, error);
+}
+
+bool CallExprAST::Validate(NameScope& scope, std::string& error) const {
+    return ValidateBody(args_, scope, error) && ValidateCallee(scope, callee_, args_.size(), error);
+}
+
+bool IfExprAST::Validate(NameScope& scope, std::string& error) const {
+    return cond_->Validate(scope, error) && ValidateBody(then_expr_, scope, error) &&
+        ValidateBody(else_expr_, scope, error);
+}
+
+bool ForExprAST::Validate(NameScope& scope, std::string& error) const {
+    // the loop variable is visible from its start value on, and goes away with the loop
+    scope.locals.insert(var_name_);
+    if (!start_expr_->Validate(scope, error) || !end_expr_->Validate(scope, error) ||
+        !ValidateBody(body_expr_, scope, error) || !step_expr_->Validate(scope, error)) {
+        return false;
+    }
+    scope.locals.erase(var_name_);
+    return true;
+}
+
+bool PrototypeAST::Validate(NameScope& scope, std::string& error) const {
+    return true;
+}
+
+bool FunctionAST::Validate(NameScope& scope, std::string& error) const {
+    scope.function = proto_.get();
+    scope.locals.insert(proto_->args().begin(), proto_->args().end());
+    return ValidateBody(body_, scope, error);
+}
+
+// check a definition or a top level expression before anything of it is registered or generated
+static bool ValidateFunction(const FunctionAST& ast, std::string& error) {
+    NameScope scope;
+    return ast.Validate(scope, error);
+}
+
+// move the specializations inferred against the result of specialization `key` of `func_name` into `stale`
+static void TakeDependentSpecializations(
+  const std::string& key, const std::string& func_name, std::map<std::string, Specialization>& stale) {
+    for (auto& caller : g_function_callers[func_name]) {
+        for (auto& caller_key : SpecializationKeys(caller)) {
+            auto spec = g_specializations.find(caller_key);
+            const auto& callees = spec->second.type_info.callees;
+            bool calls_key = std::any_of(callees.begin(), callees.end(), [&](const auto& callee) {
+                return callee.second == key;
+            });
+            if (calls_key) {
+                stale[caller_key] = std::move(spec->second);
+                g_specializations.erase(spec);
+            }
+        }
+    }
+}
+
+// `name` has been redefined with `previous_arity` arguments before, and `previous` are its specializations before:
+// infer them again, with the ones inferred against a result which changed, and generate the emitted ones into the
+// current module, their callers reach the new code through their stubs
+// only the functions calling a specialization whose return type or range changed (or `name`, if its arity did) are
+// generated again, a body-only change generates nothing but the new definition and its specializations
+static void RespecializeCallers(
+  const std::string& name, std::map<std::string, Specialization> previous, size_t previous_arity) {
+    std::set<std::string> changed;
+    if (name2func_ast.at(name)->proto().args().size() != previous_arity) {
+        changed.insert(name);
+    }
+
+    std::set<std::string> emitted;
+    while (!previous.empty()) {
+        std::map<std::string, Specialization> stale;
+        for (auto& spec : previous) {
+            const Specialization& old = spec.second;
+            // one of another arity has no call site left, one never emitted is inferred again on demand
+            bool was_emitted = old.emitted || emitted.count(spec.first) > 0;
+            if (!was_emitted || name2func_ast.at(old.func_name)->proto().args().size() != old.arg_types.size()) {
+                TakeDependentSpecializations(spec.first, old.func_name, stale);
+                continue;
+            }
+            emitted.insert(spec.first);
+            ResolveSpecialization(spec.first, old.func_name, old.arg_types);
+            // a narrower range is still right for the callers, another type is another symbol
+            const Specialization& current = g_specializations.at(spec.first);
+            bool same_result = current.ret_type == old.ret_type && (current.ret_type != TYPE_INT ||
+                (current.ret_range.lo >= old.ret_range.lo && current.ret_range.hi <= old.ret_range.hi));
+            if (!same_result) {
+                changed.insert(old.func_name);
+                TakeDependentSpecializations(spec.first, old.func_name, stale);
+            }
+        }
+        previous = std::move(stale);
+    }
+
+    std::set<std::string> callers;
+    for (auto& func_name : changed) {
+        for (auto& caller : g_function_callers[func_name]) {
+            if (callers.count(caller) > 0 || (caller == name && func_name == name)) {
+                continue;
+            }
+            std::string error;
+            if (caller == name) {
+                // the new body, generated against a result which changed since
+                g_module->getFunction(name)->deleteBody();
+            } else if (!ValidateFunction(*name2func_ast.at(caller), error)) {
+                // a caller which does not compile against the new prototype keeps its code
+                continue;
+            }
+            callers.insert(caller);
+            name2func_ast.at(caller)->CodeGen();
+        }
+    }
+    callers.insert(name);
+
+    for (auto& key : emitted) {
+        auto spec = g_specializations.find(key);
+        // inferred again on demand, or queued by the code generated above
+        if (spec == g_specializations.end() || spec->second.emitted) {
+            continue;
+        }
+        std::string error;
+        const std::string& func_name = spec->second.func_name;
+        if (callers.count(func_name) == 0 && !ValidateFunction(*name2func_ast.at(func_name), error)) {
+            continue;
+        }
+        // queued before it was inferred again
+        auto pending = std::find(g_pending_specializations.begin(), g_pending_specializations.end(), key);
+        if (pending != g_pending_specializations.end()) {
+            spec->second.emitted = true;
+        } else {
+            GetSpecializedFunction(key);
+        }
+    }
+}
+
+bool CompileDefinition(std::shared_ptr<FunctionAST> ast, std::string& error) {
+    auto jit_lock = g_jit->acquireLock();
+    if (!ValidateFunction(*ast, error)) {
+        return false;
+    }
+
+    // a redefinition takes the specializations of the previous body out, before the new body may call them, the
+    // emitted ones are inferred and generated again below
+    const std::string& name = ast->proto().name();
+    bool is_redefinition = name2func_ast.count(name) > 0;
+    std::map<std::string, Specialization> previous;
+    size_t previous_arity = 0;
+    if (is_redefinition) {
+        previous_arity = name2func_ast.at(name)->proto().args().size();
+        for (auto& key : SpecializationKeys(name)) {
+            auto spec = g_specializations.find(key);
+            previous[key] = std::move(spec->second);
+            g_specializations.erase(spec);
+        }
+    }
+
+    // keep the body, so that later call sites can specialize it
+    RegisterFunctionAST(ast);
+    // cached expressions calling it may call specializations of the previous body
+    DropCachedExpressions(name);
+
     if (g_enable_ir_print) {
-        std::cout << "Parsed a function definition:" << std::endl;
-        ast->CodeGen()->print(llvm::errs());
-        std::cerr << std::endl;
+        WriteOutput(OUTPUT_STDOUT, "Parsed a function definition:\n");
+        PrintIR(*ast->CodeGen());
     } else {
+        PhaseTimer timer(PHASE_CODEGEN);
         ast->CodeGen();
     }
+    if (is_redefinition) {
+        PhaseTimer timer(PHASE_CODEGEN);
+        RespecializeCallers(name, std::move(previous), previous_arity);
+    }
 
-    g_jit->addModule(std::move(g_module));
+    {
+        PhaseTimer timer(PHASE_ADD_MODULE);
+        g_jit->addTieredModule(std::move(g_module));
+    }
     ReCreateModule();
+
+    EmitSpecializations();
+    RemoveDroppedExpressions();
+    return true;
 }
 
-void ParseExternToken() {
-    auto ast = ParseExtern();
+void CompileExtern(std::unique_ptr<PrototypeAST> ast) {
+    auto jit_lock = g_jit->acquireLock();
     if (g_enable_ir_print) {
-        std::cout << "Parsed an extern:" << std::endl;
-        ast->CodeGen()->print(llvm::errs());
-        std::cerr << std::endl;
+        WriteOutput(OUTPUT_STDOUT, "Parsed an extern:\n");
+        PrintIR(*ast->CodeGen());
     } else {
+        PhaseTimer timer(PHASE_CODEGEN);
         ast->CodeGen();
     }
 
     name2proto_ast[ast->name()] = std::move(ast);
 }
 
-void ParseTopLevel() {
-    auto ast = ParseTopLevelExpr();
+bool RunTopLevel(std::unique_ptr<FunctionAST> ast, double& result, std::string& error) {
+    auto jit_lock = g_jit->acquireLock();
+    if (!ValidateFunction(*ast, error)) {
+        return false;
+    }
+
+    // reuse the code of an expression of the same structure, unless its IR is to be printed
+    bool use_cache = g_expr_cache_capacity > 0 && !g_enable_ir_print;
+    ExprKey key;
+    double (*fp)() = nullptr;
+    if (use_cache) {
+        PhaseTimer timer(PHASE_LOOKUP);
+        fp = FindCachedExpression(*ast, key);
+    }
+    bool is_cached = fp != nullptr;
+
+    llvm::orc::VModuleKey moduleKey = 0;
+    if (fp == nullptr) {
+        llvm::Function* func;
+        if (g_enable_ir_print) {
+            WriteOutput(OUTPUT_STDOUT, "Parsed a top level expr:\n");
+            func = (llvm::Function*) ast->CodeGen();
+            PrintIR(*func, OUTPUT_STDOUT);
+        } else {
+            PhaseTimer timer(PHASE_CODEGEN);
+            // the code of an expression which is not cached can fold its literals
+            g_lifting_key = use_cache && key.cacheable ? &key : nullptr;
+            func = (llvm::Function*) ast->CodeGen();
+            g_lifting_key = nullptr;
+        }
+
+        // a cached expression stays loaded, so its function needs a name of its own
+        std::string name = top_level_expr_name;
+        if (use_cache && key.cacheable) {
+            name = CachedExpressionName();
+            func->setName(name);
+        }
+
+        {
+            PhaseTimer timer(PHASE_ADD_MODULE);
+            moduleKey = g_jit->addModule(std::move(g_module));
+        }
+
+        // re-create g_module for next time using
+        ReCreateModule();
+
+        // specializations outlive the top level expression module
+        EmitSpecializations();
+
+        // find compiled function symbol through name
+        llvm::JITTargetAddress address;
+        {
+            PhaseTimer timer(PHASE_LOOKUP);
+            address = g_jit->getSymbolAddress(name);
+        }
+
+        // force cast to C function pointer
+        fp = (double (*)()) address;
+        is_cached = use_cache && CacheExpression(key, moduleKey, fp);
+    }
+
+    // do not block the tier-up thread while running
+    jit_lock.unlock();
+
+    // execute and output, the prefix goes out before anything the expression prints
     if (g_enable_ir_print) {
-        std::cout << "Parsed a top level expr:" << std::endl;
-        ast->CodeGen()->print(llvm::errs());
-        std::cout << std::endl;
-    } else {
-        ast->CodeGen();
+        WriteOutput(OUTPUT_STDOUT, "Evaluated to:\n");
+    } else if (g_enable_result_print) {
+        WriteOutput(OUTPUT_STDOUT, "result> ");
+    }
+    {
+        PhaseTimer timer(PHASE_EXECUTE);
+        result = fp();
+    }
+    if (g_enable_ir_print || g_enable_result_print) {
+        WriteOutput(OUTPUT_STDOUT, result, DOUBLE_GENERAL);
+        WriteOutput(OUTPUT_STDOUT, g_enable_ir_print ? "\n\n" : "\n");
+    }
+
+    jit_lock.lock();
+    // name the sampled frames of the expression while its code is loaded
+    CollectSamples();
+    // the code compiled from now on folds the consts it defined, unless a compiled function writes them
+    for (auto& name : g_pending_consts) {
+        double* address = GetGlobalAddress(name);
+        if (address != nullptr && g_written_globals.count(name) == 0) {
+            g_const_values[name] = *address;
+        }
     }
+    g_pending_consts.clear();
+    if (!is_cached) {
+        g_jit->removeModule(moduleKey);
+    }
+    RemoveDroppedExpressions();
+    return true;
+}
 
-    auto moduleKey = g_jit->addModule(std::move(g_module));
+void WriteCompileError(const std::string& error) {
+    WriteOutput(OUTPUT_STDERR, "error: " + error + "\n");
+}
 
-    // re-create g_module for next time using
-    ReCreateModule();
+void ParseDefinitionToken() {
+    ItemTimer item_timer("def");
+    std::shared_ptr<FunctionAST> ast;
+    {
+        PhaseTimer timer(PHASE_PARSING);
+        ast = ParseDefinition();
+    }
+    if (ast == nullptr) {
+        WriteCompileError("a definition does not parse");
+        return;
+    }
+    item_timer.SetName(ast->proto().name());
+
+    // parsing may block on input, so only lock the JIT for codegen
+    std::string error;
+    if (!CompileDefinition(std::move(ast), error)) {
+        WriteCompileError(error);
+    }
+}
 
-    // find compiled function symbol through name
-    auto symbol = g_jit->findSymbol(top_level_expr_name);
+void ParseExternToken() {
+    ItemTimer item_timer("extern");
+    std::unique_ptr<PrototypeAST> ast;
+    {
+        PhaseTimer timer(PHASE_PARSING);
+        ast = ParseExtern();
+    }
+    if (ast == nullptr) {
+        WriteCompileError("an extern does not parse");
+        return;
+    }
+    item_timer.SetName(ast->name());
+    CompileExtern(std::move(ast));
+}
+
+double ParseTopLevel() {
+    ItemTimer item_timer("expr");
+    std::unique_ptr<FunctionAST> ast;
+    size_t begin = g_token_offset;
+    {
+        PhaseTimer timer(PHASE_PARSING);
+        ast = ParseTopLevelExpr();
+    }
+    if (ast == nullptr) {
+        WriteCompileError("an expression does not parse");
+        // a token which starts no expression is skipped, so that the caller goes on after it
+        if (g_token_offset == begin) {
+            GetNextToken();
+        }
+        return 0;
+    }
+    double result = 0;
+    std::string error;
+    if (!RunTopLevel(std::move(ast), result, error)) {
+        WriteCompileError(error);
+    }
+    return result;
+}
 
-    // force cast to C function pointer
-    double (*fp)() = (double (*)()) (symbol.getAddress().get());
+// the key of the specialization emitted as `symbol`, an empty string if there is none
+static std::string FindSpecializationKey(const std::string& symbol) {
+    for (auto& spec : g_specializations) {
+        if (SpecializationSymbol(spec.first) == symbol) {
+            return spec.first;
+        }
+    }
+    return "";
+}
 
-    // execute and output
+// copy `func_ast` and every function it calls (transitively), specializations included, into g_module, so that
+// they can be inlined
+static void CodeGenCallTree(const std::shared_ptr<FunctionAST>& func_ast, std::vector<std::shared_ptr<FunctionAST>>& sources) {
+    func_ast->CodeGen();
+    sources.push_back(func_ast);
+    bool declared_callee = true;
+    while (declared_callee) {
+        declared_callee = false;
+        for (llvm::Function& func : *g_module) {
+            if (!func.isDeclaration()) {
+                continue;
+            }
+            // generating it may declare more functions, so start over
+            auto callee = name2func_ast.find(func.getName().str());
+            if (callee != name2func_ast.end()) {
+                callee->second->CodeGen();
+                sources.push_back(callee->second);
+                declared_callee = true;
+                break;
+            }
+            std::string key = FindSpecializationKey(func.getName().str());
+            if (!key.empty()) {
+                std::shared_ptr<FunctionAST>& spec_ast = name2func_ast.at(g_specializations.at(key).func_name);
+                spec_ast->CodeGenSpecialization(key);
+                sources.push_back(spec_ast);
+                declared_callee = true;
+                break;
+            }
+        }
+    }
+    for (llvm::Function& func : *g_module) {
+        if (!func.isDeclaration()) {
+            func.setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+    }
+}
+
+// define `<name>$batch(columns, out, n)` in g_module: out[i] = name(columns[0][i], ...) for every i < n
+static void CodeGenBatchLoop(llvm::Function* scalar) {
+    llvm::Type* double_type = llvm::Type::getDoubleTy(*g_llvm_context);
+    llvm::Type* column_type = double_type->getPointerTo();
+    llvm::Type* index_type = llvm::Type::getInt64Ty(*g_llvm_context);
+    llvm::FunctionType* batch_type = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(*g_llvm_context), { column_type->getPointerTo(), column_type, index_type }, false);
+    llvm::Function* batch = llvm::Function::Create(
+        batch_type, llvm::Function::ExternalLinkage, scalar->getName() + "$batch", *g_module);
+    // without this the vectorizer would have to check at run time that stores do not overwrite the columns
+    batch->addParamAttr(1, llvm::Attribute::NoAlias);
+    llvm::Value* columns = batch->getArg(0);
+    llvm::Value* out = batch->getArg(1);
+    llvm::Value* count = batch->getArg(2);
+
+    llvm::BasicBlock* entry_block = llvm::BasicBlock::Create(*g_llvm_context, "entry", batch);
+    llvm::BasicBlock* loop_block = llvm::BasicBlock::Create(*g_llvm_context, "loop", batch);
+    llvm::BasicBlock* exit_block = llvm::BasicBlock::Create(*g_llvm_context, "exit", batch);
+
+    // load the column pointers once, outside the loop
+    g_ir_builder->SetInsertPoint(entry_block);
+    std::vector<llvm::Value*> column_ptrs;
+    for (size_t i = 0; i < scalar->arg_size(); ++i) {
+        llvm::Value* column_ptr = g_ir_builder->CreateInBoundsGEP(column_type, columns, g_ir_builder->getInt64(i));
+        column_ptrs.push_back(g_ir_builder->CreateLoad(column_type, column_ptr, "column"));
+    }
+    g_ir_builder->CreateCondBr(g_ir_builder->CreateICmpEQ(count, g_ir_builder->getInt64(0)), exit_block, loop_block);
+
+    g_ir_builder->SetInsertPoint(loop_block);
+    llvm::PHINode* index = g_ir_builder->CreatePHI(index_type, 2, "i");
+    index->addIncoming(g_ir_builder->getInt64(0), entry_block);
+    std::vector<llvm::Value*> args;
+    for (llvm::Value* column_ptr : column_ptrs) {
+        llvm::Value* element_ptr = g_ir_builder->CreateInBoundsGEP(double_type, column_ptr, index);
+        args.push_back(g_ir_builder->CreateLoad(double_type, element_ptr, "arg"));
+    }
+    llvm::Value* result = g_ir_builder->CreateCall(scalar, args, "result");
+    g_ir_builder->CreateStore(result, g_ir_builder->CreateInBoundsGEP(double_type, out, index));
+    llvm::Value* next_index = g_ir_builder->CreateAdd(index, g_ir_builder->getInt64(1), "next", true, true);
+    index->addIncoming(next_index, loop_block);
+    g_ir_builder->CreateCondBr(g_ir_builder->CreateICmpEQ(next_index, count), exit_block, loop_block);
+
+    g_ir_builder->SetInsertPoint(exit_block);
+    g_ir_builder->CreateRetVoid();
+    llvm::verifyFunction(*batch);
+}
+
+BatchFunction GetBatchFunction(const std::string& name) {
+    auto func_ast = name2func_ast.find(name);
+    if (func_ast == name2func_ast.end()) {
+        return nullptr;
+    }
+
+    // reuse the entry point unless a definition copied into it was replaced since
+    auto cached = g_batch_functions.find(name);
+    if (cached != g_batch_functions.end()) {
+        bool current = true;
+        for (auto& source : cached->second.sources) {
+            auto latest = name2func_ast.find(source->proto().name());
+            current = current && latest != name2func_ast.end() && latest->second == source;
+        }
+        if (current) {
+            return cached->second.address;
+        }
+    }
+
+    auto jit_lock = g_jit->acquireLock();
+
+    // the entry point and its copies go into a module of their own
+    std::unique_ptr<llvm::Module> module = std::move(g_module);
+    std::unique_ptr<llvm::legacy::FunctionPassManager> fpm = std::move(g_fpm);
+    ++modules_set_aside;
+    ReCreateModule();
+
+    BatchFunctionEntry entry;
+    CodeGenCallTree(func_ast->second, entry.sources);
+    CodeGenBatchLoop(g_module->getFunction(name));
     if (g_enable_ir_print) {
-        std::cout << "Evaluated to:" << std::endl;
-        std::cout << fp() << std::endl << std::endl;
-    } else {
-        std::cout << "result> " << fp() << std::endl;
+        WriteOutput(OUTPUT_STDOUT, "Generated a batch entry point:\n");
+        PrintIR(*g_module->getFunction(name + "$batch"));
     }
 
-    g_jit->removeModule(moduleKey);
+    std::unique_ptr<llvm::Module> batch_module = std::move(g_module);
+    g_module = std::move(module);
+    g_fpm = std::move(fpm);
+    --modules_set_aside;
+    // the specializations called by the copies are emitted like any other
+    EmitSpecializations();
+
+    {
+        PhaseTimer timer(PHASE_ADD_MODULE);
+        g_jit->addVectorizedModule(std::move(batch_module));
+    }
+    {
+        PhaseTimer timer(PHASE_LOOKUP);
+        entry.address = (BatchFunction) g_jit->getSymbolAddress(name + "$batch");
+    }
+    g_batch_functions[name] = entry;
+    return entry.address;
 }
 
 // implement a printd function
 extern "C" double printd(double x) {
-    printf("%lf\n", x);
+    WriteOutput(OUTPUT_STDOUT, x, DOUBLE_FIXED);
+    WriteOutput(OUTPUT_STDOUT, "\n");
+    return 0.0;
+}
+
+// write out what printd and result printing buffered so far
+extern "C" double flushd() {
+    FlushOutput();
     return 0.0;
 }
+
+void PrintTierStats() {
+    // after the program's own output
+    FlushOutput();
+    for (auto& stats : g_jit->getTierStats()) {
+        std::cerr << "tier> " << stats.Name << " calls=" << stats.Calls
+                  << " back-edges=" << stats.BackEdges << " tier=" << stats.Tier << std::endl;
+    }
+    for (auto& event : g_jit->getTierUpEvents()) {
+        std::cerr << "tier-up> " << event.Name << " after " << event.Calls << " calls, "
+                  << event.BackEdges << " back-edges, compiled in " << event.CompileMillis << " ms" << std::endl;
+    }
+}
+
+void PrintMemoryStats() {
+    FlushOutput();
+    auto stats = g_jit->getMemoryStats();
+    if (!stats) {
+        std::cerr << "memory> every module has pages of its own, no slabs" << std::endl;
+        return;
+    }
+    const char* kind_names[] = { "code", "rodata", "rwdata" };
+    for (int kind = 0; kind < llvm::orc::SlabAllocator::NumSectionKinds; ++kind) {
+        auto& kind_stats = stats->Kinds[kind];
+        std::cerr << "memory> " << kind_names[kind] << " slabs=" << kind_stats.Slabs
+                  << " pages=" << kind_stats.PagesMapped << " pages-in-use=" << kind_stats.PagesInUse
+                  << " bytes-in-use=" << kind_stats.BytesInUse << std::endl;
+    }
+    std::cerr << "memory> allocations=" << stats->Allocations << " reused=" << stats->ReusedAllocations
+              << " slabs-unmapped=" << stats->SlabsUnmapped << std::endl;
+}
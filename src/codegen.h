@@ -8,6 +8,7 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
@@ -20,34 +21,66 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils.h"
 #include "KaleidoscopeJIT.h"
+#include "type_infer.h"
 #include <unordered_map>
+#include <vector>
+
+class FunctionAST;
+class PrototypeAST;
 
 /**
  * Global Variable Declare
  */
+// The compiler state is thread local, every thread (e.g. the one of a KaleidoscopeSession) compiles independently
+
 // Add a flag to control whether to print out LLVM IR
-extern bool g_enable_ir_print;
+extern thread_local bool g_enable_ir_print;
+
+// Print `result> ...` after evaluating a top level expression
+extern thread_local bool g_enable_result_print;
+
+// Compile Kaleidoscope globals to slots of the running thread's GlobalsInstance (see instance.h) instead of
+// process wide LLVM globals, set it before any global is defined
+extern thread_local bool g_enable_instance_globals;
 
 // Record the core "global" data of LLVM's core infrastructure, e.g. types and constants uniquing table
-extern llvm::LLVMContext g_llvm_context;
+// created by the first ReCreateModule, which replaces it every g_context_recycle_modules modules
+extern thread_local std::unique_ptr<llvm::LLVMContext> g_llvm_context;
 
-// Used for creating LLVM IR (Intermediate Representation)
-extern llvm::IRBuilder<> g_ir_builder;
+// Used for creating LLVM IR (Intermediate Representation), in g_llvm_context
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> g_ir_builder;
+
+// Modules generated in one LLVMContext before it is replaced by a new one, 0 to never replace it
+// nothing but the module being generated lives in it between top level items, yet the constants, types and
+// metadata it uniques are never freed, so a long session would grow with every item it compiles
+extern thread_local size_t g_context_recycle_modules;
 
 // Used for managing functions and global variables. You can consider it as a compile unit (like single .cpp file)
-extern std::unique_ptr<llvm::Module> g_module;
+extern thread_local std::unique_ptr<llvm::Module> g_module;
 
 // Used for recording the local named variables
-extern std::unordered_map<std::string, llvm::AllocaInst*> g_local_named_vars;
+extern thread_local std::unordered_map<std::string, llvm::AllocaInst*> g_local_named_vars;
 
 // Used for recording the global named variables
-extern std::unordered_map<std::string, llvm::AllocaInst*> g_global_named_vars;
+extern thread_local std::unordered_map<std::string, llvm::AllocaInst*> g_global_named_vars;
+
+// Slot of every global in a GlobalsInstance, when g_enable_instance_globals is set
+extern thread_local std::unordered_map<std::string, size_t> g_global_slots;
+
+// Value of every `const` global, folded into the code compiled after its definition
+extern thread_local std::unordered_map<std::string, double> g_const_values;
 
 // Function Passes Manager for CodeGen Optimizer
-extern std::unique_ptr<llvm::legacy::FunctionPassManager> g_fpm;
+extern thread_local std::unique_ptr<llvm::legacy::FunctionPassManager> g_fpm;
 
 // Add JIT Compiler
-extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> g_jit;
+extern thread_local std::unique_ptr<llvm::orc::KaleidoscopeJIT> g_jit;
+
+// Type inference result of the function being generated
+extern thread_local const TypeInfo* g_type_info;
+
+// Add dictionary for function name to function interface
+extern thread_local std::unordered_map<std::string, std::shared_ptr<PrototypeAST>> name2proto_ast;
 
 
 /**
@@ -56,18 +89,79 @@ extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> g_jit;
 // query function interface via function name
 llvm::Function* GetFunction(const std::string& name);
 
-// add memory allocate instruction in the entry-block of function
-llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func, const std::string& var_name);
+// declare specialization `key` in current module, and queue its body for emission
+llvm::Function* GetSpecializedFunction(const std::string& key);
+
+// call a kaleidoscope function (or operator), using the specialization chosen by type inference if any
+llvm::Value* CreateKaleidoscopeCall(
+  const ExprAST* node, const std::string& name, const std::vector<llvm::Value*>& args, const std::string& tmp_name);
+
+// lower an inferred type, a type which is still unknown falls back to double
+llvm::Type* GetLLVMType(ValueType type);
+
+// convert a value between the lowered types: i1, i64 and double
+llvm::Value* CastValue(llvm::Value* value, llvm::Type* type);
+
+// add memory allocate instruction in the entry-block of function, a double unless `type` is given
+llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* func, const std::string& var_name, llvm::Type* type = nullptr);
 
 // find variable AllocaInst from local_variable_table and global_variable_table
 llvm::AllocaInst* FindVariableAllocaInst(const std::string& name);
 
+// address of a global's value: its slot in the calling thread's defining (or bound) GlobalsInstance, or its
+// definition in the JIT
+// nullptr if it is not defined
+double* GetGlobalAddress(const std::string& name);
+
+// open a new g_module (and g_fpm), in a new g_llvm_context if the current one served g_context_recycle_modules
+// modules and no module of it is set aside
 void ReCreateModule();
 
+// number of times ReCreateModule replaced g_llvm_context
+uint64_t GetRecycledContextCount();
+
+// generate the bodies of the specializations queued by `GetSpecializedFunction` into the current module
+void CodeGenSpecializations();
+
+// emit the specializations queued by `GetSpecializedFunction` into their own module
+void EmitSpecializations();
+
+// compile a parsed definition / extern, so that the code parsed after it can call it
+// return false and set `error` if the definition calls a function or an operator which is not declared, with the
+// wrong number of arguments, or reads a variable which is not defined, nothing of it is compiled then
+bool CompileDefinition(std::shared_ptr<FunctionAST> ast, std::string& error);
+
+void CompileExtern(std::unique_ptr<PrototypeAST> ast);
+
+// compile and run a parsed top level expression, and set `result` to its value
+// return false and set `error` as CompileDefinition does
+bool RunTopLevel(std::unique_ptr<FunctionAST> ast, double& result, std::string& error);
+
+// write "error: <error>" to stderr
+void WriteCompileError(const std::string& error);
+
+// parse the item at the current token and compile it, an item which does not parse or compile is reported to
+// stderr and skipped
 void ParseDefinitionToken();
 
 void ParseExternToken();
 
-void ParseTopLevel();
+// evaluate a top level expression, and return its value, 0 if it does not parse or compile
+double ParseTopLevel();
+
+// batch entry point of a function: out[i] = f(columns[0][i], columns[1][i], ...) for every i < n
+// one column per parameter, `out` must not overlap them
+typedef void (*BatchFunction)(const double* const* columns, double* out, uint64_t n);
+
+// generate the batch entry point of a defined function, with a copy of the function (and of the functions
+// it calls) inlined into the loop so that it can be vectorized, nullptr if the function is not defined
+// call it between top level items, the entry point is generated again after a copied function is redefined
+BatchFunction GetBatchFunction(const std::string& name);
+
+// print call / back-edge counters and tier-up events of the tiered JIT to stderr
+void PrintTierStats();
+
+// print pages mapped / in use and bytes in use of the JIT's code and data slabs to stderr
+void PrintMemoryStats();
 
 #endif // _H_CODE_GEN
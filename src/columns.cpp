@@ -0,0 +1,159 @@
+#include "columns.h"
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+const Column* g_columns = nullptr;
+uint64_t g_column_count = 0;
+}
+
+// owns the table `g_columns` points into, the mappings live until the process exits
+static std::vector<Column> columns;
+
+bool MapColumnFile(const std::string& path, std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size % sizeof(double) != 0) {
+        error = path + ": not a file of doubles";
+        close(fd);
+        return false;
+    }
+
+    Column column = { nullptr, (uint64_t) file_stat.st_size / sizeof(double) };
+    if (column.size > 0) {
+        void* data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            error = path + ": " + strerror(errno);
+            close(fd);
+            return false;
+        }
+        // scripts mostly loop over a column from the start, let the kernel read ahead
+        madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+        column.data = (const double*) data;
+    }
+    close(fd);
+
+    columns.push_back(column);
+    g_columns = columns.data();
+    g_column_count = columns.size();
+    return true;
+}
+
+static bool IsNewer(const std::string& path, const struct stat& than) {
+    struct stat file_stat;
+    return stat(path.c_str(), &file_stat) == 0 && file_stat.st_mtime >= than.st_mtime;
+}
+
+// split a CSV line on commas, return false if a field is not a number
+static bool ParseCsvLine(const std::string& line, std::vector<double>& values) {
+    values.clear();
+    bool numeric = true;
+    const char* field = line.c_str();
+    while (true) {
+        char* end = nullptr;
+        double value = strtod(field, &end);
+        while (*end == ' ' || *end == '\t' || *end == '\r') {
+            ++end;
+        }
+        if (end == field || (*end != ',' && *end != '\0')) {
+            numeric = false;
+            value = NAN;
+            end = strchr(end, ',');
+            end = end ? end : (char*) line.c_str() + line.size();
+        }
+        values.push_back(value);
+        if (*end == '\0') {
+            return numeric;
+        }
+        field = end + 1;
+    }
+}
+
+bool ConvertCsvToColumns(const std::string& csv_path, std::vector<std::string>& column_paths, std::string& error) {
+    struct stat csv_stat;
+    std::ifstream in(csv_path);
+    if (!in || stat(csv_path.c_str(), &csv_stat) != 0) {
+        error = csv_path + ": cannot read";
+        return false;
+    }
+
+    std::string line;
+    std::vector<double> values;
+    bool has_row = false;
+    while (!has_row && std::getline(in, line)) {
+        has_row = ParseCsvLine(line, values);
+    }
+    if (!has_row) {
+        error = csv_path + ": no numeric row";
+        return false;
+    }
+
+    column_paths.clear();
+    bool converted = true;
+    for (size_t i = 0; i < values.size(); ++i) {
+        column_paths.push_back(csv_path + "." + std::to_string(i) + ".f64");
+        converted = converted && IsNewer(column_paths.back(), csv_stat);
+    }
+    if (converted) {
+        return true;
+    }
+
+    // stdio buffers the writes, one row writes a value to every column file
+    std::vector<std::unique_ptr<FILE, int (*)(FILE*)>> files;
+    for (auto& path : column_paths) {
+        files.emplace_back(fopen(path.c_str(), "wb"), fclose);
+        if (!files.back()) {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+    }
+    do {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        ParseCsvLine(line, values);
+        values.resize(files.size(), NAN);
+        for (size_t i = 0; i < files.size(); ++i) {
+            fwrite(&values[i], sizeof(double), 1, files[i].get());
+        }
+    } while (std::getline(in, line));
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (fflush(files[i].get()) != 0) {
+            error = column_paths[i] + ": " + strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the out of line builtins, column_get is only called through here if a call is not inlined
+
+extern "C" double column_count() {
+    return g_column_count;
+}
+
+extern "C" double column_size(double column) {
+    return column >= 0 && column < g_column_count ? g_columns[(uint64_t) column].size : 0;
+}
+
+extern "C" double column_get(double column, double index) {
+    if (!(column >= 0 && column < g_column_count)) {
+        return NAN;
+    }
+    const Column& c = g_columns[(uint64_t) column];
+    return index >= 0 && index < c.size ? c.data[(uint64_t) index] : NAN;
+}
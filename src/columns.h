@@ -0,0 +1,41 @@
+#ifndef _H_COLUMNS
+#define _H_COLUMNS
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Struct Declare
+ */
+// a read only array of doubles, mapped from a file
+struct Column {
+    const double* data;
+    uint64_t size;
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// the mapped columns, shared by every thread, Kaleidoscope code refers to them by index:
+//   column_count()      number of columns
+//   column_size(c)      number of values of column c
+//   column_get(c, i)    value i of column c, NaN if out of range, codegen inlines it into a bounds check and a load
+// the table must not change once code using it is compiled, so map every column before compiling anything
+extern "C" const Column* g_columns;
+extern "C" uint64_t g_column_count;
+
+
+/**
+ * Function Declare
+ */
+// map a file of native endian doubles as the next column, return false and set `error` if it cannot be mapped
+bool MapColumnFile(const std::string& path, std::string& error);
+
+// convert a CSV file of numbers to one column file per CSV column, `<csv path>.<column>.f64`
+// a first line which is not numeric is taken as a header and skipped, missing or malformed fields are NaN
+// the column files are reused while they are newer than the CSV file, so a CSV file is parsed once
+bool ConvertCsvToColumns(const std::string& csv_path, std::vector<std::string>& column_paths, std::string& error);
+
+#endif // _H_COLUMNS
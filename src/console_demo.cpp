@@ -1,23 +1,224 @@
 #include "codegen.h"
+#include "columns.h"
+#include "expr_cache.h"
 #include "parser.h"
 #include "lexer.h"
+#include "output.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "sampler.h"
+#include "snapshot.h"
+#include "time_report.h"
+#include <cctype>
+#include <cstring>
 #include <iostream>
 
-int main() {
+int main(int argc, char* argv[]) {
     llvm::InitializeNativeTarget();
     llvm::InitializeNativeTargetAsmPrinter();
     llvm::InitializeNativeTargetAsmParser();
 
-    // disable print LLVM IR
-    g_enable_ir_print = false;
+    // `--tiered-jit`: compile at -O0 first, recompile hot functions in background
+    // `--tier-calls <n>`: with `--tiered-jit`, recompile a function after n calls, 1000 by default
+    // `--tier-back-edges <n>`: with `--tiered-jit`, recompile a function after n loop iterations, 10000 by default
+    // `--tier-stats`: print counters and tier-up events when the input ends
+    // `--memory-stats`: print the usage of the JIT's code and data slabs when the input ends
+    // `--perf`: append the symbols of JIT code to /tmp/perf-<pid>.map
+    // `--perf-jitdump`: write a perf jitdump for `perf inject --jit`
+    // `--gdb-jit`: register JIT code with GDB
+    // `--time-report`: print per phase timing histograms when the input ends
+    // `--time-trace <file>`: write a Chrome trace_event JSON timeline when the input ends
+    // `--perf-counters`: count cycles, instructions, cache / branch misses and page faults per phase, printed
+    //                    with the time report, see perf_counters.h
+    // `--profile <file>`: sample the running code's stacks and write them as folded stacks when the input ends,
+    //                     `profile(<hz>)` changes the frequency from the program, see sampler.h
+    // `--profile-hz <n>`: samples per second of CPU time, 99 by default, 0 to wait for a call to `profile`
+    // `--column <file>`: map a file of doubles as the next column, see columns.h
+    // `--csv <file>`: convert a CSV file to column files once, and map them as the next columns
+    // `--instance-globals`: compile globals per thread instead of process wide, see instance.h
+    // `--flush line|full`: write output after every line / only when 64 KiB are buffered,
+    //                      by default after every line on a terminal only
+    // `--load-snapshot <file>`: start from a snapshot saved by `--save-snapshot`, see snapshot.h
+    // `--save-snapshot <file>`: save a snapshot of the definitions and globals when the input ends
+    // `--pipeline [N]`: parse on the main thread while another one compiles and runs, with up to N parsed items
+    //                   (64 by default) queued between them, see pipeline.h
+    // `--parse-threads <n>`: with `--pipeline` (implied), read the input whole and parse it on n threads, split
+    //                        before its definitions, see parallel_parse.h
+    // `--expr-cache [N]`: keep the code of up to N top level expressions (256 by default) to run them again without
+    //                     compiling, see expr_cache.h
+    // `--lift-literals`: with `--expr-cache`, expressions differing in their literals only share code
+    llvm::orc::KaleidoscopeJIT::TieringOptions tiering;
+    llvm::orc::KaleidoscopeJIT::ProfilingOptions profiling;
+    bool print_tier_stats = false;
+    bool print_memory_stats = false;
+    bool print_time_report = false;
+    bool perf_counters = false;
+    std::string time_trace_path;
+    std::vector<std::string> column_paths;
+    std::string load_snapshot_path;
+    std::string save_snapshot_path;
+    bool instance_globals = false;
+    size_t pipeline_capacity = 0;
+    size_t parse_threads = 1;
+    std::string profile_path;
+    unsigned profile_frequency = 99;
+    size_t expr_cache_capacity = 0;
+    bool lift_literals = false;
+    std::string error;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--tiered-jit") == 0) {
+            tiering.Enabled = true;
+        } else if (strcmp(argv[i], "--tier-calls") == 0 && i + 1 < argc) {
+            tiering.CallThreshold = std::stoull(argv[++i]);
+        } else if (strcmp(argv[i], "--tier-back-edges") == 0 && i + 1 < argc) {
+            tiering.BackEdgeThreshold = std::stoull(argv[++i]);
+        } else if (strcmp(argv[i], "--tier-stats") == 0) {
+            print_tier_stats = true;
+        } else if (strcmp(argv[i], "--memory-stats") == 0) {
+            print_memory_stats = true;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            profiling.PerfMap = true;
+        } else if (strcmp(argv[i], "--perf-jitdump") == 0) {
+            profiling.PerfJITDump = true;
+        } else if (strcmp(argv[i], "--gdb-jit") == 0) {
+            profiling.GDBRegistration = true;
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            print_time_report = true;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            print_time_report = true;
+            perf_counters = true;
+        } else if (strcmp(argv[i], "--time-trace") == 0 && i + 1 < argc) {
+            time_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--instance-globals") == 0) {
+            instance_globals = true;
+        } else if (strcmp(argv[i], "--flush") == 0) {
+            const char* policy = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(policy, "line") == 0) {
+                g_flush_policy = FLUSH_LINE;
+            } else if (strcmp(policy, "full") == 0) {
+                g_flush_policy = FLUSH_FULL;
+            } else {
+                std::cerr << "usage: " << argv[0] << " --flush line|full" << std::endl;
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--load-snapshot") == 0 && i + 1 < argc) {
+            load_snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+            save_snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipeline_capacity = 64;
+            if (i + 1 < argc && isdigit((unsigned char) argv[i + 1][0])) {
+                pipeline_capacity = std::stoul(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--parse-threads") == 0 && i + 1 < argc) {
+            parse_threads = std::stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--expr-cache") == 0) {
+            expr_cache_capacity = 256;
+            if (i + 1 < argc && isdigit((unsigned char) argv[i + 1][0])) {
+                expr_cache_capacity = std::stoul(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--lift-literals") == 0) {
+            lift_literals = true;
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+            profiling.Sampling = true;
+        } else if (strcmp(argv[i], "--profile-hz") == 0 && i + 1 < argc) {
+            profile_frequency = std::stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--column") == 0 && i + 1 < argc) {
+            column_paths.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            std::vector<std::string> csv_column_paths;
+            if (!ConvertCsvToColumns(argv[++i], csv_column_paths, error)) {
+                std::cerr << "error: " << error << std::endl;
+                return 1;
+            }
+            column_paths.insert(column_paths.end(), csv_column_paths.begin(), csv_column_paths.end());
+        }
+    }
+
+    // the column table is fixed before any code is compiled
+    for (auto& path : column_paths) {
+        if (!MapColumnFile(path, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return 1;
+        }
+    }
+
+    // the compiler state is thread local, so both run on the thread which compiles
+    auto start = [&]() {
+        // disable print LLVM IR
+        g_enable_ir_print = false;
+        g_enable_instance_globals = instance_globals;
+        g_expr_cache_capacity = expr_cache_capacity;
+        g_expr_cache_lift_literals = lift_literals;
+        g_enable_time_report = print_time_report || !time_trace_path.empty();
+        if (perf_counters && !OpenPerfCounters(error)) {
+            std::cerr << "error: no perf counter: " << error << std::endl;
+            return false;
+        } else if (perf_counters && !error.empty()) {
+            std::cerr << "warning: not counted: " << error << std::endl;
+        }
+
+        g_jit.reset(new llvm::orc::KaleidoscopeJIT(tiering, profiling));
+        ReCreateModule();
+        if (!save_snapshot_path.empty()) {
+            g_jit->keepObjects();
+        }
+        if (!load_snapshot_path.empty() && !LoadSnapshot(load_snapshot_path, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return false;
+        }
+        if (!profile_path.empty() && !StartSampler(profile_frequency, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return false;
+        }
+        return true;
+    };
+    auto finish = [&]() {
+        FlushOutput();
+        if (!save_snapshot_path.empty() && !SaveSnapshot(save_snapshot_path, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return false;
+        }
+        if (!profile_path.empty()) {
+            StopSampler();
+            if (!WriteFoldedStacks(profile_path, error)) {
+                std::cerr << "error: " << error << std::endl;
+                return false;
+            }
+            SamplerStats stats = GetSamplerStats();
+            std::cerr << "profile> " << stats.samples << " samples in " << stats.stacks << " stacks written to "
+                      << profile_path << ", " << stats.dropped << " dropped" << std::endl;
+        }
+        if (print_tier_stats) {
+            PrintTierStats();
+        }
+        if (print_memory_stats) {
+            PrintMemoryStats();
+        }
+        if (print_time_report) {
+            PrintTimeReport();
+        }
+        if (!time_trace_path.empty()) {
+            WriteTimeTrace(time_trace_path);
+        }
+        return true;
+    };
 
-    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
-    ReCreateModule();
+    if (parse_threads > 1 && pipeline_capacity == 0) {
+        pipeline_capacity = 64;
+    }
+    if (pipeline_capacity > 0) {
+        return RunPipelined(pipeline_capacity, parse_threads, start, finish) ? 0 : 1;
+    }
 
+    if (!start()) {
+        return 1;
+    }
     GetNextToken();
     while (true) {
         switch (g_current_token) {
-            case TOKEN_EOF: return 0;
+            case TOKEN_EOF: return finish() ? 0 : 1;
             case TOKEN_END: GetNextToken(); break;
             case TOKEN_DEF: ParseDefinitionToken(); break;
             case TOKEN_EXTERN: ParseExternToken(); break;
@@ -0,0 +1,241 @@
+#include "expr_cache.h"
+#include "codegen.h"
+#include "parser.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+
+// Top level expressions whose compiled code is kept for reuse, 0 disables the cache
+thread_local size_t g_expr_cache_capacity = 0;
+
+// Key top level expressions with their literals lifted
+thread_local bool g_expr_cache_lift_literals = false;
+
+// The key of the top level expression being generated
+thread_local const ExprKey* g_lifting_key = nullptr;
+
+// compiled code of a top level expression, and the functions it may call through others
+struct CachedExpression {
+    uint64_t module_key;
+    TopLevelFunction address;
+    std::set<std::string> dependencies;
+    uint64_t last_use;
+};
+
+// cached expressions by key text
+static thread_local std::unordered_map<std::string, CachedExpression> cached_expressions;
+
+// modules of dropped expressions, removed once no JIT'd code runs
+static thread_local std::vector<uint64_t> dropped_modules;
+
+// the JIT the modules were added to, a fresh g_jit starts with an empty cache
+static thread_local const llvm::orc::KaleidoscopeJIT* cache_jit = nullptr;
+
+static thread_local uint64_t use_clock = 0;
+static thread_local uint64_t expression_names = 0;
+
+// the lifted literals of the expression about to run, read by its code
+static thread_local double lifted_literals[max_lifted_literals];
+
+/**
+ * Expression keys
+ */
+// names are prefixed with their length, so that no two sequences of names append the same text
+static void AppendName(ExprKey& key, const std::string& name) {
+    key.text += std::to_string(name.size());
+    key.text += ':';
+    key.text += name;
+}
+
+static void AppendBody(ExprKey& key, const std::vector<std::unique_ptr<ExprAST>>& body) {
+    key.text += '{';
+    for (auto& expr : body) {
+        expr->AppendKey(key);
+    }
+    key.text += '}';
+}
+
+void NumberExprAST::AppendKey(ExprKey& key) const {
+    // the type inferred for a literal depends on its value, so a lifted literal keeps it
+    if (key.lift_literals && key.literals.size() < max_lifted_literals) {
+        key.literal_slots[this] = key.literals.size();
+        key.literals.push_back(val_);
+        key.text += is_integer_ && IsIntegralLiteral(val_) ? "#i" : "#d";
+        return;
+    }
+    uint64_t bits;
+    memcpy(&bits, &val_, sizeof(bits));
+    char text[24];
+    snprintf(text, sizeof(text), "#%016" PRIx64 "%c", bits, is_integer_ ? 'i' : 'd');
+    key.text += text;
+}
+
+void VariableExprAST::AppendKey(ExprKey& key) const {
+    // defining a global or a const has effects beyond the code: the compiler records the name
+    if (is_global_scope_ || is_const_) {
+        key.cacheable = false;
+    }
+    key.text += 'v';
+    AppendName(key, name_);
+}
+
+void BinaryExprAST::AppendKey(ExprKey& key) const {
+    key.text += 'b';
+    AppendName(key, op_);
+    lhs_->AppendKey(key);
+    rhs_->AppendKey(key);
+    // builtin operators are called too if a definition overrides them, which only adds to the dependencies
+    if (op_ != "=") {
+        key.callees.insert("binary" + op_);
+    }
+}
+
+void UnaryExprAST::AppendKey(ExprKey& key) const {
+    key.text += 'u';
+    AppendName(key, op_);
+    operand_->AppendKey(key);
+    key.callees.insert("unary" + op_);
+}
+
+void CallExprAST::AppendKey(ExprKey& key) const {
+    key.text += 'c';
+    AppendName(key, callee_);
+    key.text += std::to_string(args_.size());
+    for (auto& arg : args_) {
+        arg->AppendKey(key);
+    }
+    key.callees.insert(callee_);
+}
+
+void IfExprAST::AppendKey(ExprKey& key) const {
+    key.text += 'i';
+    cond_->AppendKey(key);
+    AppendBody(key, then_expr_);
+    AppendBody(key, else_expr_);
+}
+
+void ForExprAST::AppendKey(ExprKey& key) const {
+    key.text += 'f';
+    AppendName(key, var_name_);
+    start_expr_->AppendKey(key);
+    end_expr_->AppendKey(key);
+    step_expr_->AppendKey(key);
+    AppendBody(key, body_expr_);
+}
+
+void PrototypeAST::AppendKey(ExprKey& key) const {
+    key.text += 'p';
+    AppendName(key, name_);
+    for (auto& arg : args_) {
+        AppendName(key, arg);
+    }
+}
+
+void FunctionAST::AppendKey(ExprKey& key) const {
+    proto_->AppendKey(key);
+    AppendBody(key, body_);
+}
+
+// the functions `key`'s expression calls, and the functions they call in turn
+static std::set<std::string> GetDependencies(const ExprKey& key) {
+    std::set<std::string> dependencies = key.callees;
+    std::deque<std::string> queue(key.callees.begin(), key.callees.end());
+    while (!queue.empty()) {
+        auto func_ast = name2func_ast.find(queue.front());
+        queue.pop_front();
+        if (func_ast == name2func_ast.end()) {
+            continue;
+        }
+        ExprKey body_key;
+        body_key.lift_literals = true;
+        func_ast->second->AppendKey(body_key);
+        for (auto& callee : body_key.callees) {
+            if (dependencies.insert(callee).second) {
+                queue.push_back(callee);
+            }
+        }
+    }
+    return dependencies;
+}
+
+/**
+ * Expression cache
+ */
+TopLevelFunction FindCachedExpression(const FunctionAST& ast, ExprKey& key) {
+    if (cache_jit != g_jit.get()) {
+        // the modules went away with the JIT they were added to
+        cached_expressions.clear();
+        dropped_modules.clear();
+        cache_jit = g_jit.get();
+    }
+
+    key.lift_literals = g_expr_cache_lift_literals;
+    ast.AppendKey(key);
+    if (!key.cacheable) {
+        return nullptr;
+    }
+    std::copy(key.literals.begin(), key.literals.end(), lifted_literals);
+
+    auto cached = cached_expressions.find(key.text);
+    if (cached == cached_expressions.end()) {
+        return nullptr;
+    }
+    cached->second.last_use = ++use_clock;
+    return cached->second.address;
+}
+
+bool CacheExpression(const ExprKey& key, uint64_t module_key, TopLevelFunction address) {
+    if (!key.cacheable || g_expr_cache_capacity == 0) {
+        return false;
+    }
+
+    if (cached_expressions.size() >= g_expr_cache_capacity) {
+        auto oldest = cached_expressions.begin();
+        for (auto it = cached_expressions.begin(); it != cached_expressions.end(); ++it) {
+            if (it->second.last_use < oldest->second.last_use) {
+                oldest = it;
+            }
+        }
+        dropped_modules.push_back(oldest->second.module_key);
+        cached_expressions.erase(oldest);
+    }
+
+    cached_expressions[key.text] = { module_key, address, GetDependencies(key), ++use_clock };
+    return true;
+}
+
+std::string CachedExpressionName() {
+    return top_level_expr_name + "$" + std::to_string(++expression_names);
+}
+
+void DropCachedExpressions(const std::string& name) {
+    for (auto it = cached_expressions.begin(); it != cached_expressions.end();) {
+        if (name.empty() || it->second.dependencies.count(name) > 0) {
+            dropped_modules.push_back(it->second.module_key);
+            it = cached_expressions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RemoveDroppedExpressions() {
+    if (cache_jit != g_jit.get()) {
+        dropped_modules.clear();
+        return;
+    }
+    for (uint64_t module_key : dropped_modules) {
+        g_jit->removeModule(module_key);
+    }
+    dropped_modules.clear();
+}
+
+void ClearExpressionCache() {
+    DropCachedExpressions("");
+    RemoveDroppedExpressions();
+}
+
+const double* LiftedLiteralAddress(size_t slot) {
+    return &lifted_literals[slot];
+}
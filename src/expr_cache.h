@@ -0,0 +1,83 @@
+#ifndef _H_EXPR_CACHE
+#define _H_EXPR_CACHE
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class ExprAST;
+class FunctionAST;
+
+/**
+ * Struct Declare
+ */
+// structure of an expression, built by `ExprAST::AppendKey`: expressions with the same key compile to the same code
+struct ExprKey {
+    // leave the value of numeric literals out of `text`, keeping only whether they are integral (which decides
+    // their type), and collect them into `literals` instead
+    bool lift_literals = false;
+
+    std::string text;
+
+    // values of the lifted literals, and the slot each literal node reads its value from
+    std::vector<double> literals;
+    std::unordered_map<const ExprAST*, size_t> literal_slots;
+
+    // functions and user defined operators called, e.g. "score", "binary~"
+    std::set<std::string> callees;
+
+    // false if compiling the expression defines a global or a const, it has to be compiled every time
+    bool cacheable = true;
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// Top level expressions whose compiled code is kept for reuse, least recently used dropped first,
+// 0 compiles every expression and drops its code once it has run
+extern thread_local size_t g_expr_cache_capacity;
+
+// Key top level expressions with their literals lifted (see ExprKey), so that `score(1, 2)` and `score(3, 4)`
+// share code, which reads the literals from memory rather than having them folded into it
+extern thread_local bool g_expr_cache_lift_literals;
+
+// The key of the top level expression being generated, its lifted literals are loaded, nullptr otherwise
+extern thread_local const ExprKey* g_lifting_key;
+
+// literals beyond the first ones of an expression are kept in its key
+const size_t max_lifted_literals = 32;
+
+
+/**
+ * Function Declare
+ */
+// key a top level expression, and return the code cached for it, nullptr if there is none (yet)
+// the values of its lifted literals are stored where the code reads them from
+typedef double (*TopLevelFunction)();
+TopLevelFunction FindCachedExpression(const FunctionAST& ast, ExprKey& key);
+
+// keep the code of a top level expression compiled with `key`, in JIT module `module_key`; return false if it is
+// not kept, and the caller removes the module after running it
+bool CacheExpression(const ExprKey& key, uint64_t module_key, TopLevelFunction address);
+
+// name to give a cached expression's function, which must be unique in the JIT
+std::string CachedExpressionName();
+
+// forget the expressions calling `name`, directly or through other functions, as it is being redefined,
+// every expression if `name` is empty (e.g. a global was defined, which a name in them may now refer to)
+// the modules of their code are removed by RemoveDroppedExpressions
+void DropCachedExpressions(const std::string& name);
+
+// remove the code of dropped expressions from the JIT, when none may be running
+void RemoveDroppedExpressions();
+
+// drop every expression and remove its code, e.g. before saving a snapshot
+void ClearExpressionCache();
+
+// address the value of lifted literal `slot` is read from
+const double* LiftedLiteralAddress(size_t slot);
+
+#endif // _H_EXPR_CACHE
@@ -0,0 +1,82 @@
+#include "instance.h"
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <sys/mman.h>
+
+static std::atomic<uint64_t> instance_ids(0);
+
+static thread_local GlobalsInstance* bound_instance = nullptr;
+
+static thread_local std::unique_ptr<GlobalsInstance> defining_instance;
+
+// copies of the defining instances of other threads, by id, since a freed instance's address may be reused
+static thread_local std::unordered_map<uint64_t, std::unique_ptr<GlobalsInstance>> own_instances;
+
+// the own instance used last, found without a lookup while the same code keeps running
+static thread_local const GlobalsInstance* last_defining = nullptr;
+static thread_local uint64_t last_defining_id = 0;
+static thread_local double* last_slots = nullptr;
+
+GlobalsInstance::GlobalsInstance() : id_(++instance_ids), used_slots_(0) {
+    // zero filled, as the globals of the shared mode are
+    void* slots = mmap(nullptr, max_slots * sizeof(double), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    slots_ = (double*) slots;
+}
+
+GlobalsInstance::GlobalsInstance(const GlobalsInstance* defining) : GlobalsInstance() {
+    std::lock_guard<std::mutex> lock(defining->values_mutex_);
+    size_t count = defining->used_slots_.load(std::memory_order_acquire);
+    std::copy(defining->slots_, defining->slots_ + count, slots_);
+    used_slots_ = count;
+}
+
+GlobalsInstance::~GlobalsInstance() {
+    munmap(slots_, max_slots * sizeof(double));
+}
+
+void GlobalsInstance::UseSlots(size_t count) {
+    size_t used = used_slots_.load(std::memory_order_relaxed);
+    while (used < count && !used_slots_.compare_exchange_weak(used, count, std::memory_order_release)) {
+    }
+}
+
+GlobalsInstance* BindGlobalsInstance(GlobalsInstance* instance) {
+    GlobalsInstance* previous = bound_instance;
+    bound_instance = instance;
+    return previous;
+}
+
+GlobalsInstance* DefiningGlobalsInstance() {
+    if (!defining_instance) {
+        defining_instance.reset(new GlobalsInstance);
+    }
+    return defining_instance.get();
+}
+
+extern "C" double* kaleidoscope_instance_globals(GlobalsInstance* defining) {
+    if (bound_instance != nullptr) {
+        return bound_instance->slots();
+    }
+    // the compiling thread runs its code on the values it defines
+    if (defining == defining_instance.get()) {
+        return defining->slots();
+    }
+    if (defining == last_defining && defining->id() == last_defining_id) {
+        return last_slots;
+    }
+
+    std::unique_ptr<GlobalsInstance>& own = own_instances[defining->id()];
+    if (!own) {
+        own.reset(new GlobalsInstance(defining));
+    }
+    last_defining = defining;
+    last_defining_id = defining->id();
+    last_slots = own->slots();
+    return last_slots;
+}
@@ -0,0 +1,68 @@
+#ifndef _H_INSTANCE
+#define _H_INSTANCE
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Class Declare
+ */
+// the globals of compiled code, when compiled with `g_enable_instance_globals`
+// every global is a slot of the instance bound to the running thread, so the same code runs on many threads
+// with isolated state; the compiling thread defines the globals in its defining instance, and a thread with no
+// instance bound gets one of its own per defining instance on first use, a copy of it, freed when the thread exits
+// the copy is taken under `values_mutex()` of the defining instance
+class GlobalsInstance {
+public:
+    // zero filled
+    GlobalsInstance();
+
+    // holding the values of the slots `defining` has in use, copied under its `values_mutex()`
+    explicit GlobalsInstance(const GlobalsInstance* defining);
+
+    ~GlobalsInstance();
+
+    GlobalsInstance(const GlobalsInstance&) = delete;
+
+    GlobalsInstance& operator=(const GlobalsInstance&) = delete;
+
+    double* slots() const { return slots_; }
+
+    // unique among the instances of the process, unlike their addresses
+    uint64_t id() const { return id_; }
+
+    // record that compiled code uses the slots below `count`, the ones a copy gets
+    void UseSlots(size_t count);
+
+    // held by the thread whose code may write the slots while it runs (e.g. a session thread serving a request),
+    // so that other threads do not copy values being written
+    std::mutex& values_mutex() const { return values_mutex_; }
+
+    // the slots are reserved up front, so they never move, pages are only backed once written
+    static const size_t max_slots = 1 << 20;
+
+private:
+    double* slots_;
+    uint64_t id_;
+    std::atomic<size_t> used_slots_;
+    mutable std::mutex values_mutex_;
+};
+
+
+/**
+ * Function Declare
+ */
+// bind `instance` to the calling thread, nullptr for the thread's own instances, return the previous binding
+// an instance may be bound to several threads, which then share (and race on) its globals
+GlobalsInstance* BindGlobalsInstance(GlobalsInstance* instance);
+
+// the instance the globals compiled on the calling thread are defined in, created on first use
+GlobalsInstance* DefiningGlobalsInstance();
+
+// the slots of the instance bound to the calling thread, or of its own copy of `defining`, compiled code calls it
+// with the defining instance of the thread it was compiled on to reach its globals
+extern "C" double* kaleidoscope_instance_globals(GlobalsInstance* defining);
+
+#endif // _H_INSTANCE
@@ -1,15 +1,32 @@
 #include "lexer.h"
+#include <cstdio>
 #include <string>
 #include <unordered_set>
 
 // Filled in if TOKEN_IDENTIFIER
-std::string g_identifier_str;
+thread_local std::string g_identifier_str;
 
 // Filled in if TOKEN_NUMBER
-double g_number_val;
+thread_local double g_number_val;
+
+// Filled in if TOKEN_NUMBER, whether it was written without a decimal point
+thread_local bool g_number_is_integer;
 
 // Filled in if TOKEN_OPERATOR
-std::string g_operator_str;
+thread_local std::string g_operator_str;
+
+// Offset of the first character of the last token within the input
+thread_local size_t g_token_offset;
+
+// in-memory input set by `SetLexerInput`, stdin is read if there is none
+static thread_local const char* input_cursor = nullptr;
+static thread_local const char* input_end = nullptr;
+
+// number of characters consumed from the current input
+static thread_local size_t input_offset = 0;
+
+// the character after the last token
+static thread_local int last_char = ' ';
 
 // operator basic characters
 const std::unordered_set<char> operator_char_set = {
@@ -23,20 +40,68 @@ bool isVarChar(const char& ch) {
     return isalnum(ch) || ch == '_';
 }
 
-// extract a token from stdin
-int GetToken() {
-    static int last_char = ' ';
+// read one character of the input
+static int ReadChar() {
+    ++input_offset;
+    if (input_cursor == nullptr) {
+        return getchar();
+    }
+    return input_cursor == input_end ? EOF : (unsigned char) *input_cursor++;
+}
+
+void SetLexerInput(const char* begin, const char* end) {
+    input_cursor = begin;
+    input_end = end;
+    input_offset = 0;
+    last_char = ' ';
+}
+
+void SetLexerInput(const std::string& code) {
+    SetLexerInput(code.data(), code.data() + code.size());
+}
 
+void ResetLexerInput() {
+    SetLexerInput(nullptr, nullptr);
+}
+
+std::string ReadRemainingInput() {
+    std::string input;
+    if (last_char != EOF) {
+        input += (char) last_char;
+    }
+    if (input_cursor == nullptr) {
+        char buffer[65536];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+            input.append(buffer, size);
+        }
+    } else {
+        input.append(input_cursor, input_end);
+        input_cursor = input_end;
+    }
+    last_char = EOF;
+    return input;
+}
+
+bool IsOperatorChar(int ch) {
+    return operator_char_set.count(ch) > 0;
+}
+
+// extract a token from the input
+int GetToken() {
     // ignore white space
     while (isspace(last_char)) {
-        last_char = getchar();
+        last_char = ReadChar();
     }
 
+    // `last_char` is the first character of the token, or EOF
+    g_token_offset = input_offset - 1;
+
     // identify character
     if (isalpha(last_char) || last_char == '_') {
         g_identifier_str = last_char;
 
-        while (isVarChar((last_char = getchar()))) {
+        while (isVarChar((last_char = ReadChar()))) {
             g_identifier_str += last_char;
         }
 
@@ -53,11 +118,12 @@ int GetToken() {
 
         do {
             num_str += last_char;
-            last_char = getchar();
+            last_char = ReadChar();
         }
         while (isdigit(last_char) || last_char == '.');
 
         g_number_val = strtod(num_str.c_str(), nullptr);
+        g_number_is_integer = num_str.find('.') == std::string::npos;
 
         return TOKEN_NUMBER;
     }
@@ -65,7 +131,7 @@ int GetToken() {
     // ignore comment
     if (last_char == '#') {
         do {
-            last_char = getchar();
+            last_char = ReadChar();
         }
         while (last_char != EOF && last_char != '\n' && last_char != '\r');
 
@@ -77,7 +143,7 @@ int GetToken() {
     // identify operator
     if (operator_char_set.count(last_char)) {
         g_operator_str = last_char;
-        while (operator_char_set.count(last_char = getchar())) {
+        while (operator_char_set.count(last_char = ReadChar())) {
             g_operator_str += last_char;
         }
         return TOKEN_OPERATOR;
@@ -90,6 +156,6 @@ int GetToken() {
 
     // return ASCII directly
     int this_char = last_char;
-    last_char = getchar();
+    last_char = ReadChar();
     return this_char;
 }
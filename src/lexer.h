@@ -8,13 +8,19 @@
  * Global Variable Declare
  */
 // Filled in if TOKEN_IDENTIFIER
-extern std::string g_identifier_str;
+extern thread_local std::string g_identifier_str;
 
 // Filled in if TOKEN_NUMBER
-extern double g_number_val;
+extern thread_local double g_number_val;
+
+// Filled in if TOKEN_NUMBER, whether it was written without a decimal point
+extern thread_local bool g_number_is_integer;
 
 // Filled in if TOKEN_OPERATOR
-extern std::string g_operator_str;
+extern thread_local std::string g_operator_str;
+
+// Offset of the first character of the last token within the input
+extern thread_local size_t g_token_offset;
 
 /**
  * Enum Declare
@@ -34,7 +40,8 @@ enum Token {
     TOKEN_BINARY = -12,
     TOKEN_UNARY = -13,
     TOKEN_OPERATOR = -14,
-    TOKEN_GLOBAL = -15
+    TOKEN_GLOBAL = -15,
+    TOKEN_CONST = -16
 };
 
 // Token Mapping Table
@@ -50,13 +57,29 @@ const std::unordered_map<std::string, Token> g_token_mapping = {
     { "binary", TOKEN_BINARY },
     {  "unary", TOKEN_UNARY  },
     { "global", TOKEN_GLOBAL },
+    {  "const", TOKEN_CONST  },
 };
 
 
 /**
  * Function Declare
  */
-// extract a token from stdin
+// extract a token from the input, stdin unless `SetLexerInput` is called
 int GetToken();
 
+// lex the characters in [begin, end) instead of stdin, the range must outlive the lexing
+void SetLexerInput(const char* begin, const char* end);
+
+void SetLexerInput(const std::string& code);
+
+// lex stdin again
+void ResetLexerInput();
+
+// the rest of the input, read whole: up to the end of stdin, or of the range set by `SetLexerInput`
+// the lexer is then at the end of its input
+std::string ReadRemainingInput();
+
+// whether `ch` is part of an operator token
+bool IsOperatorChar(int ch);
+
 #endif // _H_LEXER
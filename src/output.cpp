@@ -0,0 +1,124 @@
+#include "output.h"
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+
+FlushPolicy g_flush_policy = FLUSH_AUTO;
+
+// room for any formatted double, "%f" of the largest one is 316 characters
+static const size_t max_double_chars = 512;
+
+/**
+ * Class Declare
+ */
+// the output of one thread to one stream, written out when the thread exits at the latest
+class OutputBuffer {
+public:
+    explicit OutputBuffer(int fd) : fd_(fd), data_(new char[capacity]) {}
+
+    ~OutputBuffer() {
+        Flush();
+    }
+
+    void Write(const char* data, size_t size) {
+        if (size > capacity - size_) {
+            Flush();
+            // too large to be worth a copy
+            if (size >= capacity) {
+                WriteAll(data, size);
+                return;
+            }
+        }
+        memcpy(data_.get() + size_, data, size);
+        size_ += size;
+        FlushLines(data, size);
+    }
+
+    void WriteDouble(double value, DoubleFormat format) {
+        if (capacity - size_ < max_double_chars) {
+            Flush();
+        }
+        char* begin = data_.get() + size_;
+#if defined(__cpp_lib_to_chars)
+        auto chars_format = format == DOUBLE_FIXED ? std::chars_format::fixed : std::chars_format::general;
+        size_ = std::to_chars(begin, begin + max_double_chars, value, chars_format, 6).ptr - data_.get();
+#else
+        size_ += snprintf(begin, max_double_chars, format == DOUBLE_FIXED ? "%f" : "%g", value);
+#endif
+    }
+
+    void Flush() {
+        WriteAll(data_.get(), size_);
+        size_ = 0;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    static const size_t capacity = 64 * 1024;
+
+private:
+    // flush after a complete line if the policy asks for it
+    void FlushLines(const char* data, size_t size) {
+        if (policy_ == FLUSH_AUTO) {
+            policy_ = g_flush_policy != FLUSH_AUTO ? g_flush_policy : isatty(fd_) ? FLUSH_LINE : FLUSH_FULL;
+        }
+        if (policy_ == FLUSH_LINE && memchr(data, '\n', size) != nullptr) {
+            Flush();
+        }
+    }
+
+    void WriteAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = write(fd_, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            // the reader is gone, drop the output as stdio does
+            if (n <= 0) {
+                return;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    int fd_;
+    std::unique_ptr<char[]> data_;
+    size_t size_ = 0;
+    FlushPolicy policy_ = FLUSH_AUTO;
+};
+
+static thread_local OutputBuffer stdout_buffer(OUTPUT_STDOUT);
+
+static thread_local OutputBuffer stderr_buffer(OUTPUT_STDERR);
+
+static OutputBuffer& GetBuffer(OutputStream stream) {
+    OutputBuffer& buffer = stream == OUTPUT_STDOUT ? stdout_buffer : stderr_buffer;
+    OutputBuffer& other = stream == OUTPUT_STDOUT ? stderr_buffer : stdout_buffer;
+    if (!other.empty()) {
+        other.Flush();
+    }
+    return buffer;
+}
+
+void WriteOutput(OutputStream stream, const char* data, size_t size) {
+    GetBuffer(stream).Write(data, size);
+}
+
+void WriteOutput(OutputStream stream, const std::string& text) {
+    GetBuffer(stream).Write(text.data(), text.size());
+}
+
+void WriteOutput(OutputStream stream, double value, DoubleFormat format) {
+    GetBuffer(stream).WriteDouble(value, format);
+}
+
+void FlushOutput() {
+    stdout_buffer.Flush();
+    stderr_buffer.Flush();
+}
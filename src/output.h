@@ -0,0 +1,52 @@
+#ifndef _H_OUTPUT
+#define _H_OUTPUT
+
+#include <cstddef>
+#include <string>
+
+/**
+ * Enum Declare
+ */
+// where output goes, the values are the file descriptors
+enum OutputStream {
+    OUTPUT_STDOUT = 1,
+    OUTPUT_STDERR = 2
+};
+
+// when a thread's output buffer is written out, besides FlushOutput, a full buffer and thread exit
+enum FlushPolicy {
+    FLUSH_AUTO = 0,  // FLUSH_LINE for a terminal, FLUSH_FULL otherwise
+    FLUSH_LINE = 1,  // after every complete line
+    FLUSH_FULL = 2   // only when the buffer is full
+};
+
+// how a double is formatted
+enum DoubleFormat {
+    DOUBLE_GENERAL = 0,  // as printf("%g"), e.g. result> 1.5e+08
+    DOUBLE_FIXED = 1     // as printf("%f"), e.g. printd
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// the policy of every thread, set it before any output
+extern FlushPolicy g_flush_policy;
+
+
+/**
+ * Function Declare
+ */
+// append to the calling thread's buffer of `stream`, nothing else should write to the stream meanwhile
+// the buffer of the other stream is flushed first, so stdout and stderr stay in order when they are merged
+void WriteOutput(OutputStream stream, const char* data, size_t size);
+
+void WriteOutput(OutputStream stream, const std::string& text);
+
+// format a double straight into the buffer
+void WriteOutput(OutputStream stream, double value, DoubleFormat format);
+
+// write out the calling thread's buffers
+void FlushOutput();
+
+#endif // _H_OUTPUT
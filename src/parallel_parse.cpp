@@ -0,0 +1,213 @@
+#include "parallel_parse.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+// chunks per parsing thread, so that a thread which drew short chunks takes more
+static const size_t chunks_per_thread = 4;
+
+// a token found by the pre-scan: where it is, and whether it is an identifier (or a keyword), a number, an
+// operator, another character or the end of the input, as GetToken would tell
+struct ScannedToken {
+    int kind = TOKEN_EOF;
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    bool Is(const char* text) const {
+        size_t size = strlen(text);
+        return (size_t) (end - begin) == size && memcmp(begin, text, size) == 0;
+    }
+};
+
+// scan the token starting at `p` or after the white space and comments there, return where the next one starts
+// the same rules as GetToken, without building the token's value
+static const char* ScanToken(const char* p, const char* end, ScannedToken& token) {
+    while (true) {
+        while (p != end && isspace((unsigned char) *p)) {
+            ++p;
+        }
+        if (p == end || *p != '#') {
+            break;
+        }
+        while (p != end && *p != '\n' && *p != '\r') {
+            ++p;
+        }
+    }
+
+    token.begin = p;
+    if (p == end) {
+        token.kind = TOKEN_EOF;
+    } else if (isalpha((unsigned char) *p) || *p == '_') {
+        token.kind = TOKEN_IDENTIFIER;
+        while (++p != end && (isalnum((unsigned char) *p) || *p == '_')) {
+        }
+    } else if (isdigit((unsigned char) *p) || *p == '.') {
+        token.kind = TOKEN_NUMBER;
+        while (++p != end && (isdigit((unsigned char) *p) || *p == '.')) {
+        }
+    } else if (IsOperatorChar((unsigned char) *p)) {
+        token.kind = TOKEN_OPERATOR;
+        while (++p != end && IsOperatorChar((unsigned char) *p)) {
+        }
+    } else {
+        token.kind = (unsigned char) *p++;
+    }
+    token.end = p;
+    return p;
+}
+
+// if the tokens from `p` on are `binary <operator> <precedence>`, as after a `def`, record the precedence
+static void ScanBinaryOperator(const char* p, const char* end, std::unordered_map<std::string, int>& precedences) {
+    ScannedToken keyword, op, precedence;
+    p = ScanToken(p, end, keyword);
+    if (keyword.kind != TOKEN_IDENTIFIER || !keyword.Is("binary")) {
+        return;
+    }
+    p = ScanToken(p, end, op);
+    ScanToken(p, end, precedence);
+    if (op.kind == TOKEN_OPERATOR && precedence.kind == TOKEN_NUMBER) {
+        // converted as ParsePrototype does
+        std::string value(precedence.begin, precedence.end);
+        precedences[std::string(op.begin, op.end)] = (int) strtod(value.c_str(), nullptr);
+    }
+}
+
+bool ParseItem(ParsedItem& item) {
+    while (g_current_token == TOKEN_END) {
+        GetNextToken();
+    }
+    item.kind = g_current_token;
+    switch (g_current_token) {
+        case TOKEN_EOF: return true;
+        case TOKEN_DEF: {
+            item.function = ParseDefinition();
+            if (item.function == nullptr) {
+                return false;
+            }
+            // the compiler registers it again when it compiles the definition, the items parsed before that
+            // need it now
+            const PrototypeAST& proto = item.function->proto();
+            if (proto.IsBinaryOp()) {
+                g_binop_precedence[proto.GetOpName()] = proto.op_precedence();
+            }
+            return true;
+        }
+        case TOKEN_EXTERN: {
+            item.prototype = ParseExtern();
+            return item.prototype != nullptr;
+        }
+        default: {
+            // a token which starts no expression is not consumed, and would be parsed again and again
+            size_t begin = g_token_offset;
+            item.kind = 0;
+            item.expression = ParseTopLevelExpr();
+            return item.expression != nullptr && g_token_offset != begin;
+        }
+    }
+}
+
+std::vector<SourceChunk> SplitSource(const char* begin, const char* end, size_t count,
+                                     const std::unordered_map<std::string, int>& precedences) {
+    size_t target_size = (end - begin) / std::max<size_t>(count, 1) + 1;
+    std::vector<SourceChunk> chunks;
+    chunks.push_back({ begin, end, precedences });
+    std::unordered_map<std::string, int> current = precedences;
+
+    ScannedToken token;
+    const char* p = ScanToken(begin, end, token);
+    while (token.kind != TOKEN_EOF) {
+        bool is_def = token.kind == TOKEN_IDENTIFIER && token.Is("def");
+        if (is_def || (token.kind == TOKEN_IDENTIFIER && token.Is("extern"))) {
+            if ((size_t) (token.begin - chunks.back().begin) >= target_size) {
+                chunks.back().end = token.begin;
+                chunks.push_back({ token.begin, end, current });
+            }
+            // the operator parses with its precedence after the definition, in this chunk and the next ones
+            if (is_def) {
+                ScanBinaryOperator(p, end, current);
+            }
+        }
+        p = ScanToken(p, end, token);
+    }
+    return chunks;
+}
+
+bool ParseChunk(const SourceChunk& chunk, std::vector<ParsedItem>& items) {
+    g_binop_precedence = chunk.precedences;
+    SetLexerInput(chunk.begin, chunk.end);
+    GetNextToken();
+
+    bool parsed = true;
+    while (true) {
+        ParsedItem item;
+        parsed = ParseItem(item);
+        if (!parsed || item.kind == TOKEN_EOF) {
+            break;
+        }
+        items.push_back(std::move(item));
+    }
+    ResetLexerInput();
+    return parsed;
+}
+
+bool ParseInParallel(const char* begin, const char* end, size_t threads,
+                     const std::function<void(ParsedItem&)>& consume) {
+    threads = std::max<size_t>(threads, 1);
+    std::vector<SourceChunk> chunks = SplitSource(begin, end, threads * chunks_per_thread, g_binop_precedence);
+
+    // the items of every chunk, filled in by the parsing threads
+    struct ChunkItems {
+        std::vector<ParsedItem> items;
+        bool parsed = false;
+        bool done = false;
+    };
+    std::vector<ChunkItems> results(chunks.size());
+    std::mutex mutex;
+    std::condition_variable chunk_done;
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<bool> stop(false);
+
+    // the parser state is thread local, every thread starts from the precedences of its chunk
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::min(threads, chunks.size()); ++i) {
+        workers.emplace_back([&]() {
+            for (size_t index = next_chunk++; index < chunks.size() && !stop; index = next_chunk++) {
+                std::vector<ParsedItem> items;
+                bool parsed = ParseChunk(chunks[index], items);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    results[index].items = std::move(items);
+                    results[index].parsed = parsed;
+                    results[index].done = true;
+                }
+                chunk_done.notify_all();
+            }
+        });
+    }
+
+    bool parsed = true;
+    for (size_t index = 0; index < chunks.size() && parsed; ++index) {
+        std::vector<ParsedItem> items;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            chunk_done.wait(lock, [&]() { return results[index].done; });
+            items = std::move(results[index].items);
+            parsed = results[index].parsed;
+        }
+        for (ParsedItem& item : items) {
+            consume(item);
+        }
+    }
+
+    // the chunks after one which does not parse are not needed
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return parsed;
+}
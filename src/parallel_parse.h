@@ -0,0 +1,58 @@
+#ifndef _H_PARALLEL_PARSE
+#define _H_PARALLEL_PARSE
+
+#include "lexer.h"
+#include "parser.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Struct Declare
+ */
+// one top level item, parsed ahead of its compilation
+struct ParsedItem {
+    // TOKEN_DEF, TOKEN_EXTERN, 0 for a top level expression, TOKEN_EOF after the last item
+    int kind = TOKEN_EOF;
+    std::shared_ptr<FunctionAST> function;
+    std::unique_ptr<PrototypeAST> prototype;
+    std::unique_ptr<FunctionAST> expression;
+};
+
+// a range of the input which starts at a `def` or `extern` (or at the start of the input), and the binary operator
+// precedences in effect there
+struct SourceChunk {
+    const char* begin;
+    const char* end;
+    std::unordered_map<std::string, int> precedences;
+};
+
+
+/**
+ * Function Declare
+ */
+// parse the item at `g_current_token` into `item`, skipping the `end` tokens before it, `item.kind` is TOKEN_EOF
+// at the end of the input; the operator of a `def binary` is usable in the items parsed after it
+// return false if the item does not parse, or does not start with a token an item can start with
+bool ParseItem(ParsedItem& item);
+
+// split [begin, end) into at most `count` chunks of similar size, right before `def` and `extern` tokens: every
+// item but the top level expressions starts with one, and nothing before it changes how it parses, except the
+// `def binary` definitions, whose precedences are scanned on the way and added to `precedences`
+// the scan only finds token boundaries, it is a few times faster than lexing
+std::vector<SourceChunk> SplitSource(const char* begin, const char* end, size_t count,
+                                     const std::unordered_map<std::string, int>& precedences);
+
+// parse the items of `chunk` on the calling thread, return false if one does not parse, the items before it are kept
+bool ParseChunk(const SourceChunk& chunk, std::vector<ParsedItem>& items);
+
+// parse [begin, end) on `threads` threads, starting from the precedences of the calling thread, and pass the items
+// to `consume` in source order on the calling thread, the items of a chunk as soon as it and the ones before it are
+// parsed; the range must outlive the call
+// return false if an item does not parse, `consume` has then got the items before it
+bool ParseInParallel(const char* begin, const char* end, size_t threads,
+                     const std::function<void(ParsedItem&)>& consume);
+
+#endif // _H_PARALLEL_PARSE
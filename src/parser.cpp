@@ -1,15 +1,17 @@
 #include "lexer.h"
 #include "parser.h"
+#include "time_report.h"
 
 // current token need to be processed
-int g_current_token;
+thread_local int g_current_token;
 
 int GetNextToken() {
+    PhaseTimer timer(PHASE_LEXING);
     return g_current_token = GetToken();
 }
 
 // define precedence for operator
-std::unordered_map<std::string, int> g_binop_precedence = {
+thread_local std::unordered_map<std::string, int> g_binop_precedence = {
     { "&&", 40 }, { "||", 40 }, { "==",  60 }, { "!=",  60 },
     { "<" , 60 }, { ">" , 60 }, { "<=",  60 }, { ">=",  60 },
     { "+" , 80 }, { "-" , 80 }, {  "*", 100 }, {  "/", 100 },
@@ -18,7 +20,7 @@ std::unordered_map<std::string, int> g_binop_precedence = {
 
 // numberexpr ::= number
 std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto result = std::make_unique<NumberExprAST>(g_number_val);
+    auto result = std::make_unique<NumberExprAST>(g_number_val, g_number_is_integer);
     GetNextToken();
     return result;
 }
@@ -27,6 +29,9 @@ std::unique_ptr<ExprAST> ParseNumberExpr() {
 std::unique_ptr<ExprAST> ParseParenExpr() {
     GetNextToken();  // eat (
     auto expr = ParseExpression();
+    if (!expr || g_current_token != ')') {
+        return nullptr;
+    }
     GetNextToken();  // eat )
     return expr;
 }
@@ -34,20 +39,26 @@ std::unique_ptr<ExprAST> ParseParenExpr() {
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier ( expression, expression, ..., expression )
-std::unique_ptr<ExprAST> ParseIdentifierExpr(bool is_global_scope) {
+std::unique_ptr<ExprAST> ParseIdentifierExpr(bool is_global_scope, bool is_const) {
     std::string id = g_identifier_str;
 
     GetNextToken();  // eat identifier
     if (g_current_token != '(') {
-        return std::make_unique<VariableExprAST>(id, is_global_scope);
+        return std::make_unique<VariableExprAST>(id, is_global_scope, is_const);
     }
 
     GetNextToken();  // eat (
     std::vector<std::unique_ptr<ExprAST>> args;
     while (g_current_token != ')') {
-        args.push_back(ParseExpression());
-        if (g_current_token != ')') {
+        auto arg = ParseExpression();
+        if (!arg) {
+            return nullptr;
+        }
+        args.push_back(std::move(arg));
+        if (g_current_token == ',') {
             GetNextToken();  // eat ,
+        } else if (g_current_token != ')') {
+            return nullptr;
         }
     }
     GetNextToken();  // eat )
@@ -59,9 +70,22 @@ std::unique_ptr<ExprAST> ParseIdentifierExpr(bool is_global_scope) {
 ///   ::= global identifier = expression
 std::unique_ptr<ExprAST> ParseGlobalIdentifierExpr() {
     GetNextToken(); // eat global
+    if (g_current_token != TOKEN_IDENTIFIER) {
+        return nullptr;
+    }
     return ParseIdentifierExpr(true);
 }
 
+/// const identifierexpr
+///   ::= const identifier = expression
+std::unique_ptr<ExprAST> ParseConstIdentifierExpr() {
+    GetNextToken(); // eat const
+    if (g_current_token != TOKEN_IDENTIFIER) {
+        return nullptr;
+    }
+    return ParseIdentifierExpr(true, true);
+}
+
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
@@ -75,6 +99,7 @@ std::unique_ptr<ExprAST> ParsePrimary() {
         case TOKEN_FOR: return ParseForExpr();
         case TOKEN_OPERATOR: return ParseUnary();
         case TOKEN_GLOBAL: return ParseGlobalIdentifierExpr();
+        case TOKEN_CONST: return ParseConstIdentifierExpr();
         default: return nullptr;
     }
 }
@@ -105,6 +130,9 @@ std::unique_ptr<ExprAST> ParseBinOpRhs(int min_precedence, std::unique_ptr<ExprA
         GetNextToken();  // eat binop
 
         auto rhs = ParsePrimary();
+        if (!rhs) {
+            return nullptr;
+        }
         // now we have two possible parsing method
         //   * (lhs binop rhs) binop unparsed
         //   * lhs binop (rhs binop unparsed)
@@ -112,6 +140,9 @@ std::unique_ptr<ExprAST> ParseBinOpRhs(int min_precedence, std::unique_ptr<ExprA
         if (current_precedence < next_precedence) {
             // first process the next operator (with higher precedence)
             rhs = ParseBinOpRhs(current_precedence + 1, std::move(rhs));
+            if (!rhs) {
+                return nullptr;
+            }
         }
 
         lhs = std::make_unique<BinaryExprAST>(binop, std::move(lhs), std::move(rhs)); 
@@ -150,20 +181,36 @@ std::unique_ptr<ExprAST> ParseExpression() {
     return ParseBinOpRhs(0, std::move(lhs));
 }
 
+// parse expressions into `body` up to token `end`, which is not eaten
+// return false if one does not parse, e.g. the input ends before `end`
+static bool ParseBody(int end, std::vector<std::unique_ptr<ExprAST>>& body) {
+    while (g_current_token != end) {
+        auto expr = ParseExpression();
+        if (!expr) {
+            return false;
+        }
+        body.push_back(std::move(expr));
+    }
+    return true;
+}
+
 // ifexpr
 //   ::= if expr then expr else expr
 std::unique_ptr<ExprAST> ParseIfExpr() {
     GetNextToken(); // eat if
     std::unique_ptr<ExprAST> cond = ParseExpression();
+    if (!cond || g_current_token != TOKEN_THEN) {
+        return nullptr;
+    }
     GetNextToken(); // eat then
     std::vector<std::unique_ptr<ExprAST>> then_expr;
-    while (g_current_token != TOKEN_ELSE) {
-        then_expr.push_back(ParseExpression());
+    if (!ParseBody(TOKEN_ELSE, then_expr)) {
+        return nullptr;
     }
     GetNextToken(); // eat else
     std::vector<std::unique_ptr<ExprAST>> else_expr;
-    while (g_current_token != TOKEN_END) {
-        else_expr.push_back(ParseExpression());
+    if (!ParseBody(TOKEN_END, else_expr)) {
+        return nullptr;
     }
     GetNextToken(); // eat end
     return std::make_unique<IfExprAST>(std::move(cond), std::move(then_expr), std::move(else_expr));
@@ -173,18 +220,33 @@ std::unique_ptr<ExprAST> ParseIfExpr() {
 //   ::= for var_name = start_expr, end_expr, step_expr in body_expr
 std::unique_ptr<ExprAST> ParseForExpr() {
     GetNextToken(); // eat for
+    if (g_current_token != TOKEN_IDENTIFIER) {
+        return nullptr;
+    }
     std::string var_name = g_identifier_str;
     GetNextToken(); // eat var_name
+    if (g_current_token != TOKEN_OPERATOR || g_operator_str != "=") {
+        return nullptr;
+    }
     GetNextToken(); // eat =
     std::unique_ptr<ExprAST> start_expr = ParseExpression();
+    if (!start_expr || g_current_token != ',') {
+        return nullptr;
+    }
     GetNextToken(); // eat ,
     std::unique_ptr<ExprAST> end_expr = ParseExpression();
+    if (!end_expr || g_current_token != ',') {
+        return nullptr;
+    }
     GetNextToken(); // eat ,
     std::unique_ptr<ExprAST> step_expr = ParseExpression();
+    if (!step_expr || g_current_token != TOKEN_IN) {
+        return nullptr;
+    }
     GetNextToken(); // eat in
     std::vector<std::unique_ptr<ExprAST>> body_expr;
-    while (g_current_token != TOKEN_END) {
-        body_expr.push_back(ParseExpression());
+    if (!ParseBody(TOKEN_END, body_expr)) {
+        return nullptr;
     }
     GetNextToken(); // eat end
     return std::make_unique<ForExprAST>(
@@ -207,6 +269,9 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
         }
         case TOKEN_UNARY: {
             GetNextToken(); // eat unary
+            if (g_current_token != TOKEN_OPERATOR) {
+                return nullptr;
+            }
             function_name = "unary";
             function_name += g_operator_str;
             is_operator = true;
@@ -215,19 +280,32 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
         }
         case TOKEN_BINARY: {
             GetNextToken(); // eat binary
+            if (g_current_token != TOKEN_OPERATOR) {
+                return nullptr;
+            }
             function_name = "binary";
             function_name += g_operator_str;
             is_operator = true;
             GetNextToken();  // eat binary op
+            if (g_current_token != TOKEN_NUMBER) {
+                return nullptr;
+            }
             precedence = g_number_val;
             GetNextToken();  // eat op precedence
             break;
         }
+        default: return nullptr;
     }
 
+    if (g_current_token != '(') {
+        return nullptr;
+    }
     GetNextToken(); // eat (
     std::vector<std::string> arg_names;
     while (g_current_token != ')') {
+        if (g_current_token != TOKEN_IDENTIFIER) {
+            return nullptr;
+        }
         arg_names.push_back(g_identifier_str);
         GetNextToken(); // eat arg
         if (g_current_token == ',') {
@@ -236,6 +314,12 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
     }
     GetNextToken(); // eat )
 
+    // an operator takes its operands
+    size_t operand_count = function_name.compare(0, 5, "unary") == 0 ? 1 : 2;
+    if (is_operator && arg_names.size() != operand_count) {
+        return nullptr;
+    }
+
     return std::make_unique<PrototypeAST>(function_name, std::move(arg_names), is_operator, precedence);
 }
 
@@ -244,9 +328,8 @@ std::unique_ptr<FunctionAST> ParseDefinition() {
     GetNextToken();  // eat def
     auto proto = ParsePrototype();
     std::vector<std::unique_ptr<ExprAST>> body;
-    while (g_current_token != TOKEN_END) {
-        auto expr = ParseExpression();
-        body.push_back(std::move(expr));
+    if (!proto || !ParseBody(TOKEN_END, body)) {
+        return nullptr;
     }
     GetNextToken();  // eat end
     return std::make_unique<FunctionAST>(std::move(proto), std::move(body));
@@ -262,7 +345,42 @@ std::unique_ptr<PrototypeAST> ParseExtern() {
 std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
     auto proto = std::make_unique<PrototypeAST>(top_level_expr_name, std::vector<std::string>());
     auto expr = ParseExpression();
+    if (!expr) {
+        return nullptr;
+    }
     std::vector<std::unique_ptr<ExprAST>> body;
     body.push_back(std::move(expr));
     return std::make_unique<FunctionAST>(std::move(proto), std::move(body));
 }
+
+static size_t CountBodyNodes(const std::vector<std::unique_ptr<ExprAST>>& body) {
+    size_t count = 0;
+    for (auto& expr : body) {
+        count += expr->CountNodes();
+    }
+    return count;
+}
+
+size_t NumberExprAST::CountNodes() const { return 1; }
+
+size_t VariableExprAST::CountNodes() const { return 1; }
+
+size_t BinaryExprAST::CountNodes() const { return 1 + lhs_->CountNodes() + rhs_->CountNodes(); }
+
+size_t UnaryExprAST::CountNodes() const { return 1 + operand_->CountNodes(); }
+
+size_t CallExprAST::CountNodes() const { return 1 + CountBodyNodes(args_); }
+
+size_t IfExprAST::CountNodes() const {
+    return 1 + cond_->CountNodes() + CountBodyNodes(then_expr_) + CountBodyNodes(else_expr_);
+}
+
+size_t ForExprAST::CountNodes() const {
+    return 1 + start_expr_->CountNodes() + end_expr_->CountNodes() + step_expr_->CountNodes()
+        + CountBodyNodes(body_expr_);
+}
+
+// a prototype holds names only
+size_t PrototypeAST::CountNodes() const { return 1; }
+
+size_t FunctionAST::CountNodes() const { return 1 + CountBodyNodes(body_); }
@@ -2,6 +2,9 @@
 #define _H_PARSER
 
 #include "codegen.h"
+#include "type_infer.h"
+#include "expr_cache.h"
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -10,14 +13,29 @@
  * Global Variable Declare
  */
 // current token need to be processed
-extern int g_current_token;
+extern thread_local int g_current_token;
 
 // define precedence for operator
-extern std::unordered_map<std::string, int> g_binop_precedence;
+extern thread_local std::unordered_map<std::string, int> g_binop_precedence;
 
 // symbol for top level expression
 const std::string top_level_expr_name = "__anon_expr";
 
+/**
+ * Struct Declare
+ */
+class PrototypeAST;
+
+// names a function body may refer to, see `ExprAST::Validate`
+struct NameScope {
+    // the function being validated, which may call itself before it is defined
+    const PrototypeAST* function = nullptr;
+
+    // its arguments, and the variables assigned so far in source order, which is the order they are generated in
+    std::set<std::string> locals;
+};
+
+
 /**
  * CLASS DECLARE
  */
@@ -27,34 +45,68 @@ class ExprAST {
     virtual ~ExprAST() {}
 
     virtual llvm::Value* CodeGen() = 0;
+
+    // infer the value type of this expression, record it (and its children) in `info`
+    virtual ValueType InferType(TypeInfo& info) = 0;
+
+    // append the structure of this expression to `key`, see expr_cache.h
+    virtual void AppendKey(ExprKey& key) const = 0;
+
+    // number of expression nodes in this tree, itself included
+    virtual size_t CountNodes() const = 0;
+
+    // check that the functions, operators and variables this expression refers to are defined, and add the
+    // variables it assigns to `scope`; return false and set `error` otherwise, the expression must not be compiled
+    virtual bool Validate(NameScope& scope, std::string& error) const = 0;
 };
 
 // number literal expression
 class NumberExprAST : public ExprAST {
   public:
-    NumberExprAST(double val) : val_(val) {}
+    // `is_integer`: written without a decimal point, which an integer type may be inferred for
+    NumberExprAST(double val, bool is_integer = false) : val_(val), is_integer_(is_integer) {}
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     double val_;
+    bool is_integer_;
 };
 
 // variable expression
 class VariableExprAST : public ExprAST {
   public:
-    VariableExprAST(const std::string& name, bool is_global_scope = false)
-        : name_(name), is_global_scope_(is_global_scope) {}
+    VariableExprAST(const std::string& name, bool is_global_scope = false, bool is_const = false)
+        : name_(name), is_global_scope_(is_global_scope), is_const_(is_const) {}
 
     const std::string& name() const noexcept { return name_; }
 
     bool isGlobalScope() const noexcept { return is_global_scope_; }
 
+    bool isConst() const noexcept { return is_const_; }
+
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string name_;
     bool is_global_scope_;
+    bool is_const_;
 };
 
 // binary operation expression
@@ -63,8 +115,22 @@ class BinaryExprAST : public ExprAST {
     BinaryExprAST(const std::string& op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs)
         : op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
 
+    const std::string& op() const noexcept { return op_; }
+
+    const ExprAST* lhs() const noexcept { return lhs_.get(); }
+
+    const ExprAST* rhs() const noexcept { return rhs_.get(); }
+
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string op_;
     std::unique_ptr<ExprAST> lhs_;
@@ -79,6 +145,14 @@ class UnaryExprAST : public ExprAST {
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string op_;
     std::unique_ptr<ExprAST> operand_;
@@ -92,6 +166,14 @@ class CallExprAST : public ExprAST {
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string callee_;
     std::vector<std::unique_ptr<ExprAST>> args_;
@@ -110,6 +192,14 @@ class IfExprAST : public ExprAST {
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::unique_ptr<ExprAST> cond_;
     std::vector<std::unique_ptr<ExprAST>> then_expr_;
@@ -133,6 +223,14 @@ class ForExprAST : public ExprAST {
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string var_name_;
     std::unique_ptr<ExprAST> start_expr_;
@@ -155,10 +253,20 @@ class PrototypeAST : public ExprAST {
 
     bool IsBinaryOp() const noexcept { return is_operator_ && args_.size() == 2; }
 
+    const std::vector<std::string>& args() const noexcept { return args_; }
+
     std::string GetOpName() const { return IsBinaryOp() ? name_.substr(6) : name_.substr(5); }
 
     llvm::Value* CodeGen() override;
 
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
     std::string name_;
     std::vector<std::string> args_;
@@ -172,10 +280,27 @@ class FunctionAST : public ExprAST {
     FunctionAST(std::unique_ptr<PrototypeAST> proto, std::vector<std::unique_ptr<ExprAST>> body)
         : proto_(std::move(proto)), body_(std::move(body)) {}
 
+    const PrototypeAST& proto() const noexcept { return *proto_; }
+
     llvm::Value* CodeGen() override;
 
+    // codegen the clone of this function described by specialization `key`
+    llvm::Function* CodeGenSpecialization(const std::string& key);
+
+    // `info` must be seeded with the argument types, see `InferFunctionType`
+    ValueType InferType(TypeInfo& info) override;
+
+    void AppendKey(ExprKey& key) const override;
+
+    size_t CountNodes() const override;
+
+    bool Validate(NameScope& scope, std::string& error) const override;
+
   private:
-    std::unique_ptr<PrototypeAST> proto_;
+    // codegen body into `func` using the types in `info`
+    void CodeGenBody(llvm::Function* func, const TypeInfo& info);
+
+    std::shared_ptr<PrototypeAST> proto_;
     std::vector<std::unique_ptr<ExprAST>> body_;
 };
 
@@ -198,12 +323,16 @@ std::unique_ptr<ExprAST> ParseParenExpr();
 // identifierexpr 
 //   ::= identifier 
 //   ::= identifier ( expression, expression, ..., expression ) 
-std::unique_ptr<ExprAST> ParseIdentifierExpr(bool is_global_scope = false);
+std::unique_ptr<ExprAST> ParseIdentifierExpr(bool is_global_scope = false, bool is_const = false);
 
 /// global identifierexpr
 ///   ::= global identifier = expression
 std::unique_ptr<ExprAST> ParseGlobalIdentifierExpr();
 
+/// const identifierexpr
+///   ::= const identifier = expression
+std::unique_ptr<ExprAST> ParseConstIdentifierExpr();
+
 // primary 
 //   ::= identifierexpr 
 //   ::= numberexpr 
@@ -0,0 +1,117 @@
+#include "perf_counters.h"
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char* const perf_counter_names[COUNTER_COUNT] = {
+    "cycles", "instructions", "cache-misses", "branch-misses", "page-faults"
+};
+
+// file descriptor of every counter, -1 if closed; the first open one leads the group
+static thread_local int counter_fds[COUNTER_COUNT] = { -1, -1, -1, -1, -1 };
+
+// the counters in the order they joined the group, which is the order a group read returns them in
+static thread_local std::vector<PerfCounter> group_order;
+
+#ifdef __linux__
+
+static int OpenCounter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // this thread only, on any CPU
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+bool OpenPerfCounters(std::string& error) {
+    ClosePerfCounters();
+    const std::pair<uint32_t, uint64_t> events[COUNTER_COUNT] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+    };
+
+    error.clear();
+    int leader_fd = -1;
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        int fd = OpenCounter(events[counter].first, events[counter].second, leader_fd);
+        if (fd < 0) {
+            error += std::string(error.empty() ? "" : ", ") + perf_counter_names[counter] + ": " + strerror(errno);
+            continue;
+        }
+        counter_fds[counter] = fd;
+        group_order.push_back((PerfCounter) counter);
+        if (leader_fd < 0) {
+            leader_fd = fd;
+        }
+    }
+    return leader_fd >= 0;
+}
+
+PerfCounterValues ReadPerfCounters() {
+    PerfCounterValues result;
+    if (group_order.empty()) {
+        return result;
+    }
+
+    // nr, time enabled, time running, then one value per counter
+    uint64_t buffer[3 + COUNTER_COUNT];
+    ssize_t size = read(counter_fds[group_order.front()], buffer, sizeof(buffer));
+    if (size < (ssize_t) (3 * sizeof(uint64_t)) || buffer[0] != group_order.size()) {
+        return result;
+    }
+    uint64_t time_enabled = buffer[1];
+    uint64_t time_running = buffer[2];
+    for (size_t i = 0; i < group_order.size(); ++i) {
+        uint64_t value = buffer[3 + i];
+        // the group was only scheduled part of the time, extrapolate
+        if (time_running > 0 && time_running < time_enabled) {
+            value = (uint64_t) ((double) value * time_enabled / time_running);
+        }
+        result.values[group_order[i]] = value;
+    }
+    return result;
+}
+
+#else
+
+bool OpenPerfCounters(std::string& error) {
+    error = "perf_event_open is only available on Linux";
+    return false;
+}
+
+PerfCounterValues ReadPerfCounters() {
+    return PerfCounterValues();
+}
+
+#endif
+
+bool IsPerfCounterOpen(PerfCounter counter) {
+    return counter_fds[counter] >= 0;
+}
+
+void ClosePerfCounters() {
+#ifdef __linux__
+    // members first, the leader last
+    for (auto it = group_order.rbegin(); it != group_order.rend(); ++it) {
+        close(counter_fds[*it]);
+    }
+#endif
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        counter_fds[counter] = -1;
+    }
+    group_order.clear();
+}
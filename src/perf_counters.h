@@ -0,0 +1,68 @@
+#ifndef _H_PERF_COUNTERS
+#define _H_PERF_COUNTERS
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Enum Declare
+ */
+// hardware and software counters of the calling thread, user space only
+enum PerfCounter {
+    COUNTER_CYCLES = 0,
+    COUNTER_INSTRUCTIONS = 1,
+    COUNTER_CACHE_MISSES = 2,
+    COUNTER_BRANCH_MISSES = 3,
+    COUNTER_PAGE_FAULTS = 4,
+    COUNTER_COUNT = 5
+};
+
+
+/**
+ * Struct Declare
+ */
+struct PerfCounterValues {
+    uint64_t values[COUNTER_COUNT] = {};
+
+    PerfCounterValues& operator+=(const PerfCounterValues& other) {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            values[counter] += other.values[counter];
+        }
+        return *this;
+    }
+
+    PerfCounterValues operator-(const PerfCounterValues& other) const {
+        PerfCounterValues result;
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            result.values[counter] = values[counter] - other.values[counter];
+        }
+        return result;
+    }
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// e.g. "cycles", "instructions", "cache-misses", "branch-misses", "page-faults"
+extern const char* const perf_counter_names[COUNTER_COUNT];
+
+
+/**
+ * Function Declare
+ */
+// open the counters for the calling thread with perf_event_open, as one group read by a single syscall
+// threads started by the compiler (e.g. the tier-up thread) are not counted
+// return false and set `error` if none can be opened; counters which cannot be opened while others can
+// (e.g. hardware counters in a VM without a virtual PMU) are left closed and named in `error`
+bool OpenPerfCounters(std::string& error);
+
+// whether a counter is open on the calling thread
+bool IsPerfCounterOpen(PerfCounter counter);
+
+// current totals of the calling thread's counters, scaled if the kernel multiplexed them, 0 for closed ones
+PerfCounterValues ReadPerfCounters();
+
+void ClosePerfCounters();
+
+#endif // _H_PERF_COUNTERS
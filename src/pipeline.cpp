@@ -0,0 +1,90 @@
+#include "pipeline.h"
+#include "codegen.h"
+#include "parser.h"
+#include "lexer.h"
+#include "parallel_parse.h"
+#include "time_report.h"
+#include <future>
+#include <thread>
+#include <unordered_map>
+
+// compile and run the items on the backend thread, in the order they were parsed, an item which does not compile
+// is reported and skipped as in the console
+static void CompileItems(BoundedQueue<ParsedItem>& queue) {
+    std::string error;
+    while (true) {
+        ParsedItem item = queue.Pop();
+        switch (item.kind) {
+            case TOKEN_EOF: return;
+            case TOKEN_DEF: {
+                ItemTimer item_timer("def");
+                item_timer.SetName(item.function->proto().name());
+                if (!CompileDefinition(std::move(item.function), error)) {
+                    WriteCompileError(error);
+                }
+                break;
+            }
+            case TOKEN_EXTERN: {
+                ItemTimer item_timer("extern");
+                item_timer.SetName(item.prototype->name());
+                CompileExtern(std::move(item.prototype));
+                break;
+            }
+            default: {
+                ItemTimer item_timer("expr");
+                double result;
+                if (!RunTopLevel(std::move(item.expression), result, error)) {
+                    WriteCompileError(error);
+                }
+                break;
+            }
+        }
+    }
+}
+
+bool RunPipelined(size_t queue_capacity, size_t parse_threads, const std::function<bool()>& start,
+                  const std::function<bool()>& finish) {
+    BoundedQueue<ParsedItem> queue(queue_capacity);
+    std::unordered_map<std::string, int> start_precedences;
+    std::promise<bool> started;
+    bool finished = false;
+
+    std::thread backend([&]() {
+        bool ok = start();
+        start_precedences = g_binop_precedence;
+        started.set_value(ok);
+        if (ok) {
+            CompileItems(queue);
+            finished = finish();
+        }
+    });
+
+    if (!started.get_future().get()) {
+        backend.join();
+        return false;
+    }
+    // a snapshot may define operators, parse with the precedences of the backend
+    g_binop_precedence = start_precedences;
+
+    bool parsed = true;
+    if (parse_threads > 1) {
+        // the chunks are split from the whole input, the items go to the backend as soon as they are in order
+        std::string input = ReadRemainingInput();
+        parsed = ParseInParallel(input.data(), input.data() + input.size(), parse_threads,
+                                 [&queue](ParsedItem& item) { queue.Push(std::move(item)); });
+    } else {
+        GetNextToken();
+        while (true) {
+            ParsedItem item;
+            parsed = ParseItem(item);
+            if (!parsed || item.kind == TOKEN_EOF) {
+                break;
+            }
+            queue.Push(std::move(item));
+        }
+    }
+
+    queue.Push(ParsedItem());
+    backend.join();
+    return parsed && finished;
+}
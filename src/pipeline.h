@@ -0,0 +1,66 @@
+#ifndef _H_PIPELINE
+#define _H_PIPELINE
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+/**
+ * Class Declare
+ */
+// a FIFO of at most `capacity` values between threads, Push blocks while it is full and Pop while it is empty
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+    void Push(T value) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_full_.wait(lock, [this]() { return values_.size() < capacity_; });
+            values_.push_back(std::move(value));
+        }
+        not_empty_.notify_one();
+    }
+
+    T Pop() {
+        T value;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            not_empty_.wait(lock, [this]() { return !values_.empty(); });
+            value = std::move(values_.front());
+            values_.pop_front();
+        }
+        not_full_.notify_one();
+        return value;
+    }
+
+private:
+    const size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> values_;
+};
+
+
+/**
+ * Function Declare
+ */
+// run the lexer input through a two stage pipeline: the calling thread lexes and parses it, and a backend thread
+// generates, optimizes, compiles and runs the items in source order, with at most `queue_capacity` parsed items
+// waiting between them, so that parsing the next items overlaps compiling the previous ones
+// the compiler state is thread local: `start` sets up the backend thread (JIT, module, flags, snapshot) before the
+// first item and `finish` reports when the input ends, both run on it; parsing starts from the operator
+// precedences `start` left, and a binary operator is usable as soon as its definition is parsed
+// top level items are only timed on the backend thread, so a time report does not include lexing and parsing
+// with `parse_threads` > 1, the input is read whole and parsed on that many threads (see parallel_parse.h), the
+// backend compiles the items of the first chunks while the next ones are parsed
+// return false if `start` or `finish` does, or if the input does not parse, in which case it is read up to the
+// item which failed
+bool RunPipelined(size_t queue_capacity, size_t parse_threads, const std::function<bool()>& start,
+                  const std::function<bool()>& finish);
+
+#endif // _H_PIPELINE
@@ -0,0 +1,71 @@
+#include "protocol.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static bool ReadAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteFrame(int fd, const std::string& payload) {
+    uint32_t size = payload.size();
+    // header and payload in one system call
+    struct iovec parts[2] = {
+        { &size, sizeof(size) },
+        { (void*) payload.data(), payload.size() }
+    };
+    struct iovec* part = parts;
+    int count = 2;
+    while (count > 0) {
+        ssize_t n = writev(fd, part, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        while (count > 0 && (size_t) n >= part->iov_len) {
+            n -= part->iov_len;
+            ++part;
+            --count;
+        }
+        if (count > 0) {
+            part->iov_base = (char*) part->iov_base + n;
+            part->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool ReadFrame(int fd, std::string& payload) {
+    uint32_t size = 0;
+    if (!ReadAll(fd, (char*) &size, sizeof(size)) || size > max_frame_size) {
+        return false;
+    }
+    payload.resize(size);
+    return ReadAll(fd, &payload[0], size);
+}
+
+void AppendDoubles(std::string& payload, const std::vector<double>& values) {
+    payload.append((const char*) values.data(), values.size() * sizeof(double));
+}
+
+std::vector<double> ReadDoubles(const std::string& payload, size_t offset) {
+    std::vector<double> values(offset < payload.size() ? (payload.size() - offset) / sizeof(double) : 0);
+    if (!values.empty()) {
+        memcpy(values.data(), payload.data() + offset, values.size() * sizeof(double));
+    }
+    return values;
+}
@@ -0,0 +1,44 @@
+#ifndef _H_PROTOCOL
+#define _H_PROTOCOL
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Enum Declare
+ */
+// first byte of every frame of the compile server protocol
+// a frame is a uint32 payload length in host byte order (both ends are on one host), then the payload
+//   MESSAGE_COMPILE code        -> MESSAGE_OK values of its top level expressions
+//   MESSAGE_CALL name \0 args   -> MESSAGE_OK the returned value
+//   MESSAGE_PING                -> MESSAGE_OK
+// any request may be answered by MESSAGE_ERROR and a message instead, values are raw doubles
+enum MessageKind : char {
+    MESSAGE_COMPILE = 'c',
+    MESSAGE_CALL = 'f',
+    MESSAGE_PING = 'p',
+    MESSAGE_OK = 'o',
+    MESSAGE_ERROR = 'e'
+};
+
+// frames above this size are rejected, and the connection is closed
+const uint32_t max_frame_size = 64 * 1024 * 1024;
+
+
+/**
+ * Function Declare
+ */
+// write one frame, retrying short writes, return false if the connection is gone
+bool WriteFrame(int fd, const std::string& payload);
+
+// read one frame, return false on end of stream, error or an oversized frame
+bool ReadFrame(int fd, std::string& payload);
+
+// append the doubles as raw bytes
+void AppendDoubles(std::string& payload, const std::vector<double>& values);
+
+// read the doubles starting at `offset`
+std::vector<double> ReadDoubles(const std::string& payload, size_t offset);
+
+#endif // _H_PROTOCOL
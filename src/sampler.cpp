@@ -0,0 +1,369 @@
+#include "sampler.h"
+#include "codegen.h"
+#include "llvm/Demangle/Demangle.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+// frames kept per sample, deeper stacks lose their outermost frames
+static const int max_frames = 48;
+
+// samples buffered between two CollectSamples, over a minute of CPU time at 99 Hz
+static const uint64_t ring_size = 8192;
+
+struct Sample {
+    uint32_t depth;
+    // the interrupted instruction, then return addresses
+    uintptr_t frames[max_frames];
+};
+
+// written by the signal handler only, read by CollectSamples only: a single producer, single consumer ring
+static Sample* ring = nullptr;
+static std::atomic<uint64_t> ring_head(0);
+static std::atomic<uint64_t> ring_tail(0);
+static std::atomic<uint64_t> dropped_samples(0);
+
+// the sampled thread's stack ends here, a frame pointer is only followed between the stack pointer and it
+static std::atomic<uintptr_t> stack_end(0);
+static pthread_t sampled_thread;
+static std::atomic<bool> sampling(false);
+
+// guards the state below, never taken by the signal handler
+static std::mutex sampler_mutex;
+static unsigned sampler_frequency = 0;
+static bool handler_installed = false;
+#ifdef __linux__
+static timer_t sampler_timer;
+static bool timer_created = false;
+#endif
+static std::map<std::string, uint64_t> folded_stacks;
+static uint64_t sample_count = 0;
+static std::unordered_map<uintptr_t, std::string> host_names;
+
+// program counter, frame pointer and stack pointer of the interrupted code, false if unknown for this target
+static bool ReadRegisters(void* context, uintptr_t& pc, uintptr_t& fp, uintptr_t& sp) {
+    ucontext_t* uc = (ucontext_t*) context;
+#if defined(__linux__) && defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+    return true;
+#elif defined(__linux__) && defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+    return true;
+#elif defined(__APPLE__) && defined(__x86_64__)
+    pc = uc->uc_mcontext->__ss.__rip;
+    fp = uc->uc_mcontext->__ss.__rbp;
+    sp = uc->uc_mcontext->__ss.__rsp;
+    return true;
+#elif defined(__APPLE__) && defined(__aarch64__)
+    pc = uc->uc_mcontext->__ss.__pc;
+    fp = uc->uc_mcontext->__ss.__fp;
+    sp = uc->uc_mcontext->__ss.__sp;
+    return true;
+#else
+    (void) uc;
+    return false;
+#endif
+}
+
+// async signal safe: no allocation, no lock, and only stack memory of the sampled thread is read
+static void HandleSigprof(int, siginfo_t*, void* context) {
+    if (!sampling.load(std::memory_order_relaxed) || !pthread_equal(pthread_self(), sampled_thread)) {
+        return;
+    }
+    uintptr_t pc, fp, sp;
+    if (!ReadRegisters(context, pc, fp, sp)) {
+        return;
+    }
+    uint64_t head = ring_head.load(std::memory_order_relaxed);
+    if (head - ring_tail.load(std::memory_order_acquire) >= ring_size) {
+        dropped_samples.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Sample& sample = ring[head % ring_size];
+    sample.depth = 0;
+    sample.frames[sample.depth++] = pc;
+    // every frame record is { caller's frame pointer, return address }, and callers' frames are higher up
+    uintptr_t end = stack_end.load(std::memory_order_relaxed);
+    while (sample.depth < max_frames && fp >= sp && fp <= end - 2 * sizeof(uintptr_t) &&
+           fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t* record = (const uintptr_t*) fp;
+        if (record[1] == 0) {
+            break;
+        }
+        sample.frames[sample.depth++] = record[1];
+        if (record[0] <= fp) {
+            break;
+        }
+        fp = record[0];
+    }
+    ring_head.store(head + 1, std::memory_order_release);
+}
+
+static bool FindStackEnd(uintptr_t& end) {
+#if defined(__linux__)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+    void* address = nullptr;
+    size_t size = 0;
+    int result = pthread_attr_getstack(&attr, &address, &size);
+    pthread_attr_destroy(&attr);
+    end = (uintptr_t) address + size;
+    return result == 0;
+#elif defined(__APPLE__)
+    end = (uintptr_t) pthread_get_stackaddr_np(pthread_self());
+    return true;
+#else
+    return false;
+#endif
+}
+
+// fire SIGPROF `frequency` times per second of the calling thread's CPU time, 0 to disarm
+static bool ArmTimer(unsigned frequency, std::string& error) {
+    long interval_us = frequency > 0 ? std::max(1L, 1000000L / (long) frequency) : 0;
+#ifdef __linux__
+    if (!timer_created) {
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = SIGPROF;
+        event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler_timer) != 0) {
+            error = std::string("cannot create the sampling timer: ") + strerror(errno);
+            return false;
+        }
+        timer_created = true;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_interval.tv_sec = interval_us / 1000000;
+    spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(sampler_timer, 0, &spec, nullptr) != 0) {
+        error = std::string("cannot arm the sampling timer: ") + strerror(errno);
+        return false;
+    }
+    if (frequency == 0) {
+        timer_delete(sampler_timer);
+        timer_created = false;
+    }
+#else
+    // process wide, the handler ignores the signals delivered to other threads
+    struct itimerval spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_interval.tv_sec = interval_us / 1000000;
+    spec.it_interval.tv_usec = interval_us % 1000000;
+    spec.it_value = spec.it_interval;
+    if (setitimer(ITIMER_PROF, &spec, nullptr) != 0) {
+        error = std::string("cannot arm the sampling timer: ") + strerror(errno);
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool StartSampler(unsigned frequency, std::string& error) {
+    if (frequency == 0) {
+        StopSampler();
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    if (sampler_frequency > 0 && !pthread_equal(pthread_self(), sampled_thread)) {
+        error = "another thread is being sampled";
+        return false;
+    }
+    if (!g_jit || !g_jit->isSamplingEnabled()) {
+        error = "the JIT does not keep the frame pointers and function addresses sampling needs (--profile)";
+        return false;
+    }
+#if !(defined(__linux__) || defined(__APPLE__)) || !(defined(__x86_64__) || defined(__aarch64__))
+    error = "sampling is only implemented for x86-64 and AArch64 Linux and macOS";
+    return false;
+#endif
+    uintptr_t end;
+    if (!FindStackEnd(end)) {
+        error = "cannot find the stack of the calling thread";
+        return false;
+    }
+
+    if (ring == nullptr) {
+        ring = (Sample*) calloc(ring_size, sizeof(Sample));
+        if (ring == nullptr) {
+            error = "cannot allocate the sample buffer";
+            return false;
+        }
+    }
+    if (!handler_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = HandleSigprof;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, nullptr) != 0) {
+            error = std::string("cannot install the SIGPROF handler: ") + strerror(errno);
+            return false;
+        }
+        handler_installed = true;
+    }
+
+    sampled_thread = pthread_self();
+    stack_end.store(end);
+    sampling.store(true);
+    if (!ArmTimer(frequency, error)) {
+        sampling.store(false);
+        return false;
+    }
+    sampler_frequency = frequency;
+    return true;
+}
+
+void StopSampler() {
+    {
+        std::lock_guard<std::mutex> lock(sampler_mutex);
+        if (sampler_frequency == 0) {
+            return;
+        }
+        std::string error;
+        ArmTimer(0, error);
+        sampling.store(false);
+        sampler_frequency = 0;
+    }
+    CollectSamples();
+}
+
+unsigned GetSamplerFrequency() {
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    return sampler_frequency;
+}
+
+// a frame of the compiler or of a builtin, after the dynamic symbol containing it
+static const std::string& HostName(uintptr_t address) {
+    auto found = host_names.find(address);
+    if (found != host_names.end()) {
+        return found->second;
+    }
+    std::string name = "[unknown]";
+    Dl_info info;
+    if (dladdr((void*) address, &info) != 0) {
+        if (info.dli_sname != nullptr) {
+            name = llvm::demangle(info.dli_sname);
+        } else if (info.dli_fname != nullptr) {
+            name = std::string("[") + info.dli_fname + "]";
+        }
+    }
+    return host_names.emplace(address, name).first->second;
+}
+
+// ';' separates the frames of a folded stack, e.g. in the name of a `binary;` operator
+static std::string FrameName(std::string name) {
+    std::replace(name.begin(), name.end(), ';', ':');
+    return name;
+}
+
+void CollectSamples() {
+    uint64_t tail = ring_tail.load(std::memory_order_relaxed);
+    if (ring == nullptr || ring_head.load(std::memory_order_acquire) == tail) {
+        return;
+    }
+    // the addresses are only meaningful to the sampled thread's JIT
+    if (!g_jit || !pthread_equal(pthread_self(), sampled_thread)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    uint64_t head = ring_head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail) {
+        const Sample& sample = ring[tail % ring_size];
+        // innermost first; a return address is named by its call instruction, just before it
+        std::vector<std::string> names;
+        uint32_t first_jit_frame = sample.depth;
+        for (uint32_t i = 0; i < sample.depth; ++i) {
+            uintptr_t address = i == 0 ? sample.frames[i] : sample.frames[i] - 1;
+            std::string name = g_jit->findFunctionName(address);
+            if (name.empty()) {
+                // the compiler's own frames below the outermost JIT'd one are RunTopLevel's
+                if (first_jit_frame < sample.depth) {
+                    break;
+                }
+                name = HostName(address);
+            } else if (first_jit_frame == sample.depth) {
+                first_jit_frame = i;
+            }
+            names.push_back(FrameName(name));
+        }
+        if (first_jit_frame == sample.depth) {
+            // compiling, or running the compiler's frames beyond which the chain cannot be followed
+            names.resize(1);
+            names.push_back("[compiler]");
+        }
+
+        std::string stack;
+        for (auto it = names.rbegin(); it != names.rend(); ++it) {
+            stack += (stack.empty() ? "" : ";") + *it;
+        }
+        ++folded_stacks[stack];
+        ++sample_count;
+    }
+    ring_tail.store(head, std::memory_order_release);
+}
+
+bool WriteFoldedStacks(const std::string& path, std::string& error) {
+    CollectSamples();
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    std::ofstream file(path);
+    for (auto& entry : folded_stacks) {
+        file << entry.first << " " << entry.second << "\n";
+    }
+    file.close();
+    if (!file) {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+SamplerStats GetSamplerStats() {
+    std::lock_guard<std::mutex> lock(sampler_mutex);
+    SamplerStats stats;
+    stats.samples = sample_count;
+    stats.dropped = dropped_samples.load();
+    stats.stacks = folded_stacks.size();
+    return stats;
+}
+
+// start sampling at `frequency` per second, or stop at 0, from Kaleidoscope code, e.g. `profile(99)` in the REPL
+// return 1, or 0 and print why sampling cannot start
+extern "C" double profile(double frequency) {
+    std::string error;
+    if (!StartSampler(frequency > 0 ? (unsigned) std::min(frequency, 10000.0) : 0, error)) {
+        std::cerr << "error: profile: " << error << std::endl;
+        return 0.0;
+    }
+    return 1.0;
+}
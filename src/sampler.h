@@ -0,0 +1,47 @@
+#ifndef _H_SAMPLER
+#define _H_SAMPLER
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Struct Declare
+ */
+struct SamplerStats {
+    // stacks taken by the SIGPROF handler and counted by CollectSamples
+    uint64_t samples = 0;
+    // stacks lost because the handler found its buffer full, CollectSamples was not called often enough
+    uint64_t dropped = 0;
+    // distinct folded stacks
+    size_t stacks = 0;
+};
+
+
+/**
+ * Function Declare
+ */
+// sample the calling thread `frequency` times per second of its CPU time: a SIGPROF handler walks the frame
+// pointer chain from the interrupted instruction and buffers the return addresses, nothing else
+// the JIT'd code must keep its frame pointers (ProfilingOptions::Sampling), and the calling thread must be the one
+// which compiles, since the addresses are named by its g_jit
+// calling it again changes the frequency, 0 stops sampling, the samples taken so far are kept either way
+// return false and set `error` if the timer cannot be armed, or another thread is being sampled
+bool StartSampler(unsigned frequency, std::string& error);
+
+void StopSampler();
+
+// samples per second of the running sampler, 0 if it is stopped
+unsigned GetSamplerFrequency();
+
+// name the frames of the buffered samples and count them per stack, on the sampled thread
+// RunTopLevel calls it after every top level expression, while the expression's code is still loaded
+void CollectSamples();
+
+// write the stacks counted so far as "outer;...;inner <samples>" lines, the input of flamegraph.pl
+// JIT'd frames are named after their functions, the frames of the compiler and of the builtins they call after
+// their dynamic symbol, samples without any JIT'd frame are rooted at "[compiler]"
+bool WriteFoldedStacks(const std::string& path, std::string& error);
+
+SamplerStats GetSamplerStats();
+
+#endif // _H_SAMPLER
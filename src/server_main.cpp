@@ -0,0 +1,172 @@
+#include "protocol.h"
+#include "session.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+static std::string ErrorMessage(const std::string& message) {
+    return std::string(1, MESSAGE_ERROR) + message;
+}
+
+static std::string HandleRequest(KaleidoscopeSession& session, const std::string& request) {
+    if (request.empty()) {
+        return ErrorMessage("empty request");
+    }
+    std::string response(1, MESSAGE_OK);
+    switch (request[0]) {
+        case MESSAGE_COMPILE: {
+            std::vector<double> results;
+            std::string error;
+            if (!session.Compile(request.substr(1), results, error)) {
+                return ErrorMessage(error);
+            }
+            AppendDoubles(response, results);
+            return response;
+        }
+        case MESSAGE_CALL: {
+            size_t name_end = request.find('\0', 1);
+            if (name_end == std::string::npos) {
+                return ErrorMessage("missing function name");
+            }
+            std::string name = request.substr(1, name_end - 1);
+            double result = 0;
+            if (!session.Call(name, ReadDoubles(request, name_end + 1), result)) {
+                return ErrorMessage("cannot call " + name + ": not defined, or wrong number of arguments");
+            }
+            AppendDoubles(response, { result });
+            return response;
+        }
+        case MESSAGE_PING: return response;
+        default: return ErrorMessage("unknown request");
+    }
+}
+
+// serve requests one at a time until the client disconnects
+static void ServeConnection(int fd, KaleidoscopeSession& session) {
+    std::string request;
+    while (ReadFrame(fd, request)) {
+        std::string response;
+        // an exception escaping this detached thread would stop the server
+        try {
+            response = HandleRequest(session, request);
+        } catch (const std::exception& e) {
+            response = ErrorMessage(std::string("internal error: ") + e.what());
+        }
+        if (!WriteFrame(fd, response)) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static bool ReadFile(const std::string& path, std::string& content) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// usage: ksc-server.app [--socket <path>] [--sessions N] [--snapshot <file>] [--prelude <file>]
+//                       [--expr-cache N] [--lift-literals]
+// keeps N warm sessions (the number of cores by default), each started from the snapshot with the prelude compiled in,
+// and assigns every connection to one of them in turn, definitions are seen by every connection of a session
+// `--expr-cache N` keeps the code of N top level expressions per session, to run repeated requests without compiling
+// them, `--lift-literals` lets requests differing in their literals only share it, see expr_cache.h
+// code which does not parse, or calls or reads something which is not defined, is answered with MESSAGE_ERROR, the
+// items of the request before it are compiled
+int main(int argc, char* argv[]) {
+    std::string socket_path = "/tmp/ksc.sock";
+    size_t session_count = std::thread::hardware_concurrency();
+    std::string prelude;
+    std::string snapshot_path;
+    size_t expr_cache_capacity = 0;
+    bool lift_literals = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            session_count = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--expr-cache") == 0 && i + 1 < argc) {
+            expr_cache_capacity = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--lift-literals") == 0) {
+            lift_literals = true;
+        } else if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc) {
+            if (!ReadFile(argv[++i], prelude)) {
+                fprintf(stderr, "server> cannot read %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+    if (session_count == 0) {
+        session_count = 1;
+    }
+
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "server> socket path too long: %s\n", socket_path.c_str());
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // LLVM initialization, JIT construction and the prelude are paid once, before listening
+    std::vector<std::unique_ptr<KaleidoscopeSession>> sessions;
+    std::string error;
+    for (size_t i = 0; i < session_count; ++i) {
+        sessions.emplace_back(new KaleidoscopeSession);
+        if (!snapshot_path.empty() && !sessions.back()->LoadSnapshot(snapshot_path, error)) {
+            fprintf(stderr, "server> %s\n", error.c_str());
+            return 1;
+        }
+        sessions.back()->SetExpressionCache(expr_cache_capacity, lift_literals);
+        std::vector<double> results;
+        if (!sessions.back()->Compile(prelude, results, error)) {
+            fprintf(stderr, "server> the prelude does not compile: %s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    // a client may disconnect before its response is written
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        perror("server> cannot listen");
+        return 1;
+    }
+    fprintf(stderr, "server> listening on %s with %zu sessions\n", socket_path.c_str(), sessions.size());
+
+    size_t next_session = 0;
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("server> accept failed");
+            return 1;
+        }
+        KaleidoscopeSession& session = *sessions[next_session++ % sessions.size()];
+        std::thread(ServeConnection, fd, std::ref(session)).detach();
+    }
+
+    return 0;
+}
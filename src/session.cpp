@@ -0,0 +1,207 @@
+#include "session.h"
+#include "codegen.h"
+#include "expr_cache.h"
+#include "instance.h"
+#include "parser.h"
+#include "lexer.h"
+#include "parallel_parse.h"
+#include "snapshot.h"
+#include <future>
+
+static std::once_flag init_native_target_flag;
+
+// look up a function on the session thread
+static void* LookupFunctionAddress(const std::string& name) {
+    llvm::JITSymbol symbol = g_jit->findSymbol(name);
+    if (!symbol) {
+        llvm::consumeError(symbol.takeError());
+        return nullptr;
+    }
+    auto address = symbol.getAddress();
+    if (!address) {
+        llvm::consumeError(address.takeError());
+        return nullptr;
+    }
+    return (void*) *address;
+}
+
+// every function takes and returns doubles, only the arity differs
+static double CallAddress(void* address, const std::vector<double>& args) {
+    const double* a = args.data();
+    switch (args.size()) {
+        case 0: return ((double (*)()) address)();
+        case 1: return ((double (*)(double)) address)(a[0]);
+        case 2: return ((double (*)(double, double)) address)(a[0], a[1]);
+        case 3: return ((double (*)(double, double, double)) address)(a[0], a[1], a[2]);
+        case 4: return ((double (*)(double, double, double, double)) address)(a[0], a[1], a[2], a[3]);
+        case 5: return ((double (*)(double, double, double, double, double)) address)(a[0], a[1], a[2], a[3], a[4]);
+        default: return ((double (*)(double, double, double, double, double, double)) address)(
+                            a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+}
+
+KaleidoscopeSession::KaleidoscopeSession(bool instance_globals)
+    : instance_globals_(instance_globals), thread_([this]() { ThreadMain(); }) {}
+
+KaleidoscopeSession::~KaleidoscopeSession() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+template <typename T>
+T KaleidoscopeSession::Run(std::function<T()> task) {
+    std::packaged_task<T()> packaged_task(std::move(task));
+    std::future<T> result = packaged_task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back([&packaged_task]() { packaged_task(); });
+    }
+    cv_.notify_one();
+    return result.get();
+}
+
+void KaleidoscopeSession::ThreadMain() {
+    std::call_once(init_native_target_flag, []() {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+    });
+
+    g_enable_ir_print = false;
+    g_enable_result_print = false;
+    g_enable_instance_globals = instance_globals_;
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    ReCreateModule();
+
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                break;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        // the code a request runs may write the globals, which the threads running code found through
+        // `LookupFunction` copy on first use
+        std::unique_lock<std::mutex> values_lock;
+        if (instance_globals_) {
+            values_lock = std::unique_lock<std::mutex>(DefiningGlobalsInstance()->values_mutex());
+        }
+        task();
+    }
+
+    // IR refers to the LLVM context of this thread, release it while the context is alive
+    g_fpm.reset();
+    g_module.reset();
+    g_jit.reset();
+}
+
+bool KaleidoscopeSession::LoadSnapshot(const std::string& path, std::string& error) {
+    return Run<bool>([&path, &error]() {
+        return ::LoadSnapshot(path, error);
+    });
+}
+
+void KaleidoscopeSession::SetExpressionCache(size_t capacity, bool lift_literals) {
+    Run<void>([capacity, lift_literals]() {
+        g_expr_cache_capacity = capacity;
+        g_expr_cache_lift_literals = lift_literals;
+    });
+}
+
+// compile the items at the lexer input up to its end, or up to the first which does not compile
+static bool CompileItems(std::vector<double>& results, std::string& error) {
+    GetNextToken();
+    while (true) {
+        ParsedItem item;
+        if (!ParseItem(item)) {
+            error = "code does not parse at offset " + std::to_string(g_token_offset);
+            return false;
+        }
+        switch (item.kind) {
+            case TOKEN_EOF: return true;
+            case TOKEN_DEF: {
+                if (!CompileDefinition(std::move(item.function), error)) {
+                    return false;
+                }
+                break;
+            }
+            case TOKEN_EXTERN: CompileExtern(std::move(item.prototype)); break;
+            default: {
+                double result;
+                if (!RunTopLevel(std::move(item.expression), result, error)) {
+                    return false;
+                }
+                results.push_back(result);
+                break;
+            }
+        }
+    }
+}
+
+bool KaleidoscopeSession::Compile(const std::string& code, std::vector<double>& results, std::string& error) {
+    return Run<bool>([&code, &results, &error]() {
+        SetLexerInput(code);
+        bool compiled;
+        try {
+            compiled = CompileItems(results, error);
+        } catch (...) {
+            // the caller gets the exception, the next request starts from a clean module
+            ResetLexerInput();
+            ReCreateModule();
+            throw;
+        }
+        ResetLexerInput();
+        return compiled;
+    });
+}
+
+FunctionHandle KaleidoscopeSession::LookupFunction(const std::string& name) {
+    return Run<FunctionHandle>([&name]() {
+        FunctionHandle handle;
+        handle.address_ = LookupFunctionAddress(name);
+        if (handle.address_ != nullptr) {
+            handle.pin_ = std::make_shared<llvm::orc::KaleidoscopeJIT::CodePin>(g_jit->pinCode());
+        }
+        return handle;
+    });
+}
+
+bool KaleidoscopeSession::Call(const std::string& name, const std::vector<double>& args, double& result) {
+    return Run<bool>([&name, &args, &result]() {
+        auto proto = name2proto_ast.find(name);
+        if (proto == name2proto_ast.end() || proto->second->args().size() != args.size() ||
+            args.size() > max_call_args) {
+            return false;
+        }
+        void* address = LookupFunctionAddress(name);
+        if (address == nullptr) {
+            return false;
+        }
+        result = CallAddress(address, args);
+        return true;
+    });
+}
+
+bool KaleidoscopeSession::CallBatch(const std::string& name, const std::vector<const double*>& columns, double* out,
+                                    size_t n) {
+    return Run<bool>([&name, &columns, out, n]() {
+        auto func_ast = name2func_ast.find(name);
+        if (func_ast == name2func_ast.end() || func_ast->second->proto().args().size() != columns.size()) {
+            return false;
+        }
+        BatchFunction batch = GetBatchFunction(name);
+        if (batch == nullptr) {
+            return false;
+        }
+        batch(columns.data(), out, n);
+        return true;
+    });
+}
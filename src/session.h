@@ -0,0 +1,92 @@
+#ifndef _H_SESSION
+#define _H_SESSION
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Class Declare
+ */
+// A compiled function found by `KaleidoscopeSession::LookupFunction`, the address of its stub, which calls the latest
+// definition. The code reachable through it stays in memory while the handle (or a copy) lives, even if the session
+// redefines the function meanwhile, and so does every definition the session replaces meanwhile: drop it once done.
+// It must not outlive the session.
+class FunctionHandle {
+public:
+    void* address() const { return address_; }
+
+    explicit operator bool() const { return address_ != nullptr; }
+
+private:
+    friend class KaleidoscopeSession;
+
+    void* address_ = nullptr;
+    // the JIT's pin on the code
+    std::shared_ptr<void> pin_;
+};
+
+// An independent compiler: JIT, LLVM context, modules, symbol tables and operator precedences.
+// The compiler state is the thread local globals the console uses (g_jit, g_module, name2func_ast, ...), rather than
+// a context object passed around, so that the compiler code stays the same for both: the session does all of its
+// work on a thread of its own, and one session costs one thread.
+// Every method may be called from any thread, the requests to one session are served in order.
+class KaleidoscopeSession {
+public:
+    // `instance_globals`: compile globals per thread (see instance.h), so code found through `LookupFunction`
+    // can run on many threads with isolated globals, `Call` and `CallBatch` share the session thread's
+    explicit KaleidoscopeSession(bool instance_globals = false);
+
+    ~KaleidoscopeSession();
+
+    KaleidoscopeSession(const KaleidoscopeSession&) = delete;
+
+    KaleidoscopeSession& operator=(const KaleidoscopeSession&) = delete;
+
+    // start from a snapshot saved by `SaveSnapshot` (see snapshot.h), before compiling anything
+    // return false and set `error` if it cannot be loaded, e.g. it was saved for another CPU
+    bool LoadSnapshot(const std::string& path, std::string& error);
+
+    // keep the code of up to `capacity` top level expressions for `Compile` to run again, 0 (the default) keeps none
+    // `lift_literals`: expressions differing in their literals only share code, see expr_cache.h
+    void SetExpressionCache(size_t capacity, bool lift_literals);
+
+    // compile definitions and externs, and evaluate top level expressions, appending the values of the latter to
+    // `results`; return false and set `error` at the first item which does not parse, or calls or reads something
+    // which is not defined, the items before it are compiled
+    bool Compile(const std::string& code, std::vector<double>& results, std::string& error);
+
+    // a compiled function, an empty handle if it is not defined
+    FunctionHandle LookupFunction(const std::string& name);
+
+    // call a function on the session thread, return false if it is not defined or `args` does not match
+    bool Call(const std::string& name, const std::vector<double>& args, double& result);
+
+    // out[i] = name(columns[0][i], columns[1][i], ...) for every i < n, through the function's batch entry point
+    // return false if it is not defined or there is not one column per parameter
+    bool CallBatch(const std::string& name, const std::vector<const double*>& columns, double* out, size_t n);
+
+    // functions with more arguments cannot be called through `Call`
+    static const size_t max_call_args = 6;
+
+private:
+    // run `task` on the session thread and wait for its result
+    template <typename T>
+    T Run(std::function<T()> task);
+
+    void ThreadMain();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool instance_globals_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif // _H_SESSION
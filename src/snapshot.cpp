@@ -0,0 +1,357 @@
+#include "snapshot.h"
+#include "codegen.h"
+#include "expr_cache.h"
+#include "instance.h"
+#include "parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+static const char snapshot_magic[8] = { 'K', 'S', 'C', 'S', 'N', 'A', 'P', '2' };
+
+// objects are 16 byte aligned in the file, so they can be linked in place from the mapping
+static const size_t object_alignment = 16;
+
+// the mapped snapshots, which the JITs link in place, live until the process exits
+static std::mutex mapped_snapshots_mutex;
+static std::vector<std::unique_ptr<llvm::MemoryBuffer>> mapped_snapshots;
+
+// what the objects were compiled for, a snapshot is only loaded where all of it matches
+struct SnapshotTarget {
+    std::string llvm_version;
+    std::string triple;
+    std::string cpu;
+    std::string features;
+    std::string host_cpu;
+    bool instance_globals;
+};
+
+static SnapshotTarget CurrentTarget() {
+    llvm::TargetMachine& target_machine = g_jit->getTargetMachine();
+    return {
+        LLVM_VERSION_STRING,
+        target_machine.getTargetTriple().str(),
+        target_machine.getTargetCPU().str(),
+        target_machine.getTargetFeatureString().str(),
+        llvm::sys::getHostCPUName().str(),
+        g_enable_instance_globals
+    };
+}
+
+// native endian fields, appended to a buffer
+class SnapshotWriter {
+public:
+    template <typename T>
+    void Write(T value) { data_.append((const char*) &value, sizeof(value)); }
+
+    void WriteString(const std::string& value) {
+        Write<uint64_t>(value.size());
+        data_.append(value);
+    }
+
+    void WriteBytes(llvm::StringRef bytes) { data_.append(bytes.data(), bytes.size()); }
+
+    void Align(size_t alignment) { data_.resize((data_.size() + alignment - 1) / alignment * alignment, '\0'); }
+
+    const std::string& data() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+// the fields of a SnapshotWriter, every read fails once the data is exhausted
+class SnapshotReader {
+public:
+    explicit SnapshotReader(llvm::StringRef data) : data_(data) {}
+
+    template <typename T>
+    bool Read(T& value) {
+        if (data_.size() - pos_ < sizeof(value)) {
+            return false;
+        }
+        memcpy(&value, data_.data() + pos_, sizeof(value));
+        pos_ += sizeof(value);
+        return true;
+    }
+
+    bool ReadString(std::string& value) {
+        uint64_t size;
+        if (!Read(size) || data_.size() - pos_ < size) {
+            return false;
+        }
+        value.assign(data_.data() + pos_, size);
+        pos_ += size;
+        return true;
+    }
+
+    bool ReadBytes(uint64_t size, llvm::StringRef& bytes) {
+        if (data_.size() - pos_ < size) {
+            return false;
+        }
+        bytes = data_.substr(pos_, size);
+        pos_ += size;
+        return true;
+    }
+
+    bool Align(size_t alignment) {
+        pos_ = (pos_ + alignment - 1) / alignment * alignment;
+        return pos_ <= data_.size();
+    }
+
+private:
+    llvm::StringRef data_;
+    size_t pos_ = 0;
+};
+
+static void WriteTarget(SnapshotWriter& writer, const SnapshotTarget& target) {
+    writer.WriteString(target.llvm_version);
+    writer.WriteString(target.triple);
+    writer.WriteString(target.cpu);
+    writer.WriteString(target.features);
+    writer.WriteString(target.host_cpu);
+    writer.Write<uint8_t>(target.instance_globals);
+}
+
+// check the target of a snapshot against the running one, set `error` to the first difference
+static bool CheckTarget(SnapshotReader& reader, std::string& error) {
+    SnapshotTarget current = CurrentTarget();
+    const std::pair<const char*, const std::string*> fields[] = {
+        { "LLVM version", &current.llvm_version },
+        { "target triple", &current.triple },
+        { "target CPU", &current.cpu },
+        { "target features", &current.features },
+        { "host CPU", &current.host_cpu }
+    };
+    for (auto& field : fields) {
+        std::string saved;
+        if (!reader.ReadString(saved)) {
+            error = "truncated snapshot";
+            return false;
+        }
+        if (saved != *field.second) {
+            error = std::string("saved for ") + field.first + " '" + saved + "', running '" + *field.second + "'";
+            return false;
+        }
+    }
+    uint8_t instance_globals;
+    if (!reader.Read(instance_globals)) {
+        error = "truncated snapshot";
+        return false;
+    }
+    if ((bool) instance_globals != current.instance_globals) {
+        error = instance_globals ? "saved with instance globals" : "saved without instance globals";
+        return false;
+    }
+    return true;
+}
+
+bool SaveSnapshot(const std::string& path, std::string& error) {
+    auto jit_lock = g_jit->acquireLock();
+    if (g_jit->isTieringEnabled()) {
+        error = "tiered code cannot be saved";
+        return false;
+    }
+    // cached top level expressions read their literals from this process, they are compiled again after a load
+    ClearExpressionCache();
+    auto objects = g_jit->getObjects();
+    if (!objects) {
+        error = llvm::toString(objects.takeError());
+        return false;
+    }
+
+    SnapshotWriter writer;
+    writer.WriteBytes(llvm::StringRef(snapshot_magic, sizeof(snapshot_magic)));
+    WriteTarget(writer, CurrentTarget());
+
+    writer.Write<uint64_t>(name2proto_ast.size());
+    for (auto& entry : name2proto_ast) {
+        const PrototypeAST& proto = *entry.second;
+        writer.WriteString(proto.name());
+        writer.Write<uint64_t>(proto.args().size());
+        for (auto& arg : proto.args()) {
+            writer.WriteString(arg);
+        }
+        writer.Write<uint8_t>(proto.IsUnaryOp() || proto.IsBinaryOp());
+        writer.Write<int32_t>(proto.op_precedence());
+    }
+
+    writer.Write<uint64_t>(g_binop_precedence.size());
+    for (auto& entry : g_binop_precedence) {
+        writer.WriteString(entry.first);
+        writer.Write<int32_t>(entry.second);
+    }
+
+    writer.Write<uint64_t>(g_global_named_vars.size());
+    for (auto& entry : g_global_named_vars) {
+        double* address = GetGlobalAddress(entry.first);
+        if (address == nullptr) {
+            error = "global " + entry.first + " is not defined";
+            return false;
+        }
+        writer.WriteString(entry.first);
+        writer.Write<uint64_t>(g_enable_instance_globals ? g_global_slots.at(entry.first) : 0);
+        writer.Write<double>(*address);
+        writer.Write<uint8_t>(g_const_values.count(entry.first) > 0);
+    }
+
+    std::vector<std::string> functions = g_jit->getStubbedFunctions();
+    writer.Write<uint64_t>(functions.size());
+    for (auto& name : functions) {
+        writer.WriteString(name);
+    }
+
+    writer.Write<uint64_t>(objects->size());
+    for (auto& object : *objects) {
+        writer.Write<uint64_t>(object.getBufferSize());
+    }
+    for (auto& object : *objects) {
+        writer.Align(object_alignment);
+        writer.WriteBytes(object.getBuffer());
+    }
+
+    // replace the file at once, a process loading it never sees half of it
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        file.write(writer.data().data(), writer.data().size());
+        if (!file) {
+            error = tmp_path + ": cannot write";
+            return false;
+        }
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        error = path + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool LoadSnapshot(const std::string& path, std::string& error) {
+    auto jit_lock = g_jit->acquireLock();
+    if (!name2proto_ast.empty() || !g_global_named_vars.empty()) {
+        error = "a snapshot is loaded before anything is compiled";
+        return false;
+    }
+
+    // mapped rather than read, and never null terminated, so the objects are linked from the page cache
+    auto buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (!buffer) {
+        error = path + ": " + buffer.getError().message();
+        return false;
+    }
+    SnapshotReader reader((*buffer)->getBuffer());
+
+    llvm::StringRef magic;
+    if (!reader.ReadBytes(sizeof(snapshot_magic), magic) ||
+        magic != llvm::StringRef(snapshot_magic, sizeof(snapshot_magic))) {
+        error = path + ": not a snapshot";
+        return false;
+    }
+    if (!CheckTarget(reader, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+
+    // read everything before changing the compiler state, so a truncated file changes nothing
+    std::vector<std::shared_ptr<PrototypeAST>> protos;
+    std::unordered_map<std::string, int> binop_precedence;
+    std::vector<std::tuple<std::string, uint64_t, double, bool>> globals;
+    std::vector<std::string> functions;
+    std::vector<llvm::MemoryBufferRef> objects;
+    bool complete = true;
+
+    uint64_t count = 0;
+    complete = complete && reader.Read(count);
+    for (uint64_t i = 0; complete && i < count; ++i) {
+        std::string name;
+        uint64_t arg_count = 0;
+        complete = reader.ReadString(name) && reader.Read(arg_count);
+        std::vector<std::string> args;
+        for (uint64_t j = 0; complete && j < arg_count; ++j) {
+            args.emplace_back();
+            complete = reader.ReadString(args.back());
+        }
+        uint8_t is_operator = 0;
+        int32_t precedence = 0;
+        complete = complete && reader.Read(is_operator) && reader.Read(precedence);
+        protos.push_back(std::make_shared<PrototypeAST>(name, std::move(args), is_operator, precedence));
+    }
+
+    complete = complete && reader.Read(count);
+    for (uint64_t i = 0; complete && i < count; ++i) {
+        std::string op;
+        int32_t precedence = 0;
+        complete = reader.ReadString(op) && reader.Read(precedence);
+        binop_precedence[op] = precedence;
+    }
+
+    complete = complete && reader.Read(count);
+    for (uint64_t i = 0; complete && i < count; ++i) {
+        std::string name;
+        uint64_t slot = 0;
+        double value = 0;
+        uint8_t is_const = 0;
+        complete = reader.ReadString(name) && reader.Read(slot) && reader.Read(value) && reader.Read(is_const);
+        complete = complete && slot < GlobalsInstance::max_slots;
+        globals.emplace_back(name, slot, value, is_const);
+    }
+
+    complete = complete && reader.Read(count);
+    for (uint64_t i = 0; complete && i < count; ++i) {
+        functions.emplace_back();
+        complete = reader.ReadString(functions.back());
+    }
+
+    complete = complete && reader.Read(count);
+    std::vector<uint64_t> object_sizes;
+    for (uint64_t i = 0; complete && i < count; ++i) {
+        object_sizes.emplace_back();
+        complete = reader.Read(object_sizes.back());
+    }
+    for (uint64_t size : object_sizes) {
+        llvm::StringRef object;
+        complete = complete && reader.Align(object_alignment) && reader.ReadBytes(size, object);
+        objects.emplace_back(object, path);
+    }
+
+    if (!complete) {
+        error = path + ": truncated snapshot";
+        return false;
+    }
+
+    for (auto& proto : protos) {
+        name2proto_ast[proto->name()] = proto;
+    }
+    g_binop_precedence = std::move(binop_precedence);
+
+    g_jit->addSavedObjects(objects, functions);
+    {
+        std::lock_guard<std::mutex> lock(mapped_snapshots_mutex);
+        mapped_snapshots.push_back(std::move(*buffer));
+    }
+
+    // globals keep their values, code compiled from now on refers to them by name or slot, or folds the consts
+    for (auto& global : globals) {
+        const std::string& name = std::get<0>(global);
+        if (g_enable_instance_globals) {
+            g_global_slots[name] = std::get<1>(global);
+            DefiningGlobalsInstance()->UseSlots(std::get<1>(global) + 1);
+        }
+        g_global_named_vars[name] = nullptr;
+        if (double* address = GetGlobalAddress(name)) {
+            *address = std::get<2>(global);
+        }
+        if (std::get<3>(global)) {
+            g_const_values[name] = std::get<2>(global);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef _H_SNAPSHOT
+#define _H_SNAPSHOT
+
+#include <string>
+
+/**
+ * Function Declare
+ */
+// A snapshot is the state of the calling thread's compiler in one file: prototypes, operator precedences, the
+// values of the globals, and the object code of every live module. Loading it maps the file and links the objects
+// lazily, so a session starts with its definitions in the time it takes to read the prototypes.
+// It is only valid for the LLVM version, target and host CPU it was saved for, which loading checks.
+
+// write the snapshot of the calling thread's compiler to `path`, return false and set `error` if it cannot be saved
+// the JIT must keep the objects of its modules, call `g_jit->keepObjects()` before compiling anything
+// tiered code (which embeds the addresses of its counters) and batch entry points (compiled for the host CPU) are
+// not saved, the latter are generated again on use
+bool SaveSnapshot(const std::string& path, std::string& error);
+
+// load a snapshot into the calling thread's compiler, which must not have compiled anything yet
+// the functions it restores can be called and redefined, but they have no AST: calls to them are not specialized,
+// they have no batch entry point, one named after a builtin does not replace it, and they are not recompiled when
+// a const they folded is written
+bool LoadSnapshot(const std::string& path, std::string& error);
+
+#endif // _H_SNAPSHOT
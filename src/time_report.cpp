@@ -0,0 +1,303 @@
+#include "time_report.h"
+#include "perf_counters.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// record phase timings, nothing is measured unless this is set
+thread_local bool g_enable_time_report = false;
+
+// an open timer, `phase` is PHASE_COUNT for the item itself
+struct TimerFrame {
+    TimePhase phase;
+    std::string name;
+    Clock::time_point start;
+    int64_t child_nanos;
+    PerfCounterValues start_counters;
+    PerfCounterValues child_counters;
+};
+
+// one complete ("ph": "X") event of the trace
+struct TraceEvent {
+    std::string name;
+    const char* category;
+    int64_t start_nanos;
+    int64_t duration_nanos;
+    std::string args;
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+    "lexing", "parsing", "codegen", "optimize", "add-module", "lookup", "execute"
+};
+
+static const Clock::time_point trace_origin = Clock::now();
+
+// open timers, the current item at the bottom
+static thread_local std::vector<TimerFrame> timer_stack;
+
+static thread_local std::vector<TraceEvent> trace_events;
+
+// exclusive time of each phase within the current item, and whether the item went through it
+static thread_local int64_t item_phase_nanos[PHASE_COUNT];
+static thread_local bool item_phase_seen[PHASE_COUNT];
+static thread_local std::string item_kind;
+
+// one sample per item which went through the phase
+static thread_local std::vector<int64_t> phase_samples[PHASE_COUNT];
+static thread_local std::vector<int64_t> other_samples;
+static thread_local std::vector<int64_t> item_samples;
+
+// perf counters of every phase, nested phases excluded, and of the items outside any phase (at PHASE_COUNT)
+static thread_local PerfCounterValues phase_counters[PHASE_COUNT + 1];
+
+// codegen + optimize time of every generated function body
+static thread_local std::vector<std::pair<std::string, int64_t>> function_samples;
+
+static int64_t NanosSinceOrigin(Clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time - trace_origin).count();
+}
+
+// pop the innermost timer, return its inclusive and exclusive duration
+// its exclusive counts go to the phase, or to PHASE_COUNT for an item
+static std::pair<int64_t, int64_t> PopTimer(TimerFrame& frame) {
+    int64_t total = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frame.start).count();
+    int64_t exclusive = total - frame.child_nanos;
+    PerfCounterValues total_counters = ReadPerfCounters() - frame.start_counters;
+    phase_counters[frame.phase] += total_counters - frame.child_counters;
+    timer_stack.pop_back();
+    if (!timer_stack.empty()) {
+        timer_stack.back().child_nanos += total;
+        timer_stack.back().child_counters += total_counters;
+    }
+    return { total, exclusive };
+}
+
+PhaseTimer::PhaseTimer(TimePhase phase, const std::string& name) {
+    // outside a top level item nothing is recorded
+    active_ = g_enable_time_report && !timer_stack.empty();
+    if (active_) {
+        timer_stack.push_back({ phase, name, Clock::now(), 0, ReadPerfCounters(), {} });
+    }
+}
+
+PhaseTimer::~PhaseTimer() {
+    if (!active_) {
+        return;
+    }
+
+    TimerFrame frame = timer_stack.back();
+    auto durations = PopTimer(frame);
+    item_phase_nanos[frame.phase] += durations.second;
+    item_phase_seen[frame.phase] = true;
+
+    // there is one lexing timer per token, they are only summed up per item
+    if (frame.phase == PHASE_LEXING) {
+        return;
+    }
+
+    std::string event_name = phase_names[frame.phase];
+    if (!frame.name.empty()) {
+        event_name += " " + frame.name;
+    }
+    trace_events.push_back({ event_name, "phase", NanosSinceOrigin(frame.start), durations.first, "" });
+
+    // a named codegen timer covers one function body, optimization included
+    if (frame.phase == PHASE_CODEGEN && !frame.name.empty()) {
+        function_samples.push_back({ frame.name, durations.first });
+    }
+}
+
+ItemTimer::ItemTimer(const char* kind) {
+    active_ = g_enable_time_report;
+    if (!active_) {
+        return;
+    }
+
+    std::fill(item_phase_nanos, item_phase_nanos + PHASE_COUNT, 0);
+    std::fill(item_phase_seen, item_phase_seen + PHASE_COUNT, false);
+    item_kind = kind;
+    timer_stack.push_back({ PHASE_COUNT, kind, Clock::now(), 0, ReadPerfCounters(), {} });
+}
+
+void ItemTimer::SetName(const std::string& name) {
+    if (active_) {
+        timer_stack.front().name = item_kind + " " + name;
+    }
+}
+
+static std::string EscapeJson(const std::string& str) {
+    std::string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+ItemTimer::~ItemTimer() {
+    if (!active_) {
+        return;
+    }
+
+    TimerFrame frame = timer_stack.back();
+    auto durations = PopTimer(frame);
+
+    // the item event carries the exclusive time of every phase, lexing included
+    std::string args;
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        if (!item_phase_seen[phase]) {
+            continue;
+        }
+        phase_samples[phase].push_back(item_phase_nanos[phase]);
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s\"%s_ms\":%.6f", args.empty() ? "" : ",",
+                 phase_names[phase], item_phase_nanos[phase] / 1e6);
+        args += buf;
+    }
+    other_samples.push_back(durations.second);
+    item_samples.push_back(durations.first);
+
+    trace_events.push_back({ frame.name, "item", NanosSinceOrigin(frame.start), durations.first, args });
+}
+
+static int64_t Percentile(const std::vector<int64_t>& sorted, double p) {
+    size_t index = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void PrintSummaryRow(const char* name, std::vector<int64_t> samples) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    int64_t total = 0;
+    for (int64_t sample : samples) {
+        total += sample;
+    }
+    fprintf(stderr, "%-12s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, samples.size(),
+            total / 1e6, total / 1e6 / samples.size(), Percentile(samples, 0.5) / 1e6,
+            Percentile(samples, 0.9) / 1e6, Percentile(samples, 0.99) / 1e6, samples.back() / 1e6);
+}
+
+// one row per power of two microseconds
+static void PrintHistogram(const char* name, const std::vector<int64_t>& samples) {
+    if (samples.empty()) {
+        return;
+    }
+    std::vector<size_t> buckets;
+    for (int64_t sample : samples) {
+        size_t bucket = 0;
+        while ((int64_t) 1000 << bucket <= sample) {
+            ++bucket;
+        }
+        if (buckets.size() <= bucket) {
+            buckets.resize(bucket + 1, 0);
+        }
+        ++buckets[bucket];
+    }
+    size_t max_count = *std::max_element(buckets.begin(), buckets.end());
+
+    fprintf(stderr, "%s:\n", name);
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        if (buckets[bucket] == 0) {
+            continue;
+        }
+        size_t bar = (buckets[bucket] * 40 + max_count - 1) / max_count;
+        fprintf(stderr, "  < %8lld us  %-40s %zu\n", 1LL << bucket, std::string(bar, '#').c_str(), buckets[bucket]);
+    }
+}
+
+void PrintTimeReport() {
+    fprintf(stderr, "===-------------------------- time report (ms) --------------------------===\n");
+    fprintf(stderr, "%-12s %8s %10s %10s %10s %10s %10s %10s\n",
+            "phase", "items", "total", "mean", "p50", "p90", "p99", "max");
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        PrintSummaryRow(phase_names[phase], phase_samples[phase]);
+    }
+    PrintSummaryRow("other", other_samples);
+    PrintSummaryRow("item", item_samples);
+
+    fprintf(stderr, "\n");
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        PrintHistogram(phase_names[phase], phase_samples[phase]);
+    }
+    PrintHistogram("item", item_samples);
+
+    // counts of the open perf counters, per phase
+    bool any_counter = false;
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        any_counter = any_counter || IsPerfCounterOpen((PerfCounter) counter);
+    }
+    if (any_counter) {
+        fprintf(stderr, "\n%-12s", "counters");
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (IsPerfCounterOpen((PerfCounter) counter)) {
+                fprintf(stderr, " %14s", perf_counter_names[counter]);
+            }
+        }
+        fprintf(stderr, "\n");
+        for (int phase = 0; phase <= PHASE_COUNT; ++phase) {
+            fprintf(stderr, "%-12s", phase < PHASE_COUNT ? phase_names[phase] : "other");
+            for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+                if (IsPerfCounterOpen((PerfCounter) counter)) {
+                    fprintf(stderr, " %14llu", (unsigned long long) phase_counters[phase].values[counter]);
+                }
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    // the slowest function bodies, specializations included
+    if (!function_samples.empty()) {
+        auto functions = function_samples;
+        std::stable_sort(functions.begin(), functions.end(), [](auto& lhs, auto& rhs) {
+            return lhs.second > rhs.second;
+        });
+        functions.resize(std::min<size_t>(functions.size(), 10));
+        fprintf(stderr, "\nslowest functions (codegen + optimize, ms):\n");
+        for (auto& function : functions) {
+            fprintf(stderr, "  %10.3f  %s\n", function.second / 1e6, function.first.c_str());
+        }
+    }
+}
+
+const char* GetPhaseName(TimePhase phase) {
+    return phase < PHASE_COUNT ? phase_names[phase] : "other";
+}
+
+PerfCounterValues GetPhaseCounters(TimePhase phase) {
+    return phase_counters[phase];
+}
+
+bool WriteTimeTrace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "cannot open " << path << std::endl;
+        return false;
+    }
+
+    // everything runs on the main thread, so events nest by time
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < trace_events.size(); ++i) {
+        const TraceEvent& event = trace_events[i];
+        char times[96];
+        snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start_nanos / 1e3, event.duration_nanos / 1e3);
+        out << (i == 0 ? "\n" : ",\n")
+            << "{\"name\":\"" << EscapeJson(event.name) << "\",\"cat\":\"" << event.category
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1," << times << ",\"args\":{" << event.args << "}}";
+    }
+    out << "\n]}\n";
+    return (bool) out;
+}
@@ -0,0 +1,81 @@
+#ifndef _H_TIME_REPORT
+#define _H_TIME_REPORT
+
+#include "perf_counters.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Enum Declare
+ */
+// compile / run phases of one top level item
+// the compile layer emits object code in PHASE_ADD_MODULE, linking happens lazily in PHASE_LOOKUP
+enum TimePhase {
+    PHASE_LEXING = 0,
+    PHASE_PARSING = 1,
+    PHASE_CODEGEN = 2,
+    PHASE_OPTIMIZE = 3,
+    PHASE_ADD_MODULE = 4,
+    PHASE_LOOKUP = 5,
+    PHASE_EXECUTE = 6,
+    PHASE_COUNT = 7
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// record phase timings, nothing is measured unless this is set
+extern thread_local bool g_enable_time_report;
+
+
+/**
+ * Class Declare
+ */
+// measure one phase for the lifetime of the object
+// the time of nested timers is excluded, e.g. lexing is not counted as parsing
+class PhaseTimer {
+public:
+    // `name` labels the trace event, e.g. the function being generated
+    PhaseTimer(TimePhase phase, const std::string& name = std::string());
+
+    ~PhaseTimer();
+
+private:
+    bool active_;
+};
+
+// measure one top level item (definition, extern or expression)
+class ItemTimer {
+public:
+    ItemTimer(const char* kind);
+
+    ~ItemTimer();
+
+    // the name is only known once the item is parsed
+    void SetName(const std::string& name);
+
+private:
+    bool active_;
+};
+
+
+/**
+ * Function Declare
+ */
+// print count / total / percentiles and a log2 histogram of every phase to stderr, and the counts of the open
+// perf counters
+void PrintTimeReport();
+
+// e.g. "codegen", "other" for PHASE_COUNT
+const char* GetPhaseName(TimePhase phase);
+
+// totals of the calling thread's perf counters (see perf_counters.h) in a phase, nested phases excluded as for
+// the timings, or in the items outside any phase for PHASE_COUNT; counted while the counters are open
+PerfCounterValues GetPhaseCounters(TimePhase phase);
+
+// write all items and phases as a Chrome trace_event JSON file, which can be opened in Perfetto
+bool WriteTimeTrace(const std::string& path);
+
+#endif // _H_TIME_REPORT
@@ -0,0 +1,515 @@
+#include "type_infer.h"
+#include "codegen.h"
+#include "expr_cache.h"
+#include "parser.h"
+#include <algorithm>
+#include <cmath>
+
+// function definitions kept alive so that they can be specialized later
+thread_local std::unordered_map<std::string, std::shared_ptr<FunctionAST>> name2func_ast;
+
+// specialization key (e.g. "fibonacci.i") to its inferred signature, ordered so that the keys of a function are
+// adjacent
+thread_local std::map<std::string, Specialization> g_specializations;
+
+// function name to the defined functions whose body calls it
+thread_local std::unordered_map<std::string, std::set<std::string>> g_function_callers;
+
+// keys of the specializations whose body is being inferred, innermost at the back
+static thread_local std::vector<std::string> inferring_keys;
+
+// doubles are exact integers up to 2^53, so only values within it are integers
+static const int64_t max_exact_integer = int64_t(1) << 53;
+
+static const IntRange exact_range = { -max_exact_integer, max_exact_integer };
+
+static const IntRange bool_range = { 0, 1 };
+
+// rounds of inference after which a range still growing is taken as unbounded, a double
+static const int max_range_rounds = 8;
+
+ValueType TypeInfo::TypeOf(const ExprAST* expr) const {
+    auto it = expr_types.find(expr);
+    return it == expr_types.end() ? TYPE_UNKNOWN : it->second;
+}
+
+ValueType TypeInfo::VarType(const std::string& name) const {
+    if (global_names.count(name)) {
+        return TYPE_DOUBLE;
+    }
+    auto it = var_types.find(name);
+    return it == var_types.end() ? TYPE_UNKNOWN : it->second;
+}
+
+IntRange TypeInfo::RangeOf(const ExprAST* expr) const {
+    if (TypeOf(expr) == TYPE_BOOL) {
+        return bool_range;
+    }
+    auto it = expr_ranges.find(expr);
+    return it == expr_ranges.end() ? exact_range : it->second;
+}
+
+IntRange TypeInfo::VarRange(const std::string& name) const {
+    if (VarType(name) == TYPE_BOOL) {
+        return bool_range;
+    }
+    auto it = var_ranges.find(name);
+    return it == var_ranges.end() ? exact_range : it->second;
+}
+
+ValueType JoinType(ValueType lhs, ValueType rhs) {
+    return std::max(lhs, rhs);
+}
+
+static IntRange JoinRange(IntRange lhs, IntRange rhs) {
+    return { std::min(lhs.lo, rhs.lo), std::max(lhs.hi, rhs.hi) };
+}
+
+// record the type of `expr`, and the range of an integer
+static ValueType SetType(TypeInfo& info, const ExprAST* expr, ValueType type, IntRange range) {
+    if (type == TYPE_INT) {
+        info.expr_ranges[expr] = range;
+    }
+    return info.expr_types[expr] = type;
+}
+
+// widen local variable `name` to hold a value of `type` and `range`
+static void JoinVar(TypeInfo& info, const std::string& name, ValueType type, IntRange range) {
+    ValueType& var_type = info.var_types[name];
+    ValueType old_type = var_type;
+    var_type = JoinType(old_type, type);
+    if (var_type == TYPE_INT || var_type == TYPE_BOOL) {
+        IntRange& var_range = info.var_ranges[name];
+        var_range = old_type == TYPE_UNKNOWN ? range : JoinRange(var_range, range);
+    }
+}
+
+ValueType ArithType(char op, ValueType lhs, IntRange lhs_range, ValueType rhs, IntRange rhs_range, IntRange& range) {
+    if (lhs == TYPE_UNKNOWN || rhs == TYPE_UNKNOWN) {
+        return TYPE_UNKNOWN;
+    }
+    if (lhs == TYPE_DOUBLE || rhs == TYPE_DOUBLE) {
+        return TYPE_DOUBLE;
+    }
+
+    // bool operands are promoted to integer; the bounds are within 2^53, so sums never overflow 64 bits
+    int64_t bounds[4];
+    if (op == '+') {
+        bounds[0] = bounds[1] = lhs_range.lo + rhs_range.lo;
+        bounds[2] = bounds[3] = lhs_range.hi + rhs_range.hi;
+    } else if (op == '-') {
+        bounds[0] = bounds[1] = lhs_range.lo - rhs_range.hi;
+        bounds[2] = bounds[3] = lhs_range.hi - rhs_range.lo;
+    } else {
+        if (__builtin_mul_overflow(lhs_range.lo, rhs_range.lo, &bounds[0]) ||
+            __builtin_mul_overflow(lhs_range.lo, rhs_range.hi, &bounds[1]) ||
+            __builtin_mul_overflow(lhs_range.hi, rhs_range.lo, &bounds[2]) ||
+            __builtin_mul_overflow(lhs_range.hi, rhs_range.hi, &bounds[3])) {
+            return TYPE_DOUBLE;
+        }
+    }
+
+    range.lo = *std::min_element(bounds, bounds + 4);
+    range.hi = *std::max_element(bounds, bounds + 4);
+    return range.lo < exact_range.lo || range.hi > exact_range.hi ? TYPE_DOUBLE : TYPE_INT;
+}
+
+// the range of integer `var` of range `var_range`, where `var op other` holds for an `other` of range `other_range`
+static IntRange NarrowRange(const std::string& op, IntRange var_range, IntRange other_range) {
+    IntRange range = var_range;
+    if (op == "<") {
+        range.hi = std::min(range.hi, other_range.hi - 1);
+    } else if (op == "<=") {
+        range.hi = std::min(range.hi, other_range.hi);
+    } else if (op == ">") {
+        range.lo = std::max(range.lo, other_range.lo + 1);
+    } else if (op == ">=") {
+        range.lo = std::max(range.lo, other_range.lo);
+    } else if (op == "==") {
+        range.lo = std::max(range.lo, other_range.lo);
+        range.hi = std::min(range.hi, other_range.hi);
+    }
+    // the condition never holds, the range is left as is
+    return range.lo > range.hi ? var_range : range;
+}
+
+static const std::unordered_map<std::string, std::string> negated_comparisons = {
+    { "<", ">=" }, { "<=", ">" }, { ">", "<=" }, { ">=", "<" }, { "==", "!=" }, { "!=", "==" }
+};
+
+// if `cond` compares an integer local which is never assigned with `=` (an argument or a loop variable) with an
+// integer, return the name of the local, the comparison as `name op other` and the range of the other side
+static bool ComparedVariable(const ExprAST* cond, const TypeInfo& info, std::string& name, std::string& op,
+                             IntRange& other_range) {
+    static const std::unordered_map<std::string, std::string> swapped = {
+        { "<", ">" }, { "<=", ">=" }, { ">", "<" }, { ">=", "<=" }, { "==", "==" }, { "!=", "!=" }
+    };
+
+    auto binary = dynamic_cast<const BinaryExprAST*>(cond);
+    if (binary == nullptr || swapped.count(binary->op()) == 0) {
+        return false;
+    }
+    op = binary->op();
+    auto var = dynamic_cast<const VariableExprAST*>(binary->lhs());
+    const ExprAST* other = binary->rhs();
+    if (var == nullptr) {
+        var = dynamic_cast<const VariableExprAST*>(binary->rhs());
+        other = binary->lhs();
+        op = swapped.at(op);
+    }
+    if (var == nullptr || info.TypeOf(var) != TYPE_INT || info.assigned_locals.count(var->name()) ||
+        (info.TypeOf(other) != TYPE_INT && info.TypeOf(other) != TYPE_BOOL)) {
+        return false;
+    }
+
+    name = var->name();
+    other_range = info.RangeOf(other);
+    return true;
+}
+
+char TypeSuffix(ValueType type) {
+    switch (type) {
+        case TYPE_BOOL: return 'b';
+        case TYPE_INT: return 'i';
+        default: return 'd';
+    }
+}
+
+std::string SpecializationKey(const std::string& func_name, const std::vector<ValueType>& arg_types) {
+    std::string key = func_name + ".";
+    for (ValueType type : arg_types) {
+        key += TypeSuffix(type);
+    }
+    return key;
+}
+
+std::string SpecializationSymbol(const std::string& key) {
+    // the return type is part of the symbol, so that a caller never binds to a clone with another ABI
+    return key + "." + TypeSuffix(g_specializations.at(key).ret_type);
+}
+
+std::vector<std::string> SpecializationKeys(const std::string& func_name) {
+    // a key is the name then '.', which no name contains
+    std::vector<std::string> keys;
+    std::string prefix = func_name + ".";
+    for (auto spec = g_specializations.lower_bound(prefix);
+         spec != g_specializations.end() && spec->first.compare(0, prefix.size(), prefix) == 0; ++spec) {
+        keys.push_back(spec->first);
+    }
+    return keys;
+}
+
+// functions and user defined operators called by the body of `ast`
+static std::set<std::string> Callees(const FunctionAST& ast) {
+    ExprKey key;
+    ast.AppendKey(key);
+    return std::move(key.callees);
+}
+
+void RegisterFunctionAST(std::shared_ptr<FunctionAST> ast) {
+    const std::string& name = ast->proto().name();
+    auto previous = name2func_ast.find(name);
+    if (previous != name2func_ast.end()) {
+        for (auto& callee : Callees(*previous->second)) {
+            g_function_callers[callee].erase(name);
+        }
+    }
+    for (auto& callee : Callees(*ast)) {
+        g_function_callers[callee].insert(name);
+    }
+    name2func_ast[name] = std::move(ast);
+}
+
+ValueType InferFunctionType(FunctionAST& func, const std::vector<ValueType>& arg_types, TypeInfo& info) {
+    const std::vector<std::string>& args = func.proto().args();
+    for (size_t i = 0; i < args.size(); ++i) {
+        info.var_types[args[i]] = arg_types[i];
+        info.var_ranges[args[i]] = arg_types[i] == TYPE_BOOL ? bool_range : exact_range;
+    }
+    return func.InferType(info);
+}
+
+bool ResolveSpecialization(
+  const std::string& key, const std::string& func_name, const std::vector<ValueType>& arg_types) {
+    auto found = g_specializations.find(key);
+    if (found != g_specializations.end()) {
+        // self recursion reads the current approximation of the return type
+        return !found->second.in_progress || key == inferring_keys.back();
+    }
+
+    Specialization& spec = g_specializations[key];
+    spec.func_name = func_name;
+    spec.arg_types = arg_types;
+    spec.in_progress = true;
+    inferring_keys.push_back(key);
+
+    // widen the return type until the body agrees with it, a recursive result growing round after round is a double
+    FunctionAST& func = *name2func_ast.at(func_name);
+    for (int round = 1; ; ++round) {
+        TypeInfo info;
+        ValueType body_type = InferFunctionType(func, arg_types, info);
+        ValueType ret_type = JoinType(body_type, spec.ret_type);
+        IntRange ret_range = spec.ret_type == TYPE_UNKNOWN ? info.ret_range
+            : body_type == TYPE_UNKNOWN ? spec.ret_range : JoinRange(info.ret_range, spec.ret_range);
+        if (ret_type == TYPE_INT && round >= max_range_rounds && !(ret_range == spec.ret_range)) {
+            ret_type = TYPE_DOUBLE;
+        }
+        if (ret_type == spec.ret_type && (ret_type != TYPE_INT || ret_range == spec.ret_range)) {
+            spec.type_info = std::move(info);
+            break;
+        }
+        spec.ret_type = ret_type;
+        spec.ret_range = ret_range;
+    }
+
+    // only possible for a function which never returns, any type is fine then
+    if (spec.ret_type == TYPE_UNKNOWN) {
+        spec.ret_type = TYPE_DOUBLE;
+    }
+
+    spec.in_progress = false;
+    inferring_keys.pop_back();
+    return true;
+}
+
+// infer a call to `func_name`, a specialization is used if any argument is known to be non-double
+static ValueType InferCall(
+  TypeInfo& info, const ExprAST* node, const std::string& func_name, std::vector<ValueType> arg_types) {
+    info.callees.erase(node);
+
+    for (ValueType& type : arg_types) {
+        if (type == TYPE_UNKNOWN) {
+            type = TYPE_DOUBLE;
+        }
+    }
+
+    // externs and all-double calls go to the double ABI entry point
+    auto func = name2func_ast.find(func_name);
+    bool all_double = std::all_of(arg_types.begin(), arg_types.end(), [](ValueType type) {
+        return type == TYPE_DOUBLE;
+    });
+    if (func == name2func_ast.end() || all_double || func->second->proto().args().size() != arg_types.size()) {
+        return TYPE_DOUBLE;
+    }
+
+    std::string key = SpecializationKey(func_name, arg_types);
+    if (!ResolveSpecialization(key, func_name, arg_types)) {
+        return TYPE_DOUBLE;
+    }
+
+    info.callees[node] = key;
+    const Specialization& spec = g_specializations.at(key);
+    return SetType(info, node, spec.ret_type, spec.ret_range);
+}
+
+bool IsIntegralLiteral(double value) {
+    return value == std::trunc(value) && std::fabs(value) <= (double) max_exact_integer;
+}
+
+ValueType NumberExprAST::InferType(TypeInfo& info) {
+    if (!is_integer_ || !IsIntegralLiteral(val_)) {
+        return info.expr_types[this] = TYPE_DOUBLE;
+    }
+    // a lifted literal holds the value of another run next time, any value of the same key
+    bool is_lifted = g_lifting_key != nullptr && g_lifting_key->literal_slots.count(this) > 0;
+    return SetType(info, this, TYPE_INT, is_lifted ? exact_range : IntRange{ (int64_t) val_, (int64_t) val_ });
+}
+
+ValueType VariableExprAST::InferType(TypeInfo& info) {
+    if (is_global_scope_) {
+        info.global_names.insert(name_);
+    }
+    return SetType(info, this, info.VarType(name_), info.VarRange(name_));
+}
+
+ValueType UnaryExprAST::InferType(TypeInfo& info) {
+    ValueType operand = operand_->InferType(info);
+
+    if (op_ == "!") {
+        return info.expr_types[this] = TYPE_BOOL;
+    }
+
+    if (op_ == "-") {
+        IntRange range;
+        ValueType type = ArithType('-', TYPE_INT, IntRange(), operand, info.RangeOf(operand_.get()), range);
+        return SetType(info, this, type, range);
+    }
+
+    // user defined operator
+    return info.expr_types[this] = InferCall(info, this, std::string("unary") + op_, { operand });
+}
+
+ValueType BinaryExprAST::InferType(TypeInfo& info) {
+    // assignment widens the type of a local variable, globals always stay double
+    if (op_ == "=") {
+        VariableExprAST* leftVar = (VariableExprAST*) lhs_.get();
+        ValueType rhs = rhs_->InferType(info);
+        if (leftVar->isGlobalScope()) {
+            info.global_names.insert(leftVar->name());
+        }
+        if (!info.global_names.count(leftVar->name())) {
+            JoinVar(info, leftVar->name(), rhs, info.RangeOf(rhs_.get()));
+            info.assigned_locals.insert(leftVar->name());
+        } else {
+            info.assigned_globals.insert(leftVar->name());
+        }
+        lhs_->InferType(info);
+        return SetType(info, this, info.VarType(leftVar->name()), info.VarRange(leftVar->name()));
+    }
+
+    ValueType lhs = lhs_->InferType(info);
+    ValueType rhs = rhs_->InferType(info);
+
+    if (op_ == "&&" || op_ == "||" || op_ == "==" || op_ == "!=" ||
+        op_ == "<=" || op_ == ">=" || op_ == "<" || op_ == ">") {
+        return info.expr_types[this] = TYPE_BOOL;
+    }
+
+    if (op_ == "+" || op_ == "-" || op_ == "*") {
+        IntRange range;
+        ValueType type = ArithType(op_[0], lhs, info.RangeOf(lhs_.get()), rhs, info.RangeOf(rhs_.get()), range);
+        return SetType(info, this, type, range);
+    }
+
+    if (op_ == "/") {
+        return info.expr_types[this] = TYPE_DOUBLE;
+    }
+
+    // user defined operator
+    return info.expr_types[this] = InferCall(info, this, std::string("binary") + op_, { lhs, rhs });
+}
+
+ValueType CallExprAST::InferType(TypeInfo& info) {
+    std::vector<ValueType> arg_types;
+    for (std::unique_ptr<ExprAST>& arg_expr : args_) {
+        arg_types.push_back(arg_expr->InferType(info));
+    }
+    return info.expr_types[this] = InferCall(info, this, callee_, std::move(arg_types));
+}
+
+// infer a branch of an if, with the range of local `name` narrowed to `range` while in it
+static ValueType InferBranch(TypeInfo& info, const std::vector<std::unique_ptr<ExprAST>>& exprs,
+                             const std::string& name, IntRange range, IntRange& branch_range) {
+    IntRange var_range;
+    if (!name.empty()) {
+        var_range = info.VarRange(name);
+        info.var_ranges[name] = range;
+    }
+
+    // an empty branch evaluates to 0
+    ValueType type = exprs.empty() ? TYPE_INT : TYPE_UNKNOWN;
+    branch_range = IntRange();
+    for (auto& expr : exprs) {
+        type = expr->InferType(info);
+        branch_range = info.RangeOf(expr.get());
+    }
+
+    // a loop in the branch may have widened it
+    if (!name.empty()) {
+        info.var_ranges[name] = JoinRange(var_range, info.var_ranges[name]);
+    }
+    return type;
+}
+
+ValueType IfExprAST::InferType(TypeInfo& info) {
+    cond_->InferType(info);
+
+    // `if n < 2 then ... else n - 1`: n - 1 is at least 1
+    std::string name, op;
+    IntRange other, when_true, when_false;
+    if (ComparedVariable(cond_.get(), info, name, op, other)) {
+        when_true = NarrowRange(op, info.VarRange(name), other);
+        when_false = NarrowRange(negated_comparisons.at(op), info.VarRange(name), other);
+    }
+
+    IntRange then_range, else_range;
+    ValueType then_type = InferBranch(info, then_expr_, name, when_true, then_range);
+    ValueType else_type = InferBranch(info, else_expr_, name, when_false, else_range);
+
+    ValueType type = JoinType(then_type, else_type);
+    IntRange range = then_type == TYPE_UNKNOWN ? else_range
+        : else_type == TYPE_UNKNOWN ? then_range : JoinRange(then_range, else_range);
+    return SetType(info, this, type, range);
+}
+
+ValueType ForExprAST::InferType(TypeInfo& info) {
+    ValueType start = start_expr_->InferType(info);
+    if (!info.global_names.count(var_name_)) {
+        JoinVar(info, var_name_, start, info.RangeOf(start_expr_.get()));
+    }
+
+    end_expr_->InferType(info);
+    for (auto& expr : body_expr_) {
+        expr->InferType(info);
+    }
+
+    // var = var + step; stepping towards the bound of the end condition, the values it is incremented from range
+    // from the start to the bound
+    ValueType step = step_expr_->InferType(info);
+    if (!info.global_names.count(var_name_)) {
+        IntRange current = info.VarRange(var_name_);
+        IntRange start_range = info.RangeOf(start_expr_.get()), step_range = info.RangeOf(step_expr_.get());
+        std::string name, op;
+        IntRange other;
+        if (ComparedVariable(end_expr_.get(), info, name, op, other) && name == var_name_) {
+            IntRange bound = NarrowRange(op, exact_range, other);
+            if (step_range.lo >= 0 && bound.hi < exact_range.hi) {
+                current = { start_range.lo, std::max(start_range.hi, bound.hi) };
+            } else if (step_range.hi <= 0 && bound.lo > exact_range.lo) {
+                current = { std::min(start_range.lo, bound.lo), start_range.hi };
+            }
+        }
+        IntRange range;
+        ValueType type = ArithType('+', info.VarType(var_name_), current, step, step_range, range);
+        JoinVar(info, var_name_, type, range);
+    }
+
+    // for expression always evaluates to 0
+    return SetType(info, this, TYPE_INT, IntRange());
+}
+
+ValueType PrototypeAST::InferType(TypeInfo& info) {
+    return info.expr_types[this] = TYPE_DOUBLE;
+}
+
+ValueType FunctionAST::InferType(TypeInfo& info) {
+    // an assignment without `global` writes the global of that name, unless an argument shadows it
+    const std::vector<std::string>& args = proto_->args();
+    for (auto& pair : g_global_named_vars) {
+        if (std::find(args.begin(), args.end(), pair.first) == args.end()) {
+            info.global_names.insert(pair.first);
+        }
+    }
+
+    // variable types and ranges only grow, so iterate the body until they are stable
+    for (int round = 1; ; ++round) {
+        auto var_types = info.var_types;
+        auto var_ranges = info.var_ranges;
+        size_t global_count = info.global_names.size();
+        size_t assigned_count = info.assigned_locals.size();
+
+        ValueType ret_type = body_.empty() ? TYPE_INT : TYPE_UNKNOWN;
+        IntRange ret_range;
+        for (auto& expr : body_) {
+            ret_type = expr->InferType(info);
+            ret_range = info.RangeOf(expr.get());
+        }
+
+        if (var_types == info.var_types && var_ranges == info.var_ranges &&
+            global_count == info.global_names.size() && assigned_count == info.assigned_locals.size()) {
+            info.ret_type = ret_type;
+            info.ret_range = ret_range;
+            return SetType(info, this, ret_type, ret_range);
+        }
+
+        // e.g. a sum over a loop, which no bound is known for
+        if (round >= max_range_rounds) {
+            for (auto& pair : info.var_ranges) {
+                auto previous = var_ranges.find(pair.first);
+                if (previous != var_ranges.end() && !(previous->second == pair.second)) {
+                    info.var_types[pair.first] = TYPE_DOUBLE;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,145 @@
+#ifndef _H_TYPE_INFER
+#define _H_TYPE_INFER
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class ExprAST;
+class FunctionAST;
+
+/**
+ * Enum Declare
+ */
+// value type of an expression, ordered from the narrowest to the widest
+// TYPE_UNKNOWN is the bottom element used while a fixpoint is still being computed
+enum ValueType {
+    TYPE_UNKNOWN = 0,
+    TYPE_BOOL = 1,
+    TYPE_INT = 2,
+    TYPE_DOUBLE = 3
+};
+
+
+/**
+ * Struct Declare
+ */
+// the values an integer may take, both bounds included
+// TYPE_INT is only inferred for values whose range is within +-2^53, where doubles are exact integers: there the
+// i64 code computes exactly what the double code would
+struct IntRange {
+    int64_t lo = 0;
+    int64_t hi = 0;
+
+    bool operator==(const IntRange& other) const { return lo == other.lo && hi == other.hi; }
+};
+
+// inference result of one function body under one argument signature
+struct TypeInfo {
+    // type of every expression node inside the body
+    std::unordered_map<const ExprAST*, ValueType> expr_types;
+
+    // range of the expression nodes of TYPE_INT
+    std::unordered_map<const ExprAST*, IntRange> expr_ranges;
+
+    // type of every local variable (function arguments included)
+    std::unordered_map<std::string, ValueType> var_types;
+
+    // range of the local variables of TYPE_INT or TYPE_BOOL, over the whole body
+    std::unordered_map<std::string, IntRange> var_ranges;
+
+    // locals assigned with `=`, whose range may differ from one point of the body to another
+    std::unordered_set<std::string> assigned_locals;
+
+    // names which may refer to a global variable, they are always double
+    std::unordered_set<std::string> global_names;
+
+    // globals assigned in the body, `const` definitions included
+    std::unordered_set<std::string> assigned_globals;
+
+    // call / user defined operator nodes which call a specialized function, mapped to the specialization key
+    std::unordered_map<const ExprAST*, std::string> callees;
+
+    ValueType ret_type = TYPE_UNKNOWN;
+
+    IntRange ret_range;
+
+    ValueType TypeOf(const ExprAST* expr) const;
+
+    ValueType VarType(const std::string& name) const;
+
+    // range of an expression or variable of TYPE_INT or TYPE_BOOL
+    IntRange RangeOf(const ExprAST* expr) const;
+
+    IntRange VarRange(const std::string& name) const;
+};
+
+// a clone of a user defined function specialized for non-double argument types
+struct Specialization {
+    std::string func_name;
+    std::vector<ValueType> arg_types;
+    ValueType ret_type = TYPE_UNKNOWN;
+    IntRange ret_range;
+    TypeInfo type_info;
+    bool in_progress = false;
+    bool emitted = false;
+};
+
+
+/**
+ * Global Variable Declare
+ */
+// function definitions kept alive so that they can be specialized later
+extern thread_local std::unordered_map<std::string, std::shared_ptr<FunctionAST>> name2func_ast;
+
+// specialization key (e.g. "fibonacci.i") to its inferred signature, ordered so that the keys of a function are
+// adjacent
+extern thread_local std::map<std::string, Specialization> g_specializations;
+
+// function name to the defined functions whose body calls it
+extern thread_local std::unordered_map<std::string, std::set<std::string>> g_function_callers;
+
+
+/**
+ * Function Declare
+ */
+// least upper bound of two types
+ValueType JoinType(ValueType lhs, ValueType rhs);
+
+// whether a literal written without a decimal point is inferred TYPE_INT: small enough to be exact as a double
+bool IsIntegralLiteral(double value);
+
+// result type of `op` (`+`, `-` or `*`, the for-loop increment too) on operands of the types and ranges given, and
+// the range of an integer result; a result which may be beyond +-2^53 is a double, computed as the double code does
+ValueType ArithType(char op, ValueType lhs, IntRange lhs_range, ValueType rhs, IntRange rhs_range, IntRange& range);
+
+// one letter code of a type used in specialization names
+char TypeSuffix(ValueType type);
+
+// "name.<arg codes>", identifies a specialization regardless of its return type
+std::string SpecializationKey(const std::string& func_name, const std::vector<ValueType>& arg_types);
+
+// "name.<arg codes>.<ret code>", the symbol emitted for a specialization
+std::string SpecializationSymbol(const std::string& key);
+
+// keys of the specializations of `func_name` inferred so far
+std::vector<std::string> SpecializationKeys(const std::string& func_name);
+
+// keep a function definition for specialization, and record the functions it calls
+// the specializations of a redefined function are left to the caller (see RespecializeCallers in codegen.cpp)
+void RegisterFunctionAST(std::shared_ptr<FunctionAST> ast);
+
+// infer the specialization `key` of `func_name` on demand, return false if it is unusable right now
+// (it is being inferred further up the stack through mutual recursion)
+bool ResolveSpecialization(
+  const std::string& key, const std::string& func_name, const std::vector<ValueType>& arg_types);
+
+// seed `info` with the argument types then infer the whole body of `func`
+ValueType InferFunctionType(FunctionAST& func, const std::vector<ValueType>& arg_types, TypeInfo& info);
+
+#endif // _H_TYPE_INFER
@@ -0,0 +1,430 @@
+#include "../src/codegen.h"
+#include "../src/parser.h"
+#include "../src/lexer.h"
+#include "../src/output.h"
+#include "../src/parallel_parse.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+// one top level item of a corpus file
+struct CorpusItem {
+    int kind;  // TOKEN_DEF, TOKEN_EXTERN, or 0 for a top level expression
+    std::string code;
+    size_t node_count;
+    std::shared_ptr<FunctionAST> function;
+    std::shared_ptr<PrototypeAST> prototype;
+};
+
+struct CorpusFile {
+    std::string name;
+    std::string code;
+    size_t token_count;
+    std::vector<CorpusItem> items;
+};
+
+static std::vector<CorpusFile> corpus;
+
+// split a file into its top level items, parsing it once
+// operator precedences are registered on the way, so later items parse as they do in the console
+static void SplitItems(CorpusFile& file) {
+    SetLexerInput(file.code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF) {
+        size_t begin = g_token_offset;
+        CorpusItem item;
+        item.kind = g_current_token;
+        if (g_current_token == TOKEN_DEF) {
+            item.function = ParseDefinition();
+            const PrototypeAST& proto = item.function->proto();
+            if (proto.IsBinaryOp()) {
+                g_binop_precedence[proto.GetOpName()] = proto.op_precedence();
+            }
+        } else if (g_current_token == TOKEN_EXTERN) {
+            item.prototype = ParseExtern();
+        } else if (g_current_token == TOKEN_END) {
+            GetNextToken();
+            continue;
+        } else {
+            item.kind = 0;
+            item.function = ParseTopLevelExpr();
+        }
+
+        // a token which starts no expression would never be consumed
+        if (g_token_offset == begin) {
+            GetNextToken();
+            continue;
+        }
+        item.node_count = item.function ? item.function->CountNodes() : 1;
+        item.code = file.code.substr(begin, g_token_offset - begin);
+        file.items.push_back(std::move(item));
+    }
+    ResetLexerInput();
+}
+
+static void LoadCorpus(const std::string& dir) {
+    std::vector<std::string> paths;
+    for (auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".ks") {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    for (auto& path : paths) {
+        std::ifstream in(path);
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+
+        CorpusFile file;
+        file.name = std::filesystem::path(path).filename().string();
+        file.code = buffer.str();
+        file.token_count = 0;
+        SetLexerInput(file.code);
+        while (GetToken() != TOKEN_EOF) {
+            ++file.token_count;
+        }
+        SplitItems(file);
+        corpus.push_back(std::move(file));
+    }
+}
+
+// executed expressions print, keep the benchmark report readable
+class SilenceStdout {
+public:
+    SilenceStdout() {
+        FlushOutput();
+        fflush(stdout);
+        std::cout.flush();
+        saved_fd_ = dup(STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    ~SilenceStdout() {
+        FlushOutput();
+        fflush(stdout);
+        std::cout.flush();
+        dup2(saved_fd_, STDOUT_FILENO);
+        close(saved_fd_);
+    }
+
+private:
+    int saved_fd_;
+};
+
+// start over with an empty JIT, as if the console was restarted
+static void ResetCompiler() {
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    g_global_named_vars.clear();
+    g_const_values.clear();
+    g_local_named_vars.clear();
+    name2func_ast.clear();
+    g_specializations.clear();
+    g_function_callers.clear();
+    ReCreateModule();
+}
+
+static void BM_GetToken(benchmark::State& state) {
+    size_t tokens = 0;
+    size_t bytes = 0;
+    for (auto _ : state) {
+        for (auto& file : corpus) {
+            SetLexerInput(file.code);
+            int token;
+            while ((token = GetToken()) != TOKEN_EOF) {
+                benchmark::DoNotOptimize(token);
+            }
+            tokens += file.token_count;
+            bytes += file.code.size();
+        }
+    }
+    ResetLexerInput();
+    state.counters["tokens/s"] = benchmark::Counter(tokens, benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_GetToken);
+
+// parse every item of `kind` from its source text
+template <typename ParseFunc>
+static void ParseItems(benchmark::State& state, int kind, ParseFunc parse) {
+    size_t nodes = 0;
+    for (auto _ : state) {
+        for (auto& file : corpus) {
+            for (auto& item : file.items) {
+                if (item.kind != kind) {
+                    continue;
+                }
+                SetLexerInput(item.code);
+                GetNextToken();
+                benchmark::DoNotOptimize(parse());
+                nodes += item.node_count;
+            }
+        }
+    }
+    ResetLexerInput();
+    state.counters["nodes/s"] = benchmark::Counter(nodes, benchmark::Counter::kIsRate);
+}
+
+static void BM_ParseDefinition(benchmark::State& state) {
+    ParseItems(state, TOKEN_DEF, ParseDefinition);
+}
+BENCHMARK(BM_ParseDefinition);
+
+static void BM_ParseExpression(benchmark::State& state) {
+    ParseItems(state, 0, ParseExpression);
+}
+BENCHMARK(BM_ParseExpression);
+
+// the corpus concatenated until it is a few MB, as one large file
+static const std::string& LargeInput() {
+    static std::string input;
+    while (input.size() < (4 << 20) && !corpus.empty()) {
+        for (auto& file : corpus) {
+            input += file.code;
+            input += "\n";
+        }
+    }
+    return input;
+}
+
+static void BM_SplitSource(benchmark::State& state) {
+    const std::string& input = LargeInput();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(SplitSource(input.data(), input.data() + input.size(), 64, g_binop_precedence));
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_SplitSource)->Unit(benchmark::kMillisecond);
+
+// parse the large input on N threads, the wall time should drop about as N grows, up to the number of cores
+static void BM_ParseInParallel(benchmark::State& state) {
+    const std::string& input = LargeInput();
+    size_t items = 0;
+    for (auto _ : state) {
+        ParseInParallel(input.data(), input.data() + input.size(), state.range(0),
+                        [&items](ParsedItem&) { ++items; });
+    }
+    state.counters["items/s"] = benchmark::Counter(items, benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ParseInParallel)->RangeMultiplier(2)->Range(1, 16)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// CodeGen and the function pass pipeline of every definition, without the JIT
+// each function goes into a fresh module, since a file may redefine a function
+static void BM_CodeGenFunction(benchmark::State& state) {
+    ResetCompiler();
+    size_t functions = 0;
+    for (auto _ : state) {
+        for (auto& file : corpus) {
+            for (auto& item : file.items) {
+                if (item.kind == TOKEN_EXTERN) {
+                    name2proto_ast[item.prototype->name()] = item.prototype;
+                }
+                if (item.kind != TOKEN_DEF) {
+                    continue;
+                }
+                state.PauseTiming();
+                ReCreateModule();
+                state.ResumeTiming();
+                benchmark::DoNotOptimize(item.function->CodeGen());
+                ++functions;
+            }
+        }
+    }
+    state.counters["functions/s"] = benchmark::Counter(functions, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_CodeGenFunction);
+
+// feed every file through the console driver with a fresh JIT
+// only the items of `kind` are timed: parsing, codegen, adding the module, lookup and execution
+static void JITItems(benchmark::State& state, int kind) {
+    SilenceStdout silence;
+    size_t timed_items = 0;
+    for (auto _ : state) {
+        double seconds = 0;
+        for (auto& file : corpus) {
+            ResetCompiler();
+            for (auto& item : file.items) {
+                SetLexerInput(item.code);
+                GetNextToken();
+                auto start = std::chrono::steady_clock::now();
+                switch (item.kind) {
+                    case TOKEN_DEF: ParseDefinitionToken(); break;
+                    case TOKEN_EXTERN: ParseExternToken(); break;
+                    default: ParseTopLevel(); break;
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                if (item.kind == kind) {
+                    seconds += elapsed.count();
+                    ++timed_items;
+                }
+            }
+        }
+        state.SetIterationTime(seconds);
+    }
+    ResetLexerInput();
+    state.counters["latency"] = benchmark::Counter(
+        timed_items, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+static void BM_JITDefinition(benchmark::State& state) {
+    JITItems(state, TOKEN_DEF);
+}
+BENCHMARK(BM_JITDefinition)->UseManualTime();
+
+static void BM_JITTopLevelExpr(benchmark::State& state) {
+    JITItems(state, 0);
+}
+BENCHMARK(BM_JITTopLevelExpr)->UseManualTime();
+
+static void FeedDefinition(const std::string& code) {
+    SetLexerInput(code);
+    GetNextToken();
+    ParseDefinitionToken();
+    ResetLexerInput();
+}
+
+// redefine `leaf`, which `range(0)` callers compiled and linked beforehand call as `leaf(arg)`
+// only the new `leaf` is compiled and its stubs repointed, so the latency should not grow with the callers
+static void RedefineWithCallers(benchmark::State& state, const std::string& arg, double arg_value) {
+    ResetCompiler();
+    size_t callers = state.range(0);
+    FeedDefinition("def leaf(x) x + 1.5 end");
+    std::vector<double (*)(double)> caller_fps;
+    for (size_t i = 0; i < callers; ++i) {
+        std::string name = "caller" + std::to_string(i);
+        FeedDefinition("def " + name + "(x) leaf(" + arg + ") * 2 + " + std::to_string(i) + " end");
+        caller_fps.push_back((double (*)(double)) g_jit->getSymbolAddress(name));
+        caller_fps.back()(1);
+    }
+
+    size_t version = 1;
+    for (auto _ : state) {
+        ++version;
+        // a double result whatever the argument types, so that the callers' code stays right
+        std::string code = "def leaf(x) x + " + std::to_string(version) + ".5 end";
+        auto start = std::chrono::steady_clock::now();
+        FeedDefinition(code);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        state.SetIterationTime(elapsed.count());
+
+        // every caller, linked before, must see the new definition
+        double leaf = arg_value + version + 0.5;
+        if (caller_fps.front()(1) != leaf * 2 || caller_fps.back()(1) != leaf * 2 + callers - 1) {
+            state.SkipWithError("a caller still calls the old definition");
+            break;
+        }
+    }
+    state.counters["retired_modules"] = g_jit->getRetiredModuleCount();
+}
+
+static void BM_RedefineWithCallers(benchmark::State& state) {
+    RedefineWithCallers(state, "x", 1);
+}
+BENCHMARK(BM_RedefineWithCallers)->RangeMultiplier(10)->Range(10, 10000)->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+// the callers call the specialization `leaf.i`, which is generated again with the new body
+static void BM_RedefineWithSpecializedCallers(benchmark::State& state) {
+    RedefineWithCallers(state, "3", 3);
+}
+BENCHMARK(BM_RedefineWithSpecializedCallers)->RangeMultiplier(10)->Range(10, 10000)->UseManualTime()
+    ->Unit(benchmark::kMicrosecond);
+
+// `poly` over range(0) inputs, through the scalar entry point then through the batch entry point
+static const char* batch_definition = "def poly(x y) x * x * 0.5 + x * y - y / 3 end";
+
+static std::vector<double> BatchInput(size_t n, double scale) {
+    std::vector<double> column(n);
+    for (size_t i = 0; i < n; ++i) {
+        column[i] = i * scale;
+    }
+    return column;
+}
+
+static void BM_ScalarCall(benchmark::State& state) {
+    ResetCompiler();
+    FeedDefinition(batch_definition);
+    auto poly = (double (*)(double, double)) g_jit->getSymbolAddress("poly");
+    size_t n = state.range(0);
+    std::vector<double> xs = BatchInput(n, 0.25), ys = BatchInput(n, 1.5), out(n);
+    for (auto _ : state) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = poly(xs[i], ys[i]);
+        }
+        benchmark::ClobberMemory();
+    }
+    state.counters["elements/s"] = benchmark::Counter(state.iterations() * n, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_ScalarCall)->Range(1 << 10, 1 << 20);
+
+static void BM_BatchCall(benchmark::State& state) {
+    ResetCompiler();
+    FeedDefinition(batch_definition);
+    auto poly = (double (*)(double, double)) g_jit->getSymbolAddress("poly");
+    BatchFunction batch = GetBatchFunction("poly");
+    size_t n = state.range(0);
+    std::vector<double> xs = BatchInput(n, 0.25), ys = BatchInput(n, 1.5), out(n);
+    const double* columns[] = { xs.data(), ys.data() };
+    for (auto _ : state) {
+        batch(columns, out.data(), n);
+        benchmark::ClobberMemory();
+    }
+    if (out.back() != poly(xs.back(), ys.back())) {
+        state.SkipWithError("the batch entry point disagrees with the scalar function");
+    }
+    state.counters["elements/s"] = benchmark::Counter(state.iterations() * n, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_BatchCall)->Range(1 << 10, 1 << 20);
+
+// printd from a Kaleidoscope loop, the values are formatted into the output buffer and written to /dev/null
+static void BM_Printd(benchmark::State& state) {
+    SilenceStdout silence;
+    ResetCompiler();
+    std::string extern_code = "extern printd(x)";
+    SetLexerInput(extern_code);
+    GetNextToken();
+    ParseExternToken();
+    FeedDefinition("def print_all(n) for i = 0, i < n, 1 in printd(i * 0.5) end end");
+    auto print_all = (double (*)(double)) g_jit->getSymbolAddress("print_all");
+    size_t n = state.range(0);
+    for (auto _ : state) {
+        print_all(n);
+        FlushOutput();
+    }
+    state.counters["values/s"] = benchmark::Counter(state.iterations() * n, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Printd)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+// usage: benchmark.app [benchmark flags] [corpus dir, ../resources by default]
+// e.g. `--benchmark_out=results.json --benchmark_out_format=json` for machine-readable results
+int main(int argc, char* argv[]) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    g_enable_ir_print = false;
+
+    benchmark::Initialize(&argc, argv);
+    LoadCorpus(argc > 1 ? argv[1] : "../resources");
+
+    size_t items = 0;
+    for (auto& file : corpus) {
+        items += file.items.size();
+    }
+    benchmark::AddCustomContext("corpus_files", std::to_string(corpus.size()));
+    benchmark::AddCustomContext("corpus_items", std::to_string(items));
+
+    ResetCompiler();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1 @@
+clang++ -O2 -g -std=c++17 -stdlib=libc++ ../src/lexer.cpp ../src/parser.cpp ../src/codegen.cpp ../src/columns.cpp ../src/output.cpp ../src/instance.cpp ../src/snapshot.cpp ../src/type_infer.cpp ../src/time_report.cpp ../src/perf_counters.cpp ../src/sampler.cpp ../src/expr_cache.cpp ../src/parallel_parse.cpp ./benchmark.cpp `/usr/local/opt/llvm/bin/llvm-config --cppflags --ldflags --system-libs --libs core orcjit native ipo bitreader bitwriter` -lbenchmark -lpthread -o benchmark.app
\ No newline at end of file
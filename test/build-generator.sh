@@ -0,0 +1 @@
+clang++ -O2 -std=c++17 -stdlib=libc++ ./program_generator.cpp ./generate_program.cpp -o generate_program.app
\ No newline at end of file
@@ -0,0 +1 @@
+clang++ -O2 -g -std=c++17 -stdlib=libc++ -pthread ../src/protocol.cpp ./load_generator.cpp -o load_generator.app
\ No newline at end of file
@@ -1 +1 @@
-clang++ -g -std=c++17 -stdlib=libc++ ../src/lexer.cpp ../src/parser.cpp ../src/codegen.cpp ./codegen_test.cpp `/usr/local/opt/llvm/bin/llvm-config --cppflags --ldflags --system-libs --libs core orcjit native` -o codegen.app
\ No newline at end of file
+clang++ -g -std=c++17 -stdlib=libc++ ../src/lexer.cpp ../src/parser.cpp ../src/codegen.cpp ../src/columns.cpp ../src/output.cpp ../src/instance.cpp ../src/snapshot.cpp ../src/type_infer.cpp ../src/time_report.cpp ../src/perf_counters.cpp ../src/sampler.cpp ../src/expr_cache.cpp ./codegen_test.cpp `/usr/local/opt/llvm/bin/llvm-config --cppflags --ldflags --system-libs --libs core orcjit native ipo bitreader bitwriter` -o codegen.app
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "program_generator.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// usage: generate_program.app [--seed=N] [--functions=N] [--call-depth=N] [--expression-size=N]
+//                             [--loops=N] [--globals=N] [--operators=N] [--entry-calls=N] > program.ks
+int main(int argc, char* argv[]) {
+    GeneratorOptions options;
+    struct { const char* flag; uint64_t* u64; size_t* size; } flags[] = {
+        { "--seed=", &options.seed, nullptr },
+        { "--functions=", nullptr, &options.functions },
+        { "--call-depth=", nullptr, &options.call_depth },
+        { "--expression-size=", nullptr, &options.expression_size },
+        { "--loops=", nullptr, &options.loops },
+        { "--globals=", nullptr, &options.globals },
+        { "--operators=", nullptr, &options.operators },
+        { "--entry-calls=", nullptr, &options.entry_calls },
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        bool matched = false;
+        for (auto& flag : flags) {
+            size_t length = strlen(flag.flag);
+            if (strncmp(argv[i], flag.flag, length) == 0) {
+                unsigned long long value = strtoull(argv[i] + length, nullptr, 10);
+                if (flag.u64 != nullptr) {
+                    *flag.u64 = value;
+                } else {
+                    *flag.size = value;
+                }
+                matched = true;
+            }
+        }
+        if (!matched) {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (options.functions == 0) {
+        fprintf(stderr, "--functions must be at least 1\n");
+        return 1;
+    }
+
+    std::cout << GenerateProgram(options);
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "../src/protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// request latencies of one connection, in microseconds
+struct ConnectionResult {
+    bool ok = true;
+    std::vector<double> latencies_us;
+};
+
+static int Connect(const std::string& socket_path) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool Request(int fd, const std::string& request, std::string& response) {
+    return WriteFrame(fd, request) && ReadFrame(fd, response) && !response.empty() && response[0] == MESSAGE_OK;
+}
+
+// code which does not parse and calls to undefined functions must be answered with MESSAGE_ERROR, on a connection
+// which goes on serving
+static bool CheckErrors(int fd) {
+    const std::string invalid_requests[] = {
+        std::string(1, MESSAGE_COMPILE) + "def load_broken(x\n",
+        std::string(1, MESSAGE_COMPILE) + ")\n",
+        std::string(1, MESSAGE_COMPILE) + "load_missing(1)\n",
+        std::string(1, MESSAGE_COMPILE) + "def load_calls_missing(x) load_missing(x) end\n",
+        std::string(1, MESSAGE_CALL) + "load_missing" + '\0',
+    };
+    std::string response;
+    for (const std::string& request : invalid_requests) {
+        if (!WriteFrame(fd, request) || !ReadFrame(fd, response) || response.empty() ||
+            response[0] != MESSAGE_ERROR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// `mode` is one of call, compile and ping
+static void RunConnection(const std::string& socket_path, const std::string& mode, size_t requests, int arg,
+                          ConnectionResult& result) {
+    int fd = Connect(socket_path);
+    if (fd < 0) {
+        result.ok = false;
+        return;
+    }
+
+    if (!CheckErrors(fd)) {
+        fprintf(stderr, "invalid requests were not answered with errors\n");
+        result.ok = false;
+        close(fd);
+        return;
+    }
+
+    std::string response;
+    std::string definition = std::string(1, MESSAGE_COMPILE) +
+        "def load_fib(x)\n    if x < 3 then\n        1\n    else\n        load_fib(x - 1) + load_fib(x - 2)\n    end\nend\n";
+    if (!Request(fd, definition, response)) {
+        result.ok = false;
+        close(fd);
+        return;
+    }
+
+    std::string request;
+    if (mode == "call") {
+        request = std::string(1, MESSAGE_CALL) + "load_fib" + '\0';
+        AppendDoubles(request, { (double) arg });
+    } else if (mode == "compile") {
+        request = std::string(1, MESSAGE_COMPILE) + "load_fib(" + std::to_string(arg) + ")\n";
+    } else {
+        request = std::string(1, MESSAGE_PING);
+    }
+
+    result.latencies_us.reserve(requests);
+    for (size_t i = 0; i < requests && result.ok; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        result.ok = Request(fd, request, response);
+        result.latencies_us.push_back(
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    close(fd);
+}
+
+static double Percentile(const std::vector<double>& sorted, double p) {
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+// usage: load_generator.app [--socket <path>] [--connections C] [--requests R] [--mode call|compile|ping] [--arg N]
+// every connection checks that invalid requests are answered with errors, defines `load_fib`, then sends R requests
+// back to back:
+//   call: call load_fib(N), compile: compile and run the top level expression `load_fib(N)`, ping: round trip only
+int main(int argc, char* argv[]) {
+    std::string socket_path = "/tmp/ksc.sock";
+    size_t connections = 4;
+    size_t requests = 10000;
+    std::string mode = "call";
+    int arg = 10;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--socket") == 0) {
+            socket_path = argv[i + 1];
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            connections = std::max<size_t>(1, strtoull(argv[i + 1], nullptr, 10));
+        } else if (strcmp(argv[i], "--requests") == 0) {
+            requests = strtoull(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--mode") == 0) {
+            mode = argv[i + 1];
+        } else if (strcmp(argv[i], "--arg") == 0) {
+            arg = atoi(argv[i + 1]);
+        }
+    }
+
+    std::vector<ConnectionResult> results(connections);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        threads.emplace_back(RunConnection, socket_path, mode, requests, arg, std::ref(results[i]));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> latencies;
+    for (const ConnectionResult& result : results) {
+        if (!result.ok) {
+            fprintf(stderr, "a connection failed, is the server running on %s?\n", socket_path.c_str());
+            return 1;
+        }
+        latencies.insert(latencies.end(), result.latencies_us.begin(), result.latencies_us.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("mode=%s connections=%zu requests=%zu seconds=%.3f requests/s=%.0f\n", mode.c_str(), connections,
+           latencies.size(), seconds, latencies.size() / seconds);
+    printf("latency us: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", Percentile(latencies, 0.5),
+           Percentile(latencies, 0.9), Percentile(latencies, 0.99), latencies.empty() ? 0 : latencies.back());
+    return 0;
+}
@@ -0,0 +1,330 @@
+#include "../src/codegen.h"
+#include "../src/parser.h"
+#include "../src/lexer.h"
+#include "../src/output.h"
+#include "../src/perf_counters.h"
+#include "../src/time_report.h"
+#include "program_generator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// a program of the corpus, named after its file or its generator options
+struct Program {
+    std::string name;
+    std::string code;
+};
+
+// counts of one run of a program, per phase, PHASE_COUNT for the time of the items outside any phase
+struct ProgramCounts {
+    bool open[COUNTER_COUNT];
+    PerfCounterValues phases[PHASE_COUNT + 1];
+};
+
+// tolerated increase over the baseline, in percent
+// instructions are nearly deterministic, cache misses and page faults vary with everything else on the host
+static double tolerances[COUNTER_COUNT] = { 10, 2, 25, 15, 20 };
+
+static bool ReadFile(const std::string& path, std::string& content) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// compile and run `code` as `ksc-console.app` would, with every phase counted
+static bool Run(const std::string& code, ProgramCounts& counts) {
+    std::string error;
+    if (!OpenPerfCounters(error)) {
+        return false;
+    }
+    g_enable_time_report = true;
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    ReCreateModule();
+
+    SetLexerInput(code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF) {
+        switch (g_current_token) {
+            case TOKEN_END: GetNextToken(); break;
+            case TOKEN_DEF: ParseDefinitionToken(); break;
+            case TOKEN_EXTERN: ParseExternToken(); break;
+            default: ParseTopLevel(); break;
+        }
+    }
+    FlushOutput();
+
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        counts.open[counter] = IsPerfCounterOpen((PerfCounter) counter);
+    }
+    for (int phase = 0; phase <= PHASE_COUNT; ++phase) {
+        counts.phases[phase] = GetPhaseCounters((TimePhase) phase);
+    }
+    return true;
+}
+
+// run a program in a fresh process, so that every run starts from the same compiler state and page tables
+static bool RunInChild(const Program& program, ProgramCounts& counts) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // the program prints its results
+        if (freopen("/dev/null", "w", stdout) == nullptr) {
+            _exit(1);
+        }
+        ProgramCounts child_counts = {};
+        if (!Run(program.code, child_counts)) {
+            _exit(1);
+        }
+        ssize_t written = write(fds[1], &child_counts, sizeof(child_counts));
+        _exit(written == sizeof(child_counts) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t bytes_read = read(fds[0], &counts, sizeof(counts));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return bytes_read == sizeof(counts) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// "<program> <phase> <counter>" to the median count over the runs, of the open counters only
+static std::map<std::string, uint64_t> MedianCounts(const std::string& name, const std::vector<ProgramCounts>& runs) {
+    std::map<std::string, uint64_t> medians;
+    for (int phase = 0; phase <= PHASE_COUNT; ++phase) {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (!runs.front().open[counter]) {
+                continue;
+            }
+            std::vector<uint64_t> values;
+            for (auto& run : runs) {
+                values.push_back(run.phases[phase].values[counter]);
+            }
+            std::sort(values.begin(), values.end());
+            std::string key = name + " " + GetPhaseName((TimePhase) phase) + " " + perf_counter_names[counter];
+            medians[key] = values[values.size() / 2];
+        }
+    }
+    return medians;
+}
+
+static bool ReadBaseline(const std::string& path, std::map<std::string, uint64_t>& baseline) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        std::string program, phase, counter;
+        uint64_t value;
+        if (fields >> program >> phase >> counter >> value) {
+            baseline[program + " " + phase + " " + counter] = value;
+        }
+    }
+    return true;
+}
+
+static bool WriteBaseline(const std::string& path, const std::map<std::string, uint64_t>& counts) {
+    std::ofstream file(path);
+    file << "# <program> <phase> <counter> <median count>, written by perf_regression.app --update-baseline\n";
+    for (auto& entry : counts) {
+        file << entry.first << " " << entry.second << "\n";
+    }
+    return (bool) file;
+}
+
+static int CounterIndex(const std::string& name) {
+    for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+        if (name == perf_counter_names[counter]) {
+            return counter;
+        }
+    }
+    return -1;
+}
+
+// usage: perf_regression.app [--corpus <dir>] [--generated <functions>,...] [--repeat <n>]
+//                            [--baseline <file>] [--update-baseline] [--tolerance <counter>=<percent>]...
+//                            [--min-count <n>] [--allow-missing]
+// runs every program of the corpus (the `.ks` files of ../resources and generated programs of 100 and 1000
+// functions by default) `--repeat` times (5), each time in a fresh process, and compares the median count of
+// every phase and counter with the baseline (perf_baseline.txt)
+// counts below `--min-count` (100) in the baseline are too small to compare
+// exit status: 0 if nothing regressed, 1 on a regression, or on a counter of the baseline which cannot be
+// opened here unless `--allow-missing`
+int main(int argc, char* argv[]) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    g_enable_ir_print = false;
+
+    std::string corpus_dir = "../resources";
+    std::string generated = "100,1000";
+    std::string baseline_path = "perf_baseline.txt";
+    size_t repeat = 5;
+    uint64_t min_count = 100;
+    bool update_baseline = false;
+    bool allow_missing = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            corpus_dir = argv[++i];
+        } else if (strcmp(argv[i], "--generated") == 0 && i + 1 < argc) {
+            generated = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = std::max<size_t>(1, strtoull(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--update-baseline") == 0) {
+            update_baseline = true;
+        } else if (strcmp(argv[i], "--min-count") == 0 && i + 1 < argc) {
+            min_count = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--allow-missing") == 0) {
+            allow_missing = true;
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            std::string option = argv[++i];
+            size_t equals = option.find('=');
+            int counter = CounterIndex(option.substr(0, equals));
+            if (equals == std::string::npos || counter < 0) {
+                fprintf(stderr, "error: --tolerance expects <counter>=<percent>, e.g. instructions=2\n");
+                return 1;
+            }
+            tolerances[counter] = strtod(option.c_str() + equals + 1, nullptr);
+        } else {
+            fprintf(stderr, "error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // fail before running anything if nothing can be counted, and name what cannot
+    std::string error;
+    if (!OpenPerfCounters(error)) {
+        fprintf(stderr, "error: no perf counter can be opened: %s\n", error.c_str());
+        return 1;
+    }
+    if (!error.empty()) {
+        fprintf(stderr, "warning: not counted on this host: %s\n", error.c_str());
+    }
+    ClosePerfCounters();
+
+    std::vector<Program> programs;
+    std::vector<std::string> paths;
+    std::error_code error_code;
+    for (auto& entry : std::filesystem::directory_iterator(corpus_dir, error_code)) {
+        if (entry.path().extension() == ".ks") {
+            paths.push_back(entry.path().string());
+        }
+    }
+    if (error_code) {
+        fprintf(stderr, "error: %s: %s\n", corpus_dir.c_str(), error_code.message().c_str());
+        return 1;
+    }
+    std::sort(paths.begin(), paths.end());
+    for (auto& path : paths) {
+        Program program;
+        program.name = std::filesystem::path(path).filename().string();
+        if (!ReadFile(path, program.code)) {
+            fprintf(stderr, "error: cannot read %s\n", path.c_str());
+            return 1;
+        }
+        programs.push_back(std::move(program));
+    }
+    std::istringstream sizes(generated);
+    std::string size;
+    while (std::getline(sizes, size, ',')) {
+        GeneratorOptions options;
+        options.functions = strtoull(size.c_str(), nullptr, 10);
+        programs.push_back({ "generated-" + std::to_string(options.functions), GenerateProgram(options) });
+    }
+
+    std::map<std::string, uint64_t> counts;
+    for (auto& program : programs) {
+        std::vector<ProgramCounts> runs(repeat);
+        for (auto& run : runs) {
+            if (!RunInChild(program, run)) {
+                fprintf(stderr, "error: %s: the child process failed\n", program.name.c_str());
+                return 1;
+            }
+        }
+        auto medians = MedianCounts(program.name, runs);
+        counts.insert(medians.begin(), medians.end());
+        fprintf(stderr, "measured %s\n", program.name.c_str());
+    }
+
+    if (update_baseline) {
+        if (!WriteBaseline(baseline_path, counts)) {
+            fprintf(stderr, "error: cannot write %s\n", baseline_path.c_str());
+            return 1;
+        }
+        printf("wrote %zu counts to %s\n", counts.size(), baseline_path.c_str());
+        return 0;
+    }
+
+    std::map<std::string, uint64_t> baseline;
+    if (!ReadBaseline(baseline_path, baseline)) {
+        for (auto& entry : counts) {
+            printf("%s %llu\n", entry.first.c_str(), (unsigned long long) entry.second);
+        }
+        fprintf(stderr, "error: no baseline %s, run with --update-baseline to write one\n", baseline_path.c_str());
+        return 1;
+    }
+
+    size_t compared = 0, regressions = 0, improvements = 0, missing = 0;
+    for (auto& entry : baseline) {
+        auto current = counts.find(entry.first);
+        if (current == counts.end()) {
+            printf("MISSING     %s: in the baseline, not counted now\n", entry.first.c_str());
+            ++missing;
+            continue;
+        }
+        if (entry.second < min_count) {
+            continue;
+        }
+        int counter = CounterIndex(entry.first.substr(entry.first.rfind(' ') + 1));
+        double change = 100.0 * ((double) current->second - (double) entry.second) / (double) entry.second;
+        ++compared;
+        if (change > tolerances[counter]) {
+            printf("REGRESSION  %s: %llu -> %llu (%+.1f%%, tolerance %.1f%%)\n", entry.first.c_str(),
+                   (unsigned long long) entry.second, (unsigned long long) current->second, change,
+                   tolerances[counter]);
+            ++regressions;
+        } else if (change < -tolerances[counter]) {
+            printf("improved    %s: %llu -> %llu (%+.1f%%)\n", entry.first.c_str(),
+                   (unsigned long long) entry.second, (unsigned long long) current->second, change);
+            ++improvements;
+        }
+    }
+
+    printf("%zu counts compared: %zu regressed, %zu improved, %zu missing\n",
+           compared, regressions, improvements, missing);
+    if (improvements > 0 && regressions == 0) {
+        printf("run with --update-baseline to keep the improvements\n");
+    }
+    if (regressions > 0 || (missing > 0 && !allow_missing)) {
+        fflush(stdout);
+        fprintf(stderr, "FAILED: %zu performance regressions, %zu missing counts\n", regressions, missing);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include "program_generator.h"
+#include <algorithm>
+#include <vector>
+
+// splitmix64, so the output does not depend on the standard library
+class Random {
+public:
+    Random(uint64_t seed) : state_(seed) {}
+
+    uint64_t Next() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, bound)
+    size_t Below(size_t bound) {
+        return bound == 0 ? 0 : Next() % bound;
+    }
+
+    bool Chance(size_t percent) {
+        return Below(100) < percent;
+    }
+
+private:
+    uint64_t state_;
+};
+
+struct UserOperator {
+    std::string name;
+    bool is_binary;
+};
+
+struct GeneratedFunction {
+    std::string name;
+    size_t arg_count;
+    size_t level;
+};
+
+class ProgramGenerator {
+public:
+    ProgramGenerator(const GeneratorOptions& options) : options_(options), random_(options.seed) {}
+
+    std::string Generate() {
+        out_ += "# generated by program_generator, seed " + std::to_string(options_.seed) + "\n\n";
+        GenerateOperators();
+        GenerateGlobals();
+        GenerateFunctions();
+        GenerateEntryCalls();
+        return out_;
+    }
+
+private:
+    // operator names are built from characters without a builtin meaning
+    void GenerateOperators() {
+        static const char chars[] = { '~', '@', '^', '$', '?', ':', '%' };
+        for (size_t i = 0; i < options_.operators; ++i) {
+            std::string name;
+            size_t n = i;
+            do {
+                name += chars[n % sizeof(chars)];
+                n /= sizeof(chars);
+            } while (n > 0);
+
+            UserOperator op = { name, i % 2 == 0 };
+            if (op.is_binary) {
+                out_ += "def binary" + name + " " + std::to_string(30 + random_.Below(70)) + " (lhs rhs)\n";
+                out_ += "    lhs * 0.5 + rhs\nend\n\n";
+            } else {
+                out_ += "def unary" + name + " (x)\n";
+                out_ += "    x * x + 1\nend\n\n";
+            }
+            operators_.push_back(op);
+        }
+    }
+
+    void GenerateGlobals() {
+        if (options_.globals == 0) {
+            return;
+        }
+        out_ += "def init_globals()\n";
+        for (size_t i = 0; i < options_.globals; ++i) {
+            out_ += "    global g" + std::to_string(i) + " = " + std::to_string(i + 1) + "\n";
+        }
+        out_ += "    0\nend\n\ninit_globals()\n\n";
+    }
+
+    // function i is at level i * (call_depth + 1) / functions, and only calls functions one level below
+    void GenerateFunctions() {
+        for (size_t i = 0; i < options_.functions; ++i) {
+            GeneratedFunction func;
+            func.name = "f" + std::to_string(i);
+            func.arg_count = 1 + random_.Below(3);
+            func.level = i * (options_.call_depth + 1) / options_.functions;
+            if (func.level > 0) {
+                while (level_begin_.size() < func.level + 1) {
+                    level_begin_.push_back(i);
+                }
+            }
+            functions_.push_back(func);
+            GenerateFunction(functions_.back());
+        }
+    }
+
+    void GenerateFunction(const GeneratedFunction& func) {
+        args_.clear();
+        for (size_t i = 0; i < func.arg_count; ++i) {
+            args_.push_back("a" + std::to_string(i));
+        }
+        current_ = &func;
+
+        out_ += "def " + func.name + "(";
+        for (size_t i = 0; i < args_.size(); ++i) {
+            out_ += (i == 0 ? "" : " ") + args_[i];
+        }
+        out_ += ")\n";
+
+        // calls are only made outside loops, so the run time stays linear in the call depth
+        out_ += "    t = " + Expression(options_.expression_size, true) + "\n";
+        for (size_t i = 0; i < options_.loops; ++i) {
+            std::string var = "i" + std::to_string(i);
+            out_ += "    for " + var + " = 0, " + var + " < " + std::to_string(2 + random_.Below(3)) + ", 1 in\n";
+            out_ += "        t = t + " + Expression(options_.expression_size / 2, false) + "\n";
+            out_ += "    end\n";
+        }
+        if (options_.globals > 0 && random_.Chance(25)) {
+            std::string global = "g" + std::to_string(random_.Below(options_.globals));
+            out_ += "    global " + global + " = " + global + " + 1\n";
+        }
+        out_ += "    t * 0.5\nend\n\n";
+        current_ = nullptr;
+    }
+
+    void GenerateEntryCalls() {
+        size_t count = std::min(options_.entry_calls, functions_.size());
+        for (size_t i = functions_.size() - count; i < functions_.size(); ++i) {
+            out_ += CallOf(functions_[i], false) + "\n";
+        }
+    }
+
+    std::string CallOf(const GeneratedFunction& func, bool allow_calls) {
+        std::string call = func.name + "(";
+        for (size_t i = 0; i < func.arg_count; ++i) {
+            call += (i == 0 ? "" : ", ") + (allow_calls ? Leaf(false) : std::to_string(1 + random_.Below(9)));
+        }
+        return call + ")";
+    }
+
+    std::string Leaf(bool allow_calls) {
+        size_t choice = random_.Below(10);
+        if (current_ != nullptr && choice < 5) {
+            return args_[random_.Below(args_.size())];
+        }
+        if (current_ != nullptr && options_.globals > 0 && choice == 5) {
+            return "g" + std::to_string(random_.Below(options_.globals));
+        }
+        if (allow_calls && current_ != nullptr && current_->level > 0 && choice >= 8) {
+            // a level may be empty if there are fewer functions than levels
+            size_t begin = level_begin_[current_->level - 1];
+            size_t end = level_begin_[current_->level];
+            if (begin < end) {
+                return CallOf(functions_[begin + random_.Below(end - begin)], false);
+            }
+        }
+        if (!operators_.empty() && choice == 6) {
+            for (const UserOperator& op : operators_) {
+                if (!op.is_binary) {
+                    return "(" + op.name + " " + Leaf(false) + ")";
+                }
+            }
+        }
+        return std::to_string(1 + random_.Below(99));
+    }
+
+    // `size` binary operators over leaves, every operator is surrounded by spaces for the lexer
+    std::string Expression(size_t size, bool allow_calls) {
+        if (size == 0) {
+            return Leaf(allow_calls);
+        }
+        size_t left = random_.Below(size);
+        std::string lhs = Expression(left, allow_calls);
+        std::string rhs = Expression(size - 1 - left, allow_calls);
+
+        std::string op;
+        size_t choice = random_.Below(8);
+        if (choice < 3) {
+            op = "+";
+        } else if (choice < 5) {
+            op = "-";
+        } else if (choice < 7) {
+            op = "*";
+        } else {
+            op = "+";
+            for (const UserOperator& user_op : operators_) {
+                if (user_op.is_binary && random_.Chance(50)) {
+                    op = user_op.name;
+                    break;
+                }
+            }
+        }
+        return "(" + lhs + " " + op + " " + rhs + ")";
+    }
+
+    const GeneratorOptions& options_;
+    Random random_;
+    std::string out_;
+    std::vector<UserOperator> operators_;
+    std::vector<GeneratedFunction> functions_;
+    // index of the first function of every level, level 0 starts at 0
+    std::vector<size_t> level_begin_ = { 0 };
+    std::vector<std::string> args_;
+    const GeneratedFunction* current_ = nullptr;
+};
+
+std::string GenerateProgram(const GeneratorOptions& options) {
+    return ProgramGenerator(options).Generate();
+}
@@ -0,0 +1,44 @@
+#ifndef _H_PROGRAM_GENERATOR
+#define _H_PROGRAM_GENERATOR
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Struct Declare
+ */
+// shape of a generated Kaleidoscope program, the same options always give the same program
+struct GeneratorOptions {
+    uint64_t seed = 1;
+
+    // number of `def`s, user defined operators and the globals initializer excluded
+    size_t functions = 100;
+
+    // longest chain of calls between generated functions, there is no recursion
+    size_t call_depth = 4;
+
+    // binary operators per generated expression
+    size_t expression_size = 6;
+
+    // `for` loops per function
+    size_t loops = 1;
+
+    // globals shared by all functions, initialized by `init_globals()`
+    size_t globals = 4;
+
+    // user defined operators, binary and unary alternately
+    size_t operators = 2;
+
+    // top level calls of the functions with the longest call chains
+    size_t entry_calls = 4;
+};
+
+
+/**
+ * Function Declare
+ */
+// Kaleidoscope source text of a program described by `options`
+std::string GenerateProgram(const GeneratorOptions& options);
+
+#endif // _H_PROGRAM_GENERATOR
@@ -0,0 +1,190 @@
+#include "../src/codegen.h"
+#include "../src/parser.h"
+#include "../src/lexer.h"
+#include "program_generator.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// phase timings of one generated program, measured in a child process
+struct ScalingResult {
+    size_t functions;
+    size_t bytes;
+    double lex_ms;
+    double parse_ms;
+    double codegen_ms;
+    double jit_ms;
+    double peak_rss_mb;
+};
+
+static double MillisSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double PeakRssMb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes
+#else
+    return usage.ru_maxrss / 1024.0;  // kilobytes
+#endif
+}
+
+static void ResetCompiler() {
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    g_global_named_vars.clear();
+    g_local_named_vars.clear();
+    name2func_ast.clear();
+    g_specializations.clear();
+    g_function_callers.clear();
+    ReCreateModule();
+}
+
+// lex, parse, codegen (into a single module, not JIT'd) and then run the console driver on `code`
+static ScalingResult Measure(const std::string& code, size_t functions) {
+    ScalingResult result = {};
+    result.functions = functions;
+    result.bytes = code.size();
+
+    auto start = std::chrono::steady_clock::now();
+    SetLexerInput(code);
+    while (GetToken() != TOKEN_EOF) {
+    }
+    result.lex_ms = MillisSince(start);
+
+    // operator precedences are registered while parsing, as CodeGen would do
+    std::vector<std::unique_ptr<FunctionAST>> definitions;
+    start = std::chrono::steady_clock::now();
+    SetLexerInput(code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF) {
+        if (g_current_token == TOKEN_DEF) {
+            definitions.push_back(ParseDefinition());
+            const PrototypeAST& proto = definitions.back()->proto();
+            if (proto.IsBinaryOp()) {
+                g_binop_precedence[proto.GetOpName()] = proto.op_precedence();
+            }
+        } else if (g_current_token == TOKEN_EXTERN) {
+            ParseExtern();
+        } else {
+            ParseTopLevelExpr();
+        }
+    }
+    result.parse_ms = MillisSince(start);
+
+    ResetCompiler();
+    start = std::chrono::steady_clock::now();
+    for (auto& definition : definitions) {
+        definition->CodeGen();
+    }
+    result.codegen_ms = MillisSince(start);
+    definitions.clear();
+
+    // end to end, as `ksc-console.app < program.ks` would run it
+    ResetCompiler();
+    start = std::chrono::steady_clock::now();
+    SetLexerInput(code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF) {
+        switch (g_current_token) {
+            case TOKEN_DEF: ParseDefinitionToken(); break;
+            case TOKEN_EXTERN: ParseExternToken(); break;
+            default: ParseTopLevel(); break;
+        }
+    }
+    result.jit_ms = MillisSince(start);
+
+    result.peak_rss_mb = PeakRssMb();
+    return result;
+}
+
+// run one size in a fresh process, so that peak RSS and the global compiler state are per size
+static bool MeasureInChild(const GeneratorOptions& options, ScalingResult& result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // the program prints its results
+        if (freopen("/dev/null", "w", stdout) == nullptr) {
+            _exit(1);
+        }
+        ScalingResult child_result = Measure(GenerateProgram(options), options.functions);
+        ssize_t written = write(fds[1], &child_result, sizeof(child_result));
+        _exit(written == sizeof(child_result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t bytes_read = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return bytes_read == sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// exponent k of time ~ size^k between two consecutive sizes, about 1 for linear phases
+static double GrowthExponent(double prev_ms, double ms, size_t prev_size, size_t size) {
+    if (prev_ms <= 0 || ms <= 0) {
+        return 0;
+    }
+    return std::log(ms / prev_ms) / std::log((double) size / prev_size);
+}
+
+// usage: scaling_benchmark.app [max functions, 100000 by default] [seed]
+// prints CSV to stdout (plot e.g. every column against `functions` on log-log axes),
+// and the phases growing faster than linearly to stderr
+int main(int argc, char* argv[]) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    g_enable_ir_print = false;
+
+    size_t max_functions = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    GeneratorOptions options;
+    options.seed = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1;
+
+    printf("functions,bytes,lex_ms,parse_ms,codegen_ms,jit_ms,peak_rss_mb\n");
+    fflush(stdout);
+
+    std::vector<ScalingResult> results;
+    for (size_t functions = 1; functions <= max_functions; functions *= 10) {
+        options.functions = functions;
+        ScalingResult result;
+        if (!MeasureInChild(options, result)) {
+            fprintf(stderr, "%zu functions: the child process failed\n", functions);
+            return 1;
+        }
+        printf("%zu,%zu,%.3f,%.3f,%.3f,%.3f,%.1f\n", result.functions, result.bytes, result.lex_ms,
+               result.parse_ms, result.codegen_ms, result.jit_ms, result.peak_rss_mb);
+        fflush(stdout);
+
+        // tiny programs are dominated by fixed costs, only compare from 100 functions on
+        if (!results.empty() && results.back().functions >= 100) {
+            const ScalingResult& prev = results.back();
+            const char* names[] = { "lex", "parse", "codegen", "jit" };
+            double prev_ms[] = { prev.lex_ms, prev.parse_ms, prev.codegen_ms, prev.jit_ms };
+            double ms[] = { result.lex_ms, result.parse_ms, result.codegen_ms, result.jit_ms };
+            for (int i = 0; i < 4; ++i) {
+                double exponent = GrowthExponent(prev_ms[i], ms[i], prev.functions, functions);
+                if (exponent > 1.3) {
+                    fprintf(stderr, "super-linear: %s grows as size^%.2f from %zu to %zu functions\n",
+                            names[i], exponent, prev.functions, functions);
+                }
+            }
+        }
+        results.push_back(result);
+    }
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+#include "../src/session.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* code =
+    "def fibonacci(x)\n"
+    "    if x < 3 then\n"
+    "        1\n"
+    "    else\n"
+    "        fibonacci(x - 1) + fibonacci(x - 2)\n"
+    "    end\n"
+    "end\n"
+    "def binary ~ 5 (lhs rhs)\n"
+    "    lhs * 10 + rhs\n"
+    "end\n"
+    "1 ~ 2\n";
+
+// values of the top level expressions of `code`, none if an item does not compile
+static std::vector<double> Compile(KaleidoscopeSession& session, const std::string& code) {
+    std::vector<double> results;
+    std::string error;
+    if (!session.Compile(code, results, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return {};
+    }
+    return results;
+}
+
+// every session compiles the same code and calls into it, return false on a wrong result
+static bool RunSession(size_t calls) {
+    KaleidoscopeSession session;
+    std::vector<double> results = Compile(session, code);
+    if (results.size() != 1 || results[0] != 12) {
+        return false;
+    }
+    double result = 0;
+    if (session.Call("fibonacci", {1, 2}, result) || session.Call("missing", {}, result)) {
+        return false;
+    }
+    for (size_t i = 0; i < calls; ++i) {
+        if (!session.Call("fibonacci", {20}, result) || result != 6765) {
+            return false;
+        }
+    }
+    // a redefinition in one session is not seen by the others
+    Compile(session, "def fibonacci(x)\n    x\nend\n");
+    return session.Call("fibonacci", {20}, result) && result == 20;
+}
+
+// with instance globals, threads running the same compiled `count` each see their own `hits`, starting from the
+// value it was defined with, and the code of two sessions defining the same global runs on the same threads
+static bool RunInstanceGlobals(size_t threads, size_t calls) {
+    KaleidoscopeSession first(true);
+    KaleidoscopeSession second(true);
+    Compile(first, "global hits = 5\ndef count()\n    hits = hits + 1\nend\n");
+    Compile(second, "global hits = 100\ndef count()\n    hits = hits + 2\nend\n");
+    FunctionHandle first_handle = first.LookupFunction("count");
+    FunctionHandle second_handle = second.LookupFunction("count");
+    if (!first_handle || !second_handle) {
+        return false;
+    }
+    auto count_first = (double (*)()) first_handle.address();
+    auto count_second = (double (*)()) second_handle.address();
+    std::vector<std::thread> workers;
+    std::vector<double> first_hits(threads, 0);
+    std::vector<double> second_hits(threads, 0);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&first_hits, &second_hits, count_first, count_second, i, calls]() {
+            for (size_t j = 0; j < calls; ++j) {
+                first_hits[i] = count_first();
+                second_hits[i] = count_second();
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double first_session_hits = -1;
+    double second_session_hits = -1;
+    return std::all_of(first_hits.begin(), first_hits.end(), [calls](double value) { return value == 5 + calls; }) &&
+        std::all_of(second_hits.begin(), second_hits.end(), [calls](double value) {
+            return value == 100 + 2 * calls;
+        }) &&
+        first.Call("count", {}, first_session_hits) && first_session_hits == 6 &&
+        second.Call("count", {}, second_session_hits) && second_session_hits == 102;
+}
+
+// threads keep calling `rate` through a handle while the session redefines it and assigns the global it reads:
+// the code they run is not freed under them, their first copy of the globals is not torn, and every call returns
+// the result of one of the definitions, the last one once it is compiled
+static bool RunRedefinitionUnderWorkers(size_t threads, size_t redefinitions) {
+    KaleidoscopeSession session(true);
+    Compile(session, "global base = 1\ndef rate(x)\n    x + base\nend\n");
+    FunctionHandle handle = session.LookupFunction("rate");
+    if (!handle) {
+        return false;
+    }
+    auto rate = (double (*)(double)) handle.address();
+
+    std::atomic<bool> stop(false);
+    std::atomic<bool> wrong(false);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&stop, &wrong, rate]() {
+            while (!stop.load(std::memory_order_relaxed)) {
+                double result = rate(1);
+                if (result != 2 && result != 3) {
+                    wrong = true;
+                }
+            }
+        });
+    }
+    for (size_t i = 0; i < redefinitions; ++i) {
+        const char* body = i % 2 == 0 ? "x + base * 2" : "x + base";
+        Compile(session, std::string("base = 1\ndef rate(x)\n    ") + body + "\nend\n");
+    }
+    Compile(session, "def rate(x)\n    x + base * 2\nend\n");
+    bool last_seen = rate(1) == 3;
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return !wrong && last_seen;
+}
+
+// a batch entry point copies the specializations its function calls, and is generated again after they are
+// redefined
+static bool RunBatch() {
+    KaleidoscopeSession session;
+    Compile(session, "def scale(n)\n    n * 3\nend\ndef shift(x)\n    x + scale(2)\nend\n");
+    std::vector<double> column = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    std::vector<double> out(column.size());
+    if (!session.CallBatch("shift", { column.data() }, out.data(), column.size()) || out[7] != 13) {
+        return false;
+    }
+    Compile(session, "def scale(n)\n    n * 4\nend\n");
+    return session.CallBatch("shift", { column.data() }, out.data(), column.size()) && out[0] == 8 && out[7] == 15;
+}
+
+// with the expression cache, repeated expressions share code until a function they call is redefined
+static bool RunExpressionCache() {
+    KaleidoscopeSession session;
+    session.SetExpressionCache(8, true);
+    std::vector<double> results = Compile(session, code);
+    std::vector<double> repeated = Compile(session, "fibonacci(10)\nfibonacci(12)\n3 ~ 4\nfibonacci(10)\n");
+    if (results != std::vector<double>{ 12 } || repeated != std::vector<double>{ 55, 144, 34, 55 }) {
+        return false;
+    }
+    Compile(session, "def fibonacci(x)\n    x\nend\n");
+    return Compile(session, "fibonacci(10)\n1 ~ 2\n") == std::vector<double>{ 10, 12 };
+}
+
+// code which does not parse or refers to something undefined fails, after the items before it, and the session
+// goes on
+static bool RunInvalidCode() {
+    KaleidoscopeSession session;
+    const char* invalid_code[] = {
+        "def broken(x\n",
+        "def unfinished(x) x + \n",
+        "(1 + 2\n",
+        ")\n",
+        "missing(1)\n",
+        "def calls_missing(x) missing(x) end\n",
+        "extern sin(x)\nsin(1, 2)\n",
+        "undefined_variable + 1\n",
+        "def reads_undefined(x) y end\n",
+        "1 ~ 2\n",
+        "def one(x) x end\none(1, 2)\n",
+    };
+    for (const char* invalid : invalid_code) {
+        std::vector<double> results;
+        std::string error;
+        if (session.Compile(invalid, results, error) || error.empty()) {
+            fprintf(stderr, "compiled invalid code: %s", invalid);
+            return false;
+        }
+    }
+    std::vector<double> results;
+    std::string error;
+    bool compiled = session.Compile("2 * 3\nmissing(1)\n4\n", results, error);
+    return !compiled && results == std::vector<double>{ 6 } && Compile(session, code) == std::vector<double>{ 12 } &&
+        Compile(session, "one(7)\n") == std::vector<double>{ 7 };
+}
+
+// usage: session_test.app [max sessions, the number of cores by default] [calls per session]
+// runs 1, 2, 4, ... sessions on as many threads, and prints the throughput relative to one session
+int main(int argc, char* argv[]) {
+    size_t max_sessions = argc > 1 ? strtoull(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    size_t calls = argc > 2 ? strtoull(argv[2], nullptr, 10) : 2000;
+    if (max_sessions == 0) {
+        max_sessions = 1;
+    }
+
+    if (!RunInstanceGlobals(std::max<size_t>(max_sessions, 2), calls * 100)) {
+        fprintf(stderr, "threads running with instance globals interfered\n");
+        return 1;
+    }
+
+    if (!RunRedefinitionUnderWorkers(std::max<size_t>(max_sessions, 2), 50)) {
+        fprintf(stderr, "threads calling a function being redefined got a wrong result\n");
+        return 1;
+    }
+
+    if (!RunInvalidCode()) {
+        fprintf(stderr, "invalid code was compiled, or broke the session\n");
+        return 1;
+    }
+
+    if (!RunBatch()) {
+        fprintf(stderr, "a batch entry point returned a wrong result\n");
+        return 1;
+    }
+
+    if (!RunExpressionCache()) {
+        fprintf(stderr, "a cached expression returned a wrong result\n");
+        return 1;
+    }
+
+    printf("sessions,seconds,calls_per_second,scaling\n");
+    std::vector<size_t> session_counts;
+    for (size_t sessions = 1; sessions < max_sessions; sessions *= 2) {
+        session_counts.push_back(sessions);
+    }
+    session_counts.push_back(max_sessions);
+
+    double single_throughput = 0;
+    for (size_t sessions : session_counts) {
+        std::vector<std::thread> threads;
+        std::vector<char> passed(sessions, 0);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < sessions; ++i) {
+            threads.emplace_back([&passed, i, calls]() { passed[i] = RunSession(calls); });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < sessions; ++i) {
+            if (!passed[i]) {
+                fprintf(stderr, "session %zu of %zu returned a wrong result\n", i, sessions);
+                return 1;
+            }
+        }
+        double throughput = sessions * calls / seconds;
+        if (sessions == 1) {
+            single_throughput = throughput;
+        }
+        printf("%zu,%.3f,%.0f,%.2f\n", sessions, seconds, throughput, throughput / single_throughput);
+    }
+
+    return 0;
+}
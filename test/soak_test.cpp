@@ -0,0 +1,106 @@
+#include "../src/codegen.h"
+#include "../src/parser.h"
+#include "../src/lexer.h"
+#include "../src/output.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+
+static const char* definitions =
+    "def poly(x a b)\n"
+    "    a * x * x + b * x\n"
+    "end\n"
+    "def clamp(x low high)\n"
+    "    if x < low then low else if x > high then high else x end end\n"
+    "end\n";
+
+// peak resident memory of the process in KiB
+static long PeakRssKiB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// compile and run code, as the console does
+static void Run(const std::string& code) {
+    SetLexerInput(code);
+    GetNextToken();
+    while (g_current_token != TOKEN_EOF) {
+        switch (g_current_token) {
+            case TOKEN_END: GetNextToken(); break;
+            case TOKEN_DEF: ParseDefinitionToken(); break;
+            case TOKEN_EXTERN: ParseExternToken(); break;
+            default: ParseTopLevel(); break;
+        }
+    }
+}
+
+// a top level expression with literals no other item has, as typed into a REPL over weeks
+static std::string Item(size_t i) {
+    char code[256];
+    snprintf(code, sizeof(code), "clamp(poly(%zu.%03zu, %zu.25, 0.%zu), -%zu.5, %zu.75) + %zu.0625 * 3.5\n",
+             i % 1000, i % 997, i, i + 1, i + 2, i * 3, i * 7);
+    return code;
+}
+
+// usage: soak_test.app [--items <n>] [--context-modules <n>] [--max-growth <KiB>]
+// compiles and runs `--items` (20000) top level expressions, each with constants of its own, and checks that the
+// peak resident memory stops growing: it may grow by at most `--max-growth` KiB (2048) over the last three quarters
+// of the items, once the allocator and the JIT's slabs have warmed up
+// `--context-modules <n>` sets g_context_recycle_modules, 0 keeps a single LLVMContext to show the growth it causes
+// exit status: 0 if the memory stayed flat, 1 if it grew
+int main(int argc, char* argv[]) {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    size_t items = 20000;
+    long max_growth = 2048;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--items") == 0 && i + 1 < argc) {
+            items = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--context-modules") == 0 && i + 1 < argc) {
+            g_context_recycle_modules = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--max-growth") == 0 && i + 1 < argc) {
+            max_growth = strtol(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    g_enable_ir_print = false;
+    g_enable_result_print = false;
+    g_jit.reset(new llvm::orc::KaleidoscopeJIT);
+    ReCreateModule();
+    Run(definitions);
+
+    long warm_rss = 0;
+    for (size_t i = 0; i < items; ++i) {
+        Run(Item(i));
+        if ((i + 1) % (items / 10 > 0 ? items / 10 : 1) == 0) {
+            printf("%zu items: peak rss %ld KiB, %llu contexts recycled\n", i + 1, PeakRssKiB(),
+                   (unsigned long long) GetRecycledContextCount());
+            fflush(stdout);
+        }
+        if (i + 1 == items / 4) {
+            warm_rss = PeakRssKiB();
+        }
+    }
+    FlushOutput();
+
+    long growth = PeakRssKiB() - warm_rss;
+    printf("grew by %ld KiB over the last %zu items (limit %ld KiB)\n", growth, items - items / 4, max_growth);
+    if (growth > max_growth) {
+        fflush(stdout);
+        fprintf(stderr, "FAILED: memory keeps growing with the items compiled\n");
+        return 1;
+    }
+    return 0;
+}